@@ -0,0 +1,381 @@
+//
+// Created by zhangshiping on 26-10-17.
+//
+#include "bench_util.h"
+#include "memory_pool.h"
+#include "object_pool.h"
+#include "skip_list.h"
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace GameTools;
+
+#if !ENABLE_MEMORY_POOL_HEADERLESS
+static const char* POOL_NAME="pool_header";
+#elif !ENABLE_MEMORY_POOL_STATS
+static const char* POOL_NAME="pool_nostats";
+#elif ENABLE_MEMORY_POOL_THREAD_CACHE
+static const char* POOL_NAME="pool_thread_cache";
+#else
+static const char* POOL_NAME="pool_locked";
+#endif
+
+///threads个线程各自反复申请一批混合大小(16~512字节)的块再全部归还，每个线程ops次申请+归还
+///  另有1/4的块交给下一个线程归还，模拟消息在线程间传递
+template<class Alloc,class Free>
+static void BenchContention(const std::string& name,uint32_t threads,uint64_t ops,Alloc&& alloc,Free&& free_fn){
+    const uint64_t batch=64;
+    std::vector<std::vector<char*>> handoff(threads);
+    std::vector<std::mutex> handoff_mutex(threads);
+    Bench::Print(Bench::Measure(name+"/threads="+std::to_string(threads),ops*threads,[&]{
+        std::vector<std::thread> workers;
+        for(uint32_t t=0;t<threads;t++){
+            workers.emplace_back([&,t]{
+                std::mt19937 gen(t+1);
+                std::vector<char*> blocks(batch);
+                std::vector<char*> passed;
+                for(uint64_t done=0;done<ops;done+=batch){
+                    for(auto& block:blocks){
+                        block=alloc(16+gen()%497);
+                        block[0]=1;
+                    }
+                    passed.clear();
+                    for(uint64_t i=0;i<batch;i++){
+                        if(threads>1&&i%4==0) passed.push_back(blocks[i]);
+                        else free_fn(blocks[i]);
+                    }
+                    if(!passed.empty()){
+                        std::lock_guard<std::mutex> lock(handoff_mutex[(t+1)%threads]);
+                        auto& box=handoff[(t+1)%threads];
+                        box.insert(box.end(),passed.begin(),passed.end());
+                    }
+                    std::vector<char*> received;
+                    {
+                        std::lock_guard<std::mutex> lock(handoff_mutex[t]);
+                        received.swap(handoff[t]);
+                    }
+                    for(auto block:received) free_fn(block);
+                }
+            });
+        }
+        for(auto& worker:workers) worker.join();
+    }));
+    for(auto& box:handoff){
+        for(auto block:box) free_fn(block);
+    }
+}
+
+///线上的大小分布：80%在16~256字节，15%在256~4K，5%在4K~64K
+static std::size_t MixedSize(std::mt19937& gen){
+    uint32_t bucket=gen()%100;
+    if(bucket<80) return 16+gen()%241;
+    if(bucket<95) return 256+gen()%3841;
+    return 4096+gen()%61441;
+}
+
+///单线程混合大小的翻动：live个槽位，每次随机挑一个槽位，有块就归还，再申请一个新大小的块并写第一个字节
+///  逐个计时，p99里是找系统要新slab/新内存的那些操作
+template<class Alloc,class Free>
+static void BenchChurn(const std::string& name,uint64_t ops,uint64_t live,Alloc&& alloc,Free&& free_fn){
+    std::mt19937 gen(17);
+    std::vector<std::pair<char*,std::size_t>> slots(live,{nullptr,0});
+    Bench::Print(Bench::MeasureLatency(name,ops,[&](uint64_t){
+        auto& slot=slots[gen()%live];
+        if(slot.first) free_fn(slot.first,slot.second);
+        slot.second=MixedSize(gen);
+        slot.first=alloc(slot.second);
+        slot.first[0]=1;
+    }));
+    for(auto& slot:slots){
+        if(slot.first) free_fn(slot.first,slot.second);
+    }
+}
+
+///生产者/消费者：producers个线程申请混合大小的块(消息)，每64个一批放进队列，consumers个线程取出来归还
+///  每个块都在另一个线程归还；ops是总块数
+template<class Alloc,class Free>
+static void BenchProducerConsumer(const std::string& name,uint32_t producers,uint32_t consumers,uint64_t ops,Alloc&& alloc,Free&& free_fn){
+    const uint64_t batch=64;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::vector<std::vector<char*>> queue;
+    uint32_t producing=producers;
+    Bench::Print(Bench::Measure(name+"/producers="+std::to_string(producers)+" consumers="+std::to_string(consumers),ops,[&]{
+        std::vector<std::thread> threads;
+        for(uint32_t p=0;p<producers;p++){
+            threads.emplace_back([&,p]{
+                std::mt19937 gen(p+1);
+                for(uint64_t done=0;done<ops/producers;done+=batch){
+                    std::vector<char*> blocks(batch);
+                    for(auto& block:blocks){
+                        block=alloc(MixedSize(gen));
+                        block[0]=1;
+                    }
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        queue.push_back(std::move(blocks));
+                    }
+                    cond.notify_one();
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    producing--;
+                }
+                cond.notify_all();
+            });
+        }
+        for(uint32_t c=0;c<consumers;c++){
+            threads.emplace_back([&]{
+                while(true){
+                    std::vector<char*> blocks;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        cond.wait(lock,[&]{ return !queue.empty()||producing==0; });
+                        if(queue.empty()) return;
+                        blocks.swap(queue.back());
+                        queue.pop_back();
+                    }
+                    for(auto block:blocks) free_fn(block);
+                }
+            });
+        }
+        for(auto& thread:threads) thread.join();
+    }));
+}
+
+///单线程申请n个48字节的块并写入，再按申请顺序读一遍，最后全部归还
+///  块来自同一个slab时挨着放，顺序读是连续内存
+template<class Alloc,class Free>
+static void BenchLocality(const std::string& name,uint64_t n,Alloc&& alloc,Free&& free_fn){
+    std::vector<char*> blocks(n);
+    Bench::Print(Bench::Measure(name+"/alloc_and_write",n,[&]{
+        for(uint64_t i=0;i<n;i++){
+            blocks[i]=alloc(48);
+            std::memset(blocks[i],static_cast<int>(i),48);
+        }
+    }));
+    uint64_t sum=0;
+    Bench::Print(Bench::Measure(name+"/scan",n,[&]{
+        for(uint64_t i=0;i<n;i++) sum+=static_cast<unsigned char>(blocks[i][40]);
+    }));
+    Bench::Print(Bench::Measure(name+"/free",n,[&]{
+        for(uint64_t i=0;i<n;i++) free_fn(blocks[i]);
+    }));
+    if(sum==1) std::printf("\n");
+}
+
+///随机大小(16~512字节)的块实际占用/申请的字节数：4字节头部+2的幂分级 vs 当前头部+MemorySizeClass分级；以及GetMemory<N>和GetMemory(N)的耗时
+static void BenchSizeClass(uint64_t n){
+    std::mt19937 gen(5);
+    uint64_t requested=0,power_of_two=0,classed=0;
+    for(uint64_t i=0;i<n;i++){
+        std::size_t size=16+gen()%497;
+        std::size_t with_header=size+sizeof(uint32_t);
+        std::size_t pow2=8;
+        while(pow2<with_header) pow2<<=1;
+        requested+=size;
+        power_of_two+=pow2;
+        classed+=MemorySizeClass::Size(MemorySizeClass::Index(size+MemoryPool::HEADER_SIZE));
+    }
+    Bench::Note("sizeclass/power_of_two",static_cast<double>(power_of_two)/static_cast<double>(requested),"block bytes/requested byte");
+    Bench::Note("sizeclass/four_per_doubling",static_cast<double>(classed)/static_cast<double>(requested),"block bytes/requested byte");
+    auto* pool=MemPoolManager;
+    std::vector<char*> blocks(64);
+    Bench::Print(Bench::Measure("sizeclass/GetMemory(60)",n,[&]{
+        for(uint64_t i=0;i<n;i+=64){
+            for(auto& block:blocks) block=pool->GetMemory(60);
+            for(auto block:blocks) pool->GiveBack(block);
+        }
+    }));
+    Bench::Print(Bench::Measure("sizeclass/GetMemory<60>()",n,[&]{
+        for(uint64_t i=0;i<n;i+=64){
+            for(auto& block:blocks) block=pool->GetMemory<60>();
+            for(auto block:blocks) pool->GiveBack(block);
+        }
+    }));
+}
+
+///n次申请+归还48字节的块：GiveBack(p)和GiveBack(p,size)；以及64字节对齐的申请
+static void BenchHeaderless(uint64_t n){
+    auto* pool=MemPoolManager;
+    Bench::Note("headerless/block_for_48_bytes",static_cast<double>(MemorySizeClass::Size(MemorySizeClass::Index(48+MemoryPool::HEADER_SIZE))),"bytes");
+    std::vector<char*> blocks(64);
+    uint64_t misaligned=0;
+    Bench::Print(Bench::Measure(std::string("headerless/")+POOL_NAME+"/GiveBack(p)",n,[&]{
+        for(uint64_t i=0;i<n;i+=64){
+            for(auto& block:blocks) block=pool->GetMemory(48);
+            for(auto block:blocks) pool->GiveBack(block);
+        }
+    }));
+    Bench::Print(Bench::Measure(std::string("headerless/")+POOL_NAME+"/GiveBack(p,size)",n,[&]{
+        for(uint64_t i=0;i<n;i+=64){
+            for(auto& block:blocks) block=pool->GetMemory(48);
+            for(auto block:blocks) pool->GiveBack(block,48);
+        }
+    }));
+    Bench::Print(Bench::Measure(std::string("headerless/")+POOL_NAME+"/GetMemory(100,64)",n,[&]{
+        for(uint64_t i=0;i<n;i+=64){
+            for(auto& block:blocks){
+                block=pool->GetMemory(100,64);
+                misaligned+=reinterpret_cast<uintptr_t>(block)%64!=0;
+            }
+            for(auto block:blocks) pool->GiveBack(block,100,64);
+        }
+    }));
+    for(auto& block:blocks){
+        block=pool->GetMemory(100);
+        misaligned+=reinterpret_cast<uintptr_t>(block)%16!=0&&MemoryPool::HEADER_SIZE==0;
+    }
+    for(auto block:blocks) pool->GiveBack(block);
+    Bench::Note("headerless/misaligned",static_cast<double>(misaligned),"blocks");
+}
+
+///计数的开销：n次带标签申请+归还48字节的块(和bench_memory_pool_nostats的同名项对比)，以及一次Stats汇总
+static void BenchStats(uint64_t n){
+    auto* pool=MemPoolManager;
+    uint16_t tag=pool->RegisterTag("bench");
+    std::vector<char*> blocks(64);
+    Bench::Print(Bench::Measure(std::string("stats/")+POOL_NAME+"/tagged_alloc_free",n,[&]{
+        for(uint64_t i=0;i<n;i+=64){
+            for(auto& block:blocks) block=pool->GetMemory(48,0,tag);
+            for(auto block:blocks) pool->GiveBack(block,48,0,tag);
+        }
+    }));
+    MemoryPoolStats stats;
+    Bench::Print(Bench::Measure(std::string("stats/")+POOL_NAME+"/Stats()",1000,[&]{
+        for(int i=0;i<1000;i++) stats=pool->Stats();
+    }));
+    Bench::Note("stats/snapshot/classes",static_cast<double>(stats.classes.size()),"classes");
+}
+
+///新建的内存池第一次申请n个size字节的块并写入：冷启动时要申请slab、缺页，Reserve预热过的直接从空闲链取
+static void BenchPrewarm(uint64_t n,std::size_t size){
+    for(int warm=0;warm<2;warm++){
+        MemoryPool pool;
+        std::vector<char*> blocks(n);
+        if(warm){
+            Bench::Print(Bench::Measure(std::string("prewarm/")+POOL_NAME+"/Reserve",n,[&]{
+                pool.Reserve(size,n);
+            }));
+        }
+        Bench::Print(Bench::Measure(std::string("prewarm/")+POOL_NAME+(warm?"/first_alloc_warm":"/first_alloc_cold"),n,[&]{
+            for(auto& block:blocks){
+                block=pool.GetMemory(size);
+                std::memset(block,1,size);
+            }
+        }));
+        for(auto block:blocks) pool.GiveBack(block,size);
+    }
+}
+
+///容器用std::allocator和PoolAllocator：unordered_map在n个key上随机插入/删除，list队列进出，RankSkipList随机更新分数
+///  RankSkipList的节点slab和rank_map_都来自内存池时，allocs/op(全局operator new次数)为0
+template<template<class> class Alloc>
+static void BenchContainers(const std::string& name,uint64_t n){
+    std::mt19937_64 gen(9);
+    {
+        std::unordered_map<int64_t,int64_t,std::hash<int64_t>,std::equal_to<int64_t>,Alloc<std::pair<const int64_t,int64_t>>> map;
+        Bench::Print(Bench::Measure("allocator/unordered_map/"+name,n,[&]{
+            for(uint64_t i=0;i<n;i++){
+                auto key=static_cast<int64_t>(gen()%(n/4));
+                if(i&1) map.erase(key);
+                else map[key]=static_cast<int64_t>(i);
+            }
+        }));
+    }
+    {
+        std::list<int64_t,Alloc<int64_t>> queue;
+        Bench::Print(Bench::Measure("allocator/list/"+name,n,[&]{
+            for(uint64_t i=0;i<n;i++){
+                queue.push_back(static_cast<int64_t>(i));
+                if(queue.size()>1000) queue.pop_front();
+            }
+        }));
+    }
+    {
+        RankSkipList<int64_t,int64_t,std::hash<int64_t>,SkipListPolicy<32,1,Alloc<char>>> list(0,1);
+        Bench::Print(Bench::Measure("allocator/rank_skip_list/"+name,n,[&]{
+            for(uint64_t i=0;i<n;i++){
+                list.InsertOrUpdate(static_cast<int64_t>(gen()%1000000),static_cast<int64_t>(gen()%(n/4)));
+            }
+        }));
+        Bench::Print(Bench::Measure("allocator/rank_skip_list/"+name+"/destroy",1,[&]{
+            list.Clear();
+        }));
+    }
+}
+
+int main(int argc,char** argv){
+    const char* which=Bench::ParseArgs(argc,argv);
+    auto enabled=[&](const char* name){ return std::strcmp(which,"all")==0||std::strcmp(which,name)==0; };
+    Bench::PrintHeader();
+    const uint64_t ops=200000;
+    const uint32_t thread_counts[]={1,2,4,8,16,32,64};
+    if(enabled("malloc")){
+        for(uint32_t threads:thread_counts){
+            BenchContention("contention/malloc",threads,ops,[](std::size_t size){
+                return static_cast<char*>(std::malloc(size));
+            },[](char* p){ std::free(p); });
+        }
+    }
+    if(enabled("locality")){
+        BenchLocality("locality/new",1000000,[](std::size_t size){ return new char[size]; },[](char* p){ delete[] p; });
+        auto* pool=MemPoolManager;
+        BenchLocality(std::string("locality/")+POOL_NAME,1000000,[&](std::size_t size){
+            return pool->GetMemory(size);
+        },[&](char* p){ pool->GiveBack(p); });
+    }
+    if(enabled("sizeclass")){
+        BenchSizeClass(1000000);
+    }
+    if(enabled("headerless")){
+        BenchHeaderless(1000000);
+    }
+    if(enabled("churn")){
+        BenchChurn("churn/malloc",1000000,10000,[](std::size_t size){
+            return static_cast<char*>(std::malloc(size));
+        },[](char* p,std::size_t){ std::free(p); });
+        auto* pool=MemPoolManager;
+        BenchChurn(std::string("churn/")+POOL_NAME,1000000,10000,[&](std::size_t size){
+            return pool->GetMemory(size);
+        },[&](char* p,std::size_t size){ pool->GiveBack(p,size); });
+    }
+    if(enabled("prodcons")){
+        auto* pool=MemPoolManager;
+        for(uint32_t threads:{1u,2u,4u}){
+            BenchProducerConsumer("prodcons/malloc",threads,threads,1000000,[](std::size_t size){
+                return static_cast<char*>(std::malloc(size));
+            },[](char* p){ std::free(p); });
+            BenchProducerConsumer(std::string("prodcons/")+POOL_NAME,threads,threads,1000000,[&](std::size_t size){
+                return pool->GetMemory(size);
+            },[&](char* p){ pool->GiveBack(p); });
+        }
+    }
+    if(enabled("stats")){
+        BenchStats(1000000);
+    }
+    if(enabled("prewarm")){
+        BenchPrewarm(100000,1000);
+    }
+    if(enabled("allocator")){
+        BenchContainers<std::allocator>("std",1000000);
+        BenchContainers<PoolAllocator>(POOL_NAME,1000000);
+    }
+    if(enabled("pool")){
+        auto* pool=MemPoolManager;
+        for(uint32_t threads:thread_counts){
+            BenchContention(std::string("contention/")+POOL_NAME,threads,ops,[&](std::size_t size){
+                return pool->GetMemory(size);
+            },[&](char* p){ pool->GiveBack(p); });
+        }
+    }
+}
@@ -0,0 +1,691 @@
+//
+// Created by zhangshiping on 26-10-17.
+//
+#include "bench_util.h"
+#include "skip_list.h"
+#include "concurrent_skip_list.h"
+#include "sharded_rank_list.h"
+#include "skip_list_snapshot.h"
+#include "leaderboard_registry.h"
+#include "windowed_rank_list.h"
+#include "rank_btree.h"
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace GameTools;
+
+///节点布局：插入、改分、删除各自的分配次数与cache miss
+static void BenchLayout(uint64_t n){
+    std::mt19937_64 gen(42);
+    std::vector<int64_t> scores(n);
+    for(auto& s:scores) s=static_cast<int64_t>(gen()%1000000);
+
+    auto* list=new RankSkipList<int64_t,int64_t>(0,42);
+    Bench::Print(Bench::Measure("layout/insert n="+std::to_string(n),n,[&]{
+        for(uint64_t i=0;i<n;i++) list->InsertOrUpdate(scores[i],static_cast<int64_t>(i));
+    }));
+    Bench::Print(Bench::Measure("layout/update n="+std::to_string(n),n,[&]{
+        for(uint64_t i=0;i<n;i++){
+            auto val=static_cast<int64_t>(gen()%n);
+            list->InsertOrUpdate(*list->getKey(val)+static_cast<int64_t>(gen()%1000)+1,val);
+        }
+    }));
+    Bench::Print(Bench::Measure("layout/rank n="+std::to_string(n),n,[&]{
+        int64_t sum=0;
+        for(uint64_t i=0;i<n;i++) sum+=list->Rank(static_cast<int64_t>(gen()%n));
+        if(sum==0) std::printf("\n");
+    }));
+    Bench::Print(Bench::Measure("layout/delete n="+std::to_string(n),n,[&]{
+        for(uint64_t i=0;i<n;i++) list->DeleteNode(static_cast<int64_t>(i));
+    }));
+    delete list;
+}
+
+///冷启动建表：逐个InsertOrUpdate vs Build(无序) vs BuildFromSorted(有序)
+static void BenchBulk(uint64_t n){
+    std::mt19937_64 gen(7);
+    std::vector<std::pair<int64_t,int64_t>> items(n);
+    for(uint64_t i=0;i<n;i++) items[i]={static_cast<int64_t>(gen()%100000000),static_cast<int64_t>(i)};
+    {
+        RankSkipList<int64_t,int64_t> list(0,42);
+        Bench::Print(Bench::Measure("bulk/incremental n="+std::to_string(n),n,[&]{
+            for(auto& item:items) list.InsertOrUpdate(item.first,item.second);
+        }));
+    }
+    {
+        RankSkipList<int64_t,int64_t> list(0,42);
+        Bench::Print(Bench::Measure("bulk/build n="+std::to_string(n),n,[&]{
+            list.Build(items.begin(),items.end());
+        }));
+    }
+    std::sort(items.begin(),items.end(),[](const std::pair<int64_t,int64_t>& a,const std::pair<int64_t,int64_t>& b){
+        return a.first>b.first||(a.first==b.first&&a.second>b.second);
+    });
+    {
+        RankSkipList<int64_t,int64_t> list(0,42);
+        Bench::Print(Bench::Measure("bulk/build_sorted n="+std::to_string(n),n,[&]{
+            list.BuildFromSorted(items.begin(),items.end());
+        }));
+    }
+}
+
+///翻页查询：逐个getNodeByRank vs ForEachByRank
+static void BenchPage(uint64_t n,uint64_t page_size){
+    std::mt19937_64 gen(9);
+    RankSkipList<int64_t,int64_t> list(0,42);
+    for(uint64_t i=0;i<n;i++) list.InsertOrUpdate(static_cast<int64_t>(gen()%100000000),static_cast<int64_t>(i));
+    const uint64_t pages=2000;
+    int64_t sum=0;
+    Bench::Print(Bench::Measure("page/getNodeByRank n="+std::to_string(n),pages*page_size,[&]{
+        for(uint64_t p=0;p<pages;p++){
+            uint64_t start=1+(gen()%(n/page_size))*page_size;
+            for(uint64_t r=start;r<start+page_size;r++) sum+=list.getNodeByRank(r)->value;
+        }
+    }));
+    Bench::Print(Bench::Measure("page/ForEachByRank n="+std::to_string(n),pages*page_size,[&]{
+        for(uint64_t p=0;p<pages;p++){
+            uint64_t start=1+(gen()%(n/page_size))*page_size;
+            list.ForEachByRank(start,start+page_size-1,[&](const SkipListNode<int64_t,int64_t>& node){
+                sum+=node.value;
+            });
+        }
+    }));
+    if(sum==0) std::printf("\n");
+}
+
+///"我附近的玩家"：Rank+逐个getNodeByRank vs getAroundRank
+static void BenchAround(uint64_t n,uint64_t window){
+    std::mt19937_64 gen(11);
+    RankSkipList<int64_t,int64_t> list(0,42);
+    for(uint64_t i=0;i<n;i++) list.InsertOrUpdate(static_cast<int64_t>(gen()%100000000),static_cast<int64_t>(i));
+    const uint64_t queries=100000;
+    int64_t sum=0;
+    Bench::Print(Bench::Measure("around/getNodeByRank n="+std::to_string(n),queries,[&]{
+        for(uint64_t q=0;q<queries;q++){
+            int64_t rank=list.Rank(static_cast<int64_t>(gen()%n));
+            uint64_t lo=rank>static_cast<int64_t>(window)?rank-window:1;
+            for(uint64_t r=lo;r<=rank+window&&r<=list.length();r++) sum+=list.getNodeByRank(r)->value;
+        }
+    }));
+    std::vector<const SkipListNode<int64_t,int64_t>*> buffer(2*window+1);
+    Bench::Print(Bench::Measure("around/getAroundRank n="+std::to_string(n),queries,[&]{
+        for(uint64_t q=0;q<queries;q++){
+            uint64_t count=0,first_rank=0;
+            list.getAroundRank(static_cast<int64_t>(gen()%n),window,buffer.data(),count,first_rank);
+            for(uint64_t i=0;i<count;i++) sum+=buffer[i]->value;
+        }
+    }));
+    if(sum==0) std::printf("\n");
+}
+
+///批量改分：逐个InsertOrUpdate vs ApplyBatch，批大小1/64/1k/64k
+static void BenchBatch(uint64_t n){
+    std::mt19937_64 gen(13);
+    std::vector<std::pair<int64_t,int64_t>> items(n);
+    for(uint64_t i=0;i<n;i++) items[i]={static_cast<int64_t>(gen()%100000000),static_cast<int64_t>(i)};
+    const uint64_t total=1<<16;
+    for(uint64_t batch:{1ULL,64ULL,1024ULL,65536ULL}){
+        std::vector<SkipListBatchOp<int64_t,int64_t>> ops(total);
+        for(auto& op:ops){
+            op.value=static_cast<int64_t>(gen()%n);
+            op.key=items[op.value].first+static_cast<int64_t>(gen()%10000);
+        }
+        {
+            RankSkipList<int64_t,int64_t> list(0,42);
+            list.Build(items.begin(),items.end());
+            Bench::Print(Bench::Measure("batch/one_by_one batch="+std::to_string(batch),total,[&]{
+                for(auto& op:ops) list.InsertOrUpdate(op.key,op.value);
+            }));
+        }
+        {
+            RankSkipList<int64_t,int64_t> list(0,42);
+            list.Build(items.begin(),items.end());
+            Bench::Print(Bench::Measure("batch/ApplyBatch batch="+std::to_string(batch),total,[&]{
+                for(uint64_t i=0;i<total;i+=batch) list.ApplyBatch(ops.data()+i,batch);
+            }));
+        }
+    }
+}
+
+///"分数X能排第几"：逐个扫描第0层 vs RankByKey，以及CountInKeyRange、KeyAtPercentile
+static void BenchScore(uint64_t n){
+    std::mt19937_64 gen(19);
+    RankSkipList<int64_t,int64_t> list(0,42);
+    for(uint64_t i=0;i<n;i++) list.InsertOrUpdate(static_cast<int64_t>(gen()%100000000),static_cast<int64_t>(i));
+    uint64_t sum=0;
+    const uint64_t scans=100;
+    Bench::Print(Bench::Measure("score/scan n="+std::to_string(n),scans,[&]{
+        for(uint64_t q=0;q<scans;q++){
+            auto key=static_cast<int64_t>(gen()%100000000);
+            uint64_t rank=1;
+            for(auto it=list.begin();it!=list.end()&&it->key>key;++it) rank++;
+            sum+=rank;
+        }
+    }));
+    const uint64_t queries=1000000;
+    Bench::Print(Bench::Measure("score/RankByKey n="+std::to_string(n),queries,[&]{
+        for(uint64_t q=0;q<queries;q++) sum+=list.RankByKey(static_cast<int64_t>(gen()%100000000));
+    }));
+    Bench::Print(Bench::Measure("score/CountInKeyRange n="+std::to_string(n),queries,[&]{
+        for(uint64_t q=0;q<queries;q++){
+            auto lo=static_cast<int64_t>(gen()%100000000);
+            sum+=list.CountInKeyRange(lo,lo+1000000);
+        }
+    }));
+    Bench::Print(Bench::Measure("score/KeyAtPercentile n="+std::to_string(n),queries,[&]{
+        for(uint64_t q=0;q<queries;q++) sum+=*list.KeyAtPercentile(static_cast<double>(gen()%10001)/100);
+    }));
+    if(sum==0) std::printf("\n");
+}
+
+///rank_map_：std::unordered_map vs FlatHashMap，每个元素占用的字节数和查找耗时
+template<class Map>
+static void BenchIndexOne(const std::string& name,uint64_t n){
+    std::mt19937_64 gen(17);
+    std::vector<int64_t> keys(n);
+    for(auto& k:keys) k=static_cast<int64_t>(gen());
+    int64_t bytes=Bench::LiveBytes().load();
+    auto* map=new Map();
+    Bench::Print(Bench::Measure("index/"+name+"/emplace n="+std::to_string(n),n,[&]{
+        for(auto k:keys) map->emplace(k,nullptr);
+    }));
+    Bench::Note("index/"+name+"/memory",static_cast<double>(Bench::LiveBytes().load()-bytes)/static_cast<double>(n),"bytes/entry");
+    uint64_t found=0;
+    Bench::Print(Bench::Measure("index/"+name+"/find n="+std::to_string(n),n,[&]{
+        for(uint64_t i=0;i<n;i++) found+=map->find(keys[gen()%n])!=map->end();
+    }));
+    if(found!=n) std::printf("\n");
+    delete map;
+}
+
+static void BenchIndex(uint64_t n){
+    BenchIndexOne<std::unordered_map<int64_t,void*>>("unordered_map",n);
+    BenchIndexOne<FlatHashMap<int64_t,void*>>("FlatHashMap",n);
+}
+
+///每个排行榜一把互斥锁的做法，作为并发版本的对照
+class MutexRankList{
+public:
+    explicit MutexRankList(uint64_t seed):list_(0,seed){}
+    bool InsertOrUpdate(int64_t key,int64_t val){
+        std::lock_guard<std::mutex> lock(mutex_);
+        return list_.InsertOrUpdate(key,val)!= nullptr;
+    }
+    int64_t Rank(int64_t val){
+        std::lock_guard<std::mutex> lock(mutex_);
+        return list_.Rank(val);
+    }
+    uint64_t CopyByRank(uint64_t start,uint64_t end,ConcurrentSkipListEntry<int64_t,int64_t>* buffer){
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t count=0;
+        list_.ForEachByRank(start,end,[&](const SkipListNode<int64_t,int64_t>& node){
+            buffer[count].key=node.key;
+            buffer[count].value=node.value;
+            count++;
+        });
+        return count;
+    }
+private:
+    std::mutex mutex_;
+    RankSkipList<int64_t,int64_t> list_;
+};
+
+///读多写少：readers个读线程做Rank(每8次夹一次10条的翻页)，1个写线程按读次数的1/50改分，固定时长统计读吞吐
+template<class List>
+static void BenchConcurrentOne(const std::string& name,List& list,uint64_t n,uint32_t readers){
+    const auto duration=std::chrono::milliseconds(300);
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> reads{0};
+    std::vector<std::thread> threads;
+    for(uint32_t t=0;t<readers;t++){
+        threads.emplace_back([&,t]{
+            std::mt19937_64 gen(100+t);
+            ConcurrentSkipListEntry<int64_t,int64_t> buffer[10];
+            uint64_t local=0;
+            int64_t sum=0;
+            while(!stop.load(std::memory_order_relaxed)){
+                if((local&7)==7){
+                    uint64_t start=1+gen()%(n-10);
+                    sum+=static_cast<int64_t>(list.CopyByRank(start,start+9,buffer));
+                }
+                else sum+=list.Rank(static_cast<int64_t>(gen()%n));
+                local++;
+                if((local&63)==0) reads.fetch_add(64,std::memory_order_relaxed);
+            }
+            if(sum==0) std::printf("\n");
+        });
+    }
+    uint64_t writes=0;
+    std::thread writer([&]{
+        std::mt19937_64 gen(99);
+        while(!stop.load(std::memory_order_relaxed)){
+            if(writes*50>=reads.load(std::memory_order_relaxed)){
+                std::this_thread::yield();
+                continue;
+            }
+            list.InsertOrUpdate(static_cast<int64_t>(gen()%100000000),static_cast<int64_t>(gen()%n));
+            writes++;
+        }
+    });
+    Bench::Timer timer;
+    std::this_thread::sleep_for(duration);
+    stop.store(true);
+    double ns=timer.ElapsedNs();
+    writer.join();
+    for(auto& thread:threads) thread.join();
+    uint64_t total=reads.load();
+    Bench::Sample sample;
+    sample.name="concurrent/"+name+" readers="+std::to_string(readers);
+    sample.ops=total;
+    sample.ns=ns;
+    sample.rss_kb=Bench::ResidentKB();
+    Bench::Print(sample);
+    Bench::Note(sample.name+"/writes",static_cast<double>(writes),"writes");
+}
+
+static void BenchConcurrent(uint64_t n){
+    std::mt19937_64 gen(21);
+    MutexRankList mutex_list(42);
+    ConcurrentRankSkipList<int64_t,int64_t> concurrent_list(0,42);
+    for(uint64_t i=0;i<n;i++){
+        auto key=static_cast<int64_t>(gen()%100000000);
+        mutex_list.InsertOrUpdate(key,static_cast<int64_t>(i));
+        concurrent_list.InsertOrUpdate(key,static_cast<int64_t>(i));
+    }
+    for(uint32_t readers:{1u,2u,4u,8u,16u,32u,64u}){
+        BenchConcurrentOne("mutex",mutex_list,n,readers);
+        BenchConcurrentOne("lock_free_read",concurrent_list,n,readers);
+    }
+}
+
+///分片排行榜：分片数1..16，改分吞吐(写线程数=分片数)、全局Rank、前100名、随机翻页的耗时，对照单个RankSkipList
+static void BenchSharded(uint64_t n){
+    std::mt19937_64 gen(23);
+    std::vector<int64_t> keys(n);
+    for(auto& key:keys) key=static_cast<int64_t>(gen()%100000000);
+    const uint64_t updates=400000;
+    {
+        RankSkipList<int64_t,int64_t> list(0,42);
+        for(uint64_t i=0;i<n;i++) list.InsertOrUpdate(keys[i],static_cast<int64_t>(i));
+        Bench::Print(Bench::Measure("sharded/single_list/update",updates,[&]{
+            for(uint64_t i=0;i<updates;i++){
+                list.InsertOrUpdate(static_cast<int64_t>(gen()%100000000),static_cast<int64_t>(gen()%n));
+            }
+        }));
+        int64_t sum=0;
+        Bench::Print(Bench::Measure("sharded/single_list/Rank",100000,[&]{
+            for(uint64_t i=0;i<100000;i++) sum+=list.Rank(static_cast<int64_t>(gen()%n));
+        }));
+        Bench::Print(Bench::Measure("sharded/single_list/top100",10000,[&]{
+            for(uint64_t i=0;i<10000;i++){
+                list.ForEachByRank(1,100,[&](const SkipListNode<int64_t,int64_t>& node){ sum+=node.value; });
+            }
+        }));
+        Bench::Print(Bench::Measure("sharded/single_list/page100",10000,[&]{
+            for(uint64_t i=0;i<10000;i++){
+                uint64_t start=1+gen()%(n-100);
+                list.ForEachByRank(start,start+99,[&](const SkipListNode<int64_t,int64_t>& node){ sum+=node.value; });
+            }
+        }));
+        if(sum==0) std::printf("\n");
+    }
+    for(uint32_t shards:{1u,2u,4u,8u,16u}){
+        ShardedRankList<int64_t,int64_t> list(shards,42);
+        for(uint64_t i=0;i<n;i++) list.InsertOrUpdate(keys[i],static_cast<int64_t>(i));
+        std::string prefix="sharded/shards="+std::to_string(shards)+"/";
+        Bench::Print(Bench::Measure(prefix+"update",updates,[&]{
+            std::vector<std::thread> threads;
+            for(uint32_t t=0;t<shards;t++){
+                threads.emplace_back([&,t]{
+                    std::mt19937_64 local(1000+t);
+                    for(uint64_t i=0;i<updates/shards;i++){
+                        list.InsertOrUpdate(static_cast<int64_t>(local()%100000000),static_cast<int64_t>(local()%n));
+                    }
+                });
+            }
+            for(auto& thread:threads) thread.join();
+        }));
+        int64_t sum=0;
+        Bench::Print(Bench::Measure(prefix+"Rank",100000,[&]{
+            for(uint64_t i=0;i<100000;i++) sum+=list.Rank(static_cast<int64_t>(gen()%n));
+        }));
+        Bench::Print(Bench::Measure(prefix+"top100",10000,[&]{
+            for(uint64_t i=0;i<10000;i++){
+                list.ForEachTop(100,[&](const SkipListNode<int64_t,int64_t>& node){ sum+=node.value; });
+            }
+        }));
+        Bench::Print(Bench::Measure(prefix+"page100",10000,[&]{
+            for(uint64_t i=0;i<10000;i++){
+                uint64_t start=1+gen()%(n-100);
+                list.ForEachByRank(start,start+99,[&](const SkipListNode<int64_t,int64_t>& node){ sum+=node.value; });
+            }
+        }));
+        if(sum==0) std::printf("\n");
+    }
+}
+
+///快照：保存、mmap加载建表 vs 逐个InsertOrUpdate重放，冻结榜直接在映射上查询
+static void BenchSnapshot(uint64_t n){
+    std::mt19937_64 gen(29);
+    std::vector<std::pair<int64_t,int64_t>> items(n);
+    for(uint64_t i=0;i<n;i++) items[i]={static_cast<int64_t>(gen()%100000000),static_cast<int64_t>(i)};
+    const char* path="bench_skip_list.snap";
+    RankSkipList<int64_t,int64_t> list(0,42);
+    list.Build(items.begin(),items.end());
+    Bench::Print(Bench::Measure("snapshot/save n="+std::to_string(n),n,[&]{
+        SaveSnapshot(list,path);
+    }));
+    {
+        RankSkipList<int64_t,int64_t> replay(0,42);
+        Bench::Print(Bench::Measure("snapshot/replay n="+std::to_string(n),n,[&]{
+            for(auto& item:items) replay.InsertOrUpdate(item.first,item.second);
+        }));
+    }
+    {
+        RankSkipList<int64_t,int64_t> loaded(0,42);
+        Bench::Print(Bench::Measure("snapshot/load n="+std::to_string(n),n,[&]{
+            LoadSnapshot(loaded,path);
+        }));
+    }
+    int64_t bytes=Bench::LiveBytes().load();
+    FrozenRankList<int64_t,int64_t> frozen;
+    Bench::Print(Bench::Measure("snapshot/frozen_open n="+std::to_string(n),n,[&]{
+        frozen.Open(path);
+    }));
+    Bench::Note("snapshot/frozen_heap",static_cast<double>(Bench::LiveBytes().load()-bytes),"bytes");
+    const uint64_t queries=1000000;
+    int64_t sum=0;
+    Bench::Print(Bench::Measure("snapshot/list_Rank n="+std::to_string(n),queries,[&]{
+        for(uint64_t q=0;q<queries;q++) sum+=list.Rank(static_cast<int64_t>(gen()%n));
+    }));
+    Bench::Print(Bench::Measure("snapshot/frozen_Rank n="+std::to_string(n),queries,[&]{
+        for(uint64_t q=0;q<queries;q++) sum+=frozen.Rank(static_cast<int64_t>(gen()%n));
+    }));
+    Bench::Print(Bench::Measure("snapshot/frozen_page100 n="+std::to_string(n),10000,[&]{
+        for(uint64_t q=0;q<10000;q++){
+            uint64_t start=1+gen()%(n-100);
+            frozen.ForEachByRank(start,start+99,[&](const SkipListSnapshotEntry<int64_t,int64_t>& entry){ sum+=entry.value; });
+        }
+    }));
+    if(sum==0) std::printf("\n");
+    std::remove(path);
+}
+
+///变化日志：记录日志对改分的额外开销；每个tick轮询1万在线玩家的Rank vs 订阅前100名窗口后Poll
+static void BenchChangeLog(uint64_t n){
+    std::mt19937_64 gen(31);
+    std::vector<std::pair<int64_t,int64_t>> items(n);
+    for(uint64_t i=0;i<n;i++) items[i]={static_cast<int64_t>(gen()%100000000),static_cast<int64_t>(i)};
+    const uint64_t updates=200000;
+    std::vector<std::pair<int64_t,int64_t>> ops(updates);
+    for(auto& op:ops) op={static_cast<int64_t>(gen()%100000000),static_cast<int64_t>(gen()%n)};
+    {
+        RankSkipList<int64_t,int64_t> list(0,42);
+        list.Build(items.begin(),items.end());
+        Bench::Print(Bench::Measure("changelog/update_no_log",updates,[&]{
+            for(auto& op:ops) list.InsertOrUpdate(op.first,op.second);
+        }));
+    }
+    RankSkipList<int64_t,int64_t> list(0,42);
+    list.Build(items.begin(),items.end());
+    SkipListChangeLog<int64_t,int64_t> log(1<<16);
+    list.SetChangeLog(&log);
+    Bench::Print(Bench::Measure("changelog/update_with_log",updates,[&]{
+        for(auto& op:ops) list.InsertOrUpdate(op.first,op.second);
+    }));
+    //每个tick改分100次，然后刷新在线玩家的排名
+    const uint64_t ticks=100,online=10000;
+    int64_t sum=0;
+    Bench::Print(Bench::Measure("changelog/poll_rank_per_tick",ticks,[&]{
+        for(uint64_t t=0;t<ticks;t++){
+            for(uint64_t i=0;i<100;i++) list.InsertOrUpdate(static_cast<int64_t>(gen()%100000000),static_cast<int64_t>(gen()%n));
+            for(uint64_t p=0;p<online;p++) sum+=list.Rank(static_cast<int64_t>(p));
+        }
+    }));
+    uint32_t top=log.Subscribe(1,100);
+    std::vector<SkipListChangeEvent<int64_t,int64_t>> events(4096);
+    Bench::Print(Bench::Measure("changelog/subscribe_top100_per_tick",ticks,[&]{
+        for(uint64_t t=0;t<ticks;t++){
+            for(uint64_t i=0;i<100;i++) list.InsertOrUpdate(static_cast<int64_t>(gen()%100000000),static_cast<int64_t>(gen()%n));
+            bool overrun=false;
+            sum+=static_cast<int64_t>(log.Poll(top,events.data(),events.size(),overrun));
+        }
+    }));
+    if(sum==0) std::printf("\n");
+}
+
+///大量小榜：每个榜一个RankSkipList vs LeaderboardRegistry，每个榜的内存和增改、查排名的耗时
+///  大部分榜10~50人，1%的榜500人
+static void BenchRegistry(uint64_t boards){
+    std::mt19937_64 gen(37);
+    std::vector<uint64_t> sizes(boards);
+    uint64_t total=0;
+    for(auto& size:sizes){
+        size=(gen()%100==0)?500:10+gen()%41;
+        total+=size;
+    }
+    std::vector<std::pair<uint64_t,int64_t>> ops;
+    ops.reserve(total*2);
+    for(uint64_t b=0;b<boards;b++){
+        for(uint64_t i=0;i<sizes[b]*2;i++) ops.push_back({b,static_cast<int64_t>(gen()%sizes[b])});
+    }
+    std::shuffle(ops.begin(),ops.end(),gen);
+    {
+        int64_t bytes=Bench::LiveBytes().load();
+        std::vector<std::unique_ptr<RankSkipList<int64_t,int64_t>>> lists;
+        for(uint64_t b=0;b<boards;b++) lists.emplace_back(new RankSkipList<int64_t,int64_t>(0,42+b));
+        Bench::Print(Bench::Measure("registry/skip_list_each/update",ops.size(),[&]{
+            for(auto& op:ops) lists[op.first]->InsertOrUpdate(static_cast<int64_t>(gen()%100000),op.second);
+        }));
+        Bench::Note("registry/skip_list_each/memory",static_cast<double>(Bench::LiveBytes().load()-bytes)/static_cast<double>(boards),"bytes/board");
+        int64_t sum=0;
+        Bench::Print(Bench::Measure("registry/skip_list_each/Rank",ops.size(),[&]{
+            for(auto& op:ops) sum+=lists[op.first]->Rank(op.second);
+        }));
+        if(sum==0) std::printf("\n");
+    }
+    {
+        int64_t bytes=Bench::LiveBytes().load();
+        auto* registry=new LeaderboardRegistry<int64_t,int64_t>(42);
+        for(uint64_t b=0;b<boards;b++) registry->Create(b);
+        Bench::Print(Bench::Measure("registry/compact/update",ops.size(),[&]{
+            for(auto& op:ops) registry->Find(op.first)->InsertOrUpdate(static_cast<int64_t>(gen()%100000),op.second);
+        }));
+        Bench::Note("registry/compact/memory",static_cast<double>(Bench::LiveBytes().load()-bytes)/static_cast<double>(boards),"bytes/board");
+        int64_t sum=0;
+        Bench::Print(Bench::Measure("registry/compact/Rank",ops.size(),[&]{
+            for(auto& op:ops) sum+=registry->Find(op.first)->Rank(op.second);
+        }));
+        if(sum==0) std::printf("\n");
+        delete registry;
+    }
+}
+
+///日榜零点重置：DeleteNodeByRange逐个删除 vs Rollover换新榜、旧榜交给后台线程释放
+///  只计调用线程上的耗时，每种做法重置一次n人的榜
+static void BenchWindowed(uint64_t n){
+    std::mt19937_64 gen(41);
+    std::vector<std::pair<int64_t,int64_t>> items(n);
+    for(uint64_t i=0;i<n;i++) items[i]={static_cast<int64_t>(gen()%100000000),static_cast<int64_t>(i)};
+    {
+        RankSkipList<int64_t,int64_t> list(0,42);
+        for(auto& item:items) list.InsertOrUpdate(item.first,item.second);
+        Bench::Print(Bench::Measure("windowed/DeleteNodeByRange_reset",1,[&]{
+            list.DeleteNodeByRange(1,list.length());
+        }));
+    }
+    {
+        WindowedRankList<int64_t,int64_t> board(0,0,42,false);
+        for(auto& item:items) board.InsertOrUpdate(item.first,item.second);
+        Bench::Print(Bench::Measure("windowed/rollover_inline_free",1,[&]{
+            board.Rollover();
+        }));
+    }
+    {
+        WindowedRankList<int64_t,int64_t> board(0,0,42,true);
+        for(auto& item:items) board.InsertOrUpdate(item.first,item.second);
+        Bench::Print(Bench::Measure("windowed/rollover_background_free",1,[&]{
+            board.Rollover();
+        }));
+        board.DrainReclaimer();
+    }
+    {
+        //7个日榜，查询最近7天最好排名
+        WindowedRankList<int64_t,int64_t> board(6,0,42);
+        uint64_t per_day=n/10;
+        for(uint32_t day=0;day<7;day++){
+            if(day) board.Rollover();
+            for(uint64_t i=0;i<per_day;i++) board.InsertOrUpdate(static_cast<int64_t>(gen()%100000000),static_cast<int64_t>(gen()%per_day));
+        }
+        int64_t sum=0;
+        Bench::Print(Bench::Measure("windowed/BestRank_7_windows",per_day,[&]{
+            for(uint64_t i=0;i<per_day;i++) sum+=board.BestRank(static_cast<int64_t>(i),7);
+        }));
+        if(sum==0) std::printf("\n");
+    }
+}
+
+///跳表和B+树两种引擎：插入、改分、Rank、getNodeByRank、删除，以及占用内存
+template<class List>
+static void BenchEngineOne(const std::string& name,uint64_t n){
+    std::mt19937_64 gen(43);
+    std::string suffix=" n="+std::to_string(n);
+    uint64_t queries=std::min<uint64_t>(n,1000000);
+    int64_t bytes=Bench::LiveBytes().load();
+    auto* list=new List();
+    Bench::Print(Bench::Measure("engine/"+name+"/insert"+suffix,n,[&]{
+        for(uint64_t i=0;i<n;i++) list->InsertOrUpdate(static_cast<int64_t>(gen()%100000000),static_cast<int64_t>(i));
+    }));
+    Bench::Note("engine/"+name+"/memory"+suffix,static_cast<double>(Bench::LiveBytes().load()-bytes)/static_cast<double>(n),"bytes/entry");
+    Bench::Print(Bench::Measure("engine/"+name+"/update"+suffix,queries,[&]{
+        for(uint64_t i=0;i<queries;i++) list->InsertOrUpdate(static_cast<int64_t>(gen()%100000000),static_cast<int64_t>(gen()%n));
+    }));
+    int64_t sum=0;
+    Bench::Print(Bench::Measure("engine/"+name+"/Rank"+suffix,queries,[&]{
+        for(uint64_t i=0;i<queries;i++) sum+=list->Rank(static_cast<int64_t>(gen()%n));
+    }));
+    Bench::Print(Bench::Measure("engine/"+name+"/getNodeByRank"+suffix,queries,[&]{
+        for(uint64_t i=0;i<queries;i++) sum+=list->getNodeByRank(1+gen()%n)->key;
+    }));
+    Bench::Print(Bench::Measure("engine/"+name+"/DeleteNode"+suffix,queries,[&]{
+        for(uint64_t i=0;i<queries;i++) sum+=list->DeleteNode(static_cast<int64_t>(gen()%n));
+    }));
+    if(sum==0) std::printf("\n");
+    delete list;
+}
+
+static void BenchEngine(uint64_t n){
+    BenchEngineOne<RankSkipList<int64_t,int64_t>>("skip_list",n);
+    BenchEngineOne<RankBTree<int64_t,int64_t>>("btree",n);
+}
+
+///线上的用法：n个玩家，改分按Zipf分布集中在少数活跃玩家(s=1)，每次涨1~100分；前100名、"我附近"±10名的查询也按Zipf挑玩家
+///  满榜(max_len=n)时新玩家挤掉末尾，以及一次把榜截到90%；逐个计时，给出p50/p99
+static void BenchZipf(uint64_t n){
+    std::mt19937_64 gen(31);
+    Bench::Zipf zipf(n,1.0);
+    std::vector<std::pair<int64_t,int64_t>> items(n);
+    for(uint64_t i=0;i<n;i++) items[i]={static_cast<int64_t>(gen()%100000000),static_cast<int64_t>(i)};
+    const std::string suffix=" n="+std::to_string(n);
+    int64_t sum=0;
+    {
+        RankSkipList<int64_t,int64_t> list(0,42);
+        list.Build(items.begin(),items.end());
+        const uint64_t updates=200000;
+        Bench::Print(Bench::MeasureLatency("zipf/update"+suffix,updates,[&](uint64_t){
+            auto val=static_cast<int64_t>(zipf(gen));
+            list.InsertOrUpdate(*list.getKey(val)+static_cast<int64_t>(gen()%100)+1,val);
+        }));
+        const uint64_t top_reads=20000;
+        Bench::Print(Bench::MeasureLatency("zipf/top100"+suffix,top_reads,[&](uint64_t){
+            list.ForEachByRank(1,100,[&](const SkipListNode<int64_t,int64_t>& node){
+                sum+=node.value;
+            });
+        }));
+        std::vector<const SkipListNode<int64_t,int64_t>*> buffer(21);
+        const uint64_t around_reads=100000;
+        Bench::Print(Bench::MeasureLatency("zipf/around"+suffix,around_reads,[&](uint64_t){
+            uint64_t count=0,first_rank=0;
+            list.getAroundRank(static_cast<int64_t>(zipf(gen)),10,buffer.data(),count,first_rank);
+            for(uint64_t i=0;i<count;i++) sum+=buffer[i]->value;
+        }));
+    }
+    {
+        RankSkipList<int64_t,int64_t> list(n,42);
+        list.Build(items.begin(),items.end());
+        uint64_t inserts=n<100000?n:100000;
+        Bench::Print(Bench::MeasureLatency("zipf/evict_full"+suffix,inserts,[&](uint64_t i){
+            list.InsertOrUpdate(static_cast<int64_t>(gen()%100000000),static_cast<int64_t>(n+i));
+        }));
+        uint64_t keep=n/10*9;
+        uint64_t removed=list.length()-keep;
+        Bench::Print(Bench::Measure("zipf/trim_to_90%"+suffix,removed,[&]{
+            list.DeleteNodeByRange(keep+1,list.length());
+        }));
+    }
+    if(sum==0) std::printf("\n");
+}
+
+int main(int argc,char** argv){
+    const char* which=Bench::ParseArgs(argc,argv);
+    auto enabled=[&](const char* name){ return std::strcmp(which,"all")==0||std::strcmp(which,name)==0; };
+    Bench::PrintHeader();
+    if(enabled("layout")){
+        BenchLayout(10000);
+        BenchLayout(200000);
+    }
+    if(enabled("bulk")){
+        BenchBulk(1000000);
+    }
+    if(enabled("page")){
+        BenchPage(1000000,100);
+    }
+    if(enabled("around")){
+        BenchAround(1000000,10);
+    }
+    if(enabled("batch")){
+        BenchBatch(1000000);
+    }
+    if(enabled("score")){
+        BenchScore(1000000);
+    }
+    if(enabled("concurrent")){
+        BenchConcurrent(1000000);
+    }
+    if(enabled("sharded")){
+        BenchSharded(1000000);
+    }
+    if(enabled("snapshot")){
+        BenchSnapshot(1000000);
+    }
+    if(enabled("changelog")){
+        BenchChangeLog(1000000);
+    }
+    if(enabled("registry")){
+        BenchRegistry(20000);
+    }
+    if(enabled("windowed")){
+        BenchWindowed(1000000);
+    }
+    if(enabled("engine")){
+        BenchEngine(10000);
+        BenchEngine(1000000);
+        BenchEngine(10000000);
+    }
+    if(enabled("zipf")){
+        //默认到100万，--max=10000000跑到1000万
+        uint64_t max_n=Bench::MaxEntries()?Bench::MaxEntries():1000000;
+        for(uint64_t n=1000;n<=max_n;n*=10) BenchZipf(n);
+    }
+    if(enabled("index")){
+        BenchIndex(1000000);
+        BenchIndex(1500000);
+    }
+    return 0;
+}
@@ -0,0 +1,371 @@
+//
+// Created by zhangshiping on 26-10-17.
+//
+
+#ifndef GAMETOOLS_BENCH_UTIL_H
+#define GAMETOOLS_BENCH_UTIL_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+#include <malloc.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+///基准测试公共工具，每个benchmark可执行文件只能有一个源文件包含此头文件（替换了全局operator new/delete）
+///  结果打印成表格；命令行带--json=文件时每个结果再往文件追加一行JSON，用来对比回归
+namespace GameTools{ namespace Bench{
+
+///--json=指定的文件，没有时为nullptr
+inline std::FILE*& JsonFile(){
+    static std::FILE* file=nullptr;
+    return file;
+}
+///可执行文件名，写在每行JSON里区分同名的case(比如bench_memory_pool和bench_memory_pool_locked)
+inline std::string& Program(){
+    static std::string program;
+    return program;
+}
+///--max=指定的最大规模，没有时为0
+inline uint64_t& MaxEntries(){
+    static uint64_t max_entries=0;
+    return max_entries;
+}
+///解析命令行：第一个不是--开头的参数是要跑的case(默认all)，--json=文件、--max=规模
+inline const char* ParseArgs(int argc,char** argv){
+    const char* which="all";
+    bool named=false;
+    const char* slash=argc>0?std::strrchr(argv[0],'/'):nullptr;
+    Program()=argc>0?(slash?slash+1:argv[0]):"";
+    for(int i=1;i<argc;i++){
+        if(std::strncmp(argv[i],"--json=",7)==0){
+            JsonFile()=std::fopen(argv[i]+7,"a");
+            if(JsonFile()== nullptr) std::fprintf(stderr,"cannot open %s\n",argv[i]+7);
+        }
+        else if(std::strncmp(argv[i],"--max=",6)==0) MaxEntries()=std::strtoull(argv[i]+6,nullptr,10);
+        else if(!named){
+            which=argv[i];
+            named=true;
+        }
+    }
+    return which;
+}
+
+///当前常驻内存，KB，读不到时为-1
+inline int64_t ResidentKB(){
+#if defined(__linux__)
+    std::FILE* file=std::fopen("/proc/self/statm","r");
+    if(file== nullptr) return -1;
+    long long size=0,resident=0;
+    int got=std::fscanf(file,"%lld %lld",&size,&resident);
+    std::fclose(file);
+    if(got!=2) return -1;
+    return static_cast<int64_t>(resident)*static_cast<int64_t>(sysconf(_SC_PAGESIZE))/1024;
+#else
+    return -1;
+#endif
+}
+
+///全局分配计数
+inline std::atomic<uint64_t>& AllocCount(){
+    static std::atomic<uint64_t> count{0};
+    return count;
+}
+inline std::atomic<uint64_t>& AllocBytes(){
+    static std::atomic<uint64_t> bytes{0};
+    return bytes;
+}
+///当前未释放的字节数(按malloc_usable_size统计)
+inline std::atomic<int64_t>& LiveBytes(){
+    static std::atomic<int64_t> bytes{0};
+    return bytes;
+}
+
+///计时器
+class Timer{
+public:
+    Timer(){ Reset(); }
+    void Reset(){ start_=std::chrono::steady_clock::now(); }
+    ///经过的纳秒数
+    double ElapsedNs() const{
+        return std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now()-start_).count();
+    }
+private:
+    std::chrono::steady_clock::time_point start_;
+};
+
+///硬件cache miss计数，不支持perf_event时Value()返回-1
+class CacheMissCounter{
+public:
+    CacheMissCounter(){
+#if defined(__linux__)
+        perf_event_attr attr;
+        std::memset(&attr,0,sizeof(attr));
+        attr.type=PERF_TYPE_HARDWARE;
+        attr.size=sizeof(attr);
+        attr.config=PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled=1;
+        attr.exclude_kernel=1;
+        attr.exclude_hv=1;
+        fd_=static_cast<int>(syscall(__NR_perf_event_open,&attr,0,-1,-1,0));
+#endif
+    }
+    ~CacheMissCounter(){
+#if defined(__linux__)
+        if(fd_>=0) close(fd_);
+#endif
+    }
+    CacheMissCounter(const CacheMissCounter&)=delete;
+    CacheMissCounter& operator=(const CacheMissCounter&)=delete;
+    void Start(){
+#if defined(__linux__)
+        if(fd_<0) return;
+        ioctl(fd_,PERF_EVENT_IOC_RESET,0);
+        ioctl(fd_,PERF_EVENT_IOC_ENABLE,0);
+#endif
+    }
+    void Stop(){
+#if defined(__linux__)
+        if(fd_<0) return;
+        ioctl(fd_,PERF_EVENT_IOC_DISABLE,0);
+#endif
+    }
+    int64_t Value() const{
+#if defined(__linux__)
+        if(fd_<0) return -1;
+        uint64_t value=0;
+        if(read(fd_,&value,sizeof(value))!=sizeof(value)) return -1;
+        return static_cast<int64_t>(value);
+#else
+        return -1;
+#endif
+    }
+private:
+    int fd_=-1;
+};
+
+///逐个操作的耗时，算分位数
+class Latency{
+public:
+    void Reserve(std::size_t count){
+        samples_.reserve(count);
+    }
+    void Add(double ns){
+        samples_.push_back(static_cast<float>(ns));
+    }
+    ///p在[0,1]，没有数据时为-1
+    double Percentile(double p){
+        if(samples_.empty()) return -1;
+        auto index=static_cast<std::size_t>(p*static_cast<double>(samples_.size()-1));
+        std::nth_element(samples_.begin(),samples_.begin()+static_cast<std::ptrdiff_t>(index),samples_.end());
+        return samples_[index];
+    }
+private:
+    std::vector<float> samples_;
+};
+
+///一次测量的结果，没有测的项为-1
+struct Sample{
+    std::string name;
+    uint64_t ops=0;
+    double ns=0;
+    uint64_t allocs=0;
+    int64_t cache_misses=-1;
+    double p50_ns=-1;
+    double p99_ns=-1;
+    //测量结束时的常驻内存
+    int64_t rss_kb=-1;
+};
+
+///测量fn()，fn执行ops次操作
+template<class Fn>
+Sample Measure(const std::string& name,uint64_t ops,Fn&& fn){
+    Sample sample;
+    sample.name=name;
+    sample.ops=ops;
+    CacheMissCounter misses;
+    uint64_t allocs=AllocCount().load(std::memory_order_relaxed);
+    misses.Start();
+    Timer timer;
+    fn();
+    sample.ns=timer.ElapsedNs();
+    misses.Stop();
+    sample.allocs=AllocCount().load(std::memory_order_relaxed)-allocs;
+    sample.cache_misses=misses.Value();
+    sample.rss_kb=ResidentKB();
+    return sample;
+}
+
+///逐个计时ops次fn(i)，另外给出p50/p99；计时本身(两次steady_clock)也算在每次操作里
+template<class Fn>
+Sample MeasureLatency(const std::string& name,uint64_t ops,Fn&& fn){
+    Latency latency;
+    latency.Reserve(ops);
+    Sample sample=Measure(name,ops,[&]{
+        for(uint64_t i=0;i<ops;i++){
+            auto start=std::chrono::steady_clock::now();
+            fn(i);
+            latency.Add(std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now()-start).count());
+        }
+    });
+    sample.p50_ns=latency.Percentile(0.5);
+    sample.p99_ns=latency.Percentile(0.99);
+    return sample;
+}
+
+inline void PrintHeader(){
+    std::printf("%-40s %12s %12s %12s %14s %10s %10s %10s\n","case","ops","ns/op","allocs/op","misses/op","p50 ns","p99 ns","rss MB");
+}
+
+///JSON字符串里要转义的字符
+inline std::string JsonEscape(const std::string& text){
+    std::string escaped;
+    for(char c:text){
+        if(c=='"'||c=='\\') escaped+='\\';
+        escaped+=c;
+    }
+    return escaped;
+}
+///没有测的项写成null
+inline void JsonNumber(std::FILE* file,const char* key,double value,bool present){
+    if(present&&std::isfinite(value)) std::fprintf(file,",\"%s\":%.3f",key,value);
+    else std::fprintf(file,",\"%s\":null",key);
+}
+
+inline void Print(const Sample& sample){
+    double ops=sample.ops?static_cast<double>(sample.ops):1.0;
+    char misses[32]="n/a",p50[32]="n/a",p99[32]="n/a",rss[32]="n/a";
+    if(sample.cache_misses>=0) std::snprintf(misses,sizeof(misses),"%.3f",sample.cache_misses/ops);
+    if(sample.p50_ns>=0) std::snprintf(p50,sizeof(p50),"%.0f",sample.p50_ns);
+    if(sample.p99_ns>=0) std::snprintf(p99,sizeof(p99),"%.0f",sample.p99_ns);
+    if(sample.rss_kb>=0) std::snprintf(rss,sizeof(rss),"%.1f",static_cast<double>(sample.rss_kb)/1024);
+    std::printf("%-40s %12llu %12.1f %12.3f %14s %10s %10s %10s\n",sample.name.c_str(),
+                static_cast<unsigned long long>(sample.ops),sample.ns/ops,sample.allocs/ops,misses,p50,p99,rss);
+    std::FILE* file=JsonFile();
+    if(file== nullptr) return;
+    std::fprintf(file,"{\"program\":\"%s\",\"case\":\"%s\",\"ops\":%llu",JsonEscape(Program()).c_str(),
+                 JsonEscape(sample.name).c_str(),static_cast<unsigned long long>(sample.ops));
+    JsonNumber(file,"ns_per_op",sample.ns/ops,true);
+    JsonNumber(file,"ops_per_sec",sample.ns>0?static_cast<double>(sample.ops)*1e9/sample.ns:0,sample.ns>0);
+    JsonNumber(file,"p50_ns",sample.p50_ns,sample.p50_ns>=0);
+    JsonNumber(file,"p99_ns",sample.p99_ns,sample.p99_ns>=0);
+    JsonNumber(file,"allocs_per_op",sample.allocs/ops,true);
+    JsonNumber(file,"misses_per_op",sample.cache_misses/ops,sample.cache_misses>=0);
+    JsonNumber(file,"rss_kb",static_cast<double>(sample.rss_kb),sample.rss_kb>=0);
+    std::fprintf(file,"}\n");
+    std::fflush(file);
+}
+
+///不是按操作计时的结果(内存占用、比例等)：打印一行，--json时写{"case","value","unit"}
+inline void Note(const std::string& name,double value,const char* unit){
+    std::printf("%-40s %12.3f %s\n",name.c_str(),value,unit);
+    std::FILE* file=JsonFile();
+    if(file== nullptr) return;
+    std::fprintf(file,"{\"program\":\"%s\",\"case\":\"%s\"",JsonEscape(Program()).c_str(),JsonEscape(name).c_str());
+    JsonNumber(file,"value",value,true);
+    std::fprintf(file,",\"unit\":\"%s\"}\n",JsonEscape(unit).c_str());
+    std::fflush(file);
+}
+
+///Zipf分布的下标[0,n)，下标0最常见，P(k)正比于1/(k+1)^s；拒绝-逆变换采样，不用存n个概率
+///  用来模拟少数活跃玩家贡献大部分改分
+class Zipf{
+public:
+    Zipf(uint64_t n,double s):n_(static_cast<double>(n)),s_(s){
+        h_integral_x1_=hIntegral(1.5)-1;
+        h_integral_n_=hIntegral(n_+0.5);
+        threshold_=2-hIntegralInverse(hIntegral(2.5)-h(2));
+    }
+    template<class Gen>
+    uint64_t operator()(Gen& gen){
+        while(true){
+            double uniform=static_cast<double>(gen()>>11)*(1.0/9007199254740992.0);
+            double u=h_integral_n_+uniform*(h_integral_x1_-h_integral_n_);
+            double x=hIntegralInverse(u);
+            double k=std::floor(x+0.5);
+            if(k<1) k=1;
+            else if(k>n_) k=n_;
+            if(k-x<=threshold_||u>=hIntegral(k+0.5)-h(k)) return static_cast<uint64_t>(k)-1;
+        }
+    }
+private:
+    double h(double x) const{
+        return std::exp(-s_*std::log(x));
+    }
+    double hIntegral(double x) const{
+        double log_x=std::log(x);
+        return helper2((1-s_)*log_x)*log_x;
+    }
+    double hIntegralInverse(double x) const{
+        double t=x*(1-s_);
+        if(t<-1) t=-1;
+        return std::exp(helper1(t)*x);
+    }
+    ///log(1+x)/x
+    static double helper1(double x){
+        if(std::fabs(x)>1e-8) return std::log1p(x)/x;
+        return 1-x*(0.5-x*(1.0/3-0.25*x));
+    }
+    ///(exp(x)-1)/x
+    static double helper2(double x){
+        if(std::fabs(x)>1e-8) return std::expm1(x)/x;
+        return 1+x*0.5*(1+x*(1.0/3)*(1+0.25*x));
+    }
+    double n_;
+    double s_;
+    double h_integral_x1_;
+    double h_integral_n_;
+    double threshold_;
+};
+
+}}
+
+void* operator new(std::size_t size){
+    GameTools::Bench::AllocCount().fetch_add(1,std::memory_order_relaxed);
+    GameTools::Bench::AllocBytes().fetch_add(size,std::memory_order_relaxed);
+    if(size==0) size=1;
+    if(void* p=std::malloc(size)){
+        GameTools::Bench::LiveBytes().fetch_add(static_cast<int64_t>(malloc_usable_size(p)),std::memory_order_relaxed);
+        return p;
+    }
+    throw std::bad_alloc();
+}
+void* operator new[](std::size_t size){
+    return ::operator new(size);
+}
+//上面替换的operator new就是用malloc申请的，GCC内联后看不出来，误报new/free不配对
+#if defined(__GNUC__)&&!defined(__clang__)&&__GNUC__>=11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* p) noexcept{
+    if(p) GameTools::Bench::LiveBytes().fetch_sub(static_cast<int64_t>(malloc_usable_size(p)),std::memory_order_relaxed);
+    std::free(p);
+}
+#if defined(__GNUC__)&&!defined(__clang__)&&__GNUC__>=11
+#pragma GCC diagnostic pop
+#endif
+void operator delete[](void* p) noexcept{
+    ::operator delete(p);
+}
+void operator delete(void* p,std::size_t) noexcept{
+    ::operator delete(p);
+}
+void operator delete[](void* p,std::size_t) noexcept{
+    ::operator delete(p);
+}
+
+#endif //GAMETOOLS_BENCH_UTIL_H
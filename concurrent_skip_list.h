@@ -0,0 +1,666 @@
+//
+// Created by zhangshiping on 26-10-17.
+//
+
+#ifndef GAMETOOLS_CONCURRENT_SKIP_LIST_H
+#define GAMETOOLS_CONCURRENT_SKIP_LIST_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <random>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "skip_list.h"
+
+namespace GameTools{
+//并发跳表节点，key/value在节点发布后不再修改，改分时换一个新节点
+template<class K,class V>
+struct ConcurrentSkipListNode{
+    const K key;
+    const V value;
+    //层数
+    int32_t level;
+    struct SkipListLevel{
+        std::atomic<ConcurrentSkipListNode*> next{nullptr};
+        //同SkipListNode，到下一个节点在整条链中相差的节点数量
+        std::atomic<uint64_t> span{0};
+    };
+    //层数组紧跟在节点头之后，和节点在同一块内存中
+    SkipListLevel* levels(){
+        return reinterpret_cast<SkipListLevel*>(this+1);
+    }
+    const SkipListLevel* levels() const{
+        return reinterpret_cast<const SkipListLevel*>(this+1);
+    }
+    ///level层的节点所占内存大小
+    static std::size_t BlockSize(int32_t level){
+        static_assert(alignof(ConcurrentSkipListNode)%alignof(SkipListLevel)==0,"层数组需要紧跟节点头对齐");
+        return sizeof(ConcurrentSkipListNode)+sizeof(SkipListLevel)*static_cast<std::size_t>(level);
+    }
+
+    explicit ConcurrentSkipListNode(int32_t lev)
+            : key(), value(), level(lev)
+    {
+        for(int32_t i=0;i<level;i++) new(levels()+i) SkipListLevel();
+    }
+    ConcurrentSkipListNode(int32_t lev,const K& k,const V& v)
+            : key(k), value(v), level(lev)
+    {
+        for(int32_t i=0;i<level;i++) new(levels()+i) SkipListLevel();
+    }
+};
+
+///读接口拷贝出来的一条记录
+template<class K,class V>
+struct ConcurrentSkipListEntry{
+    K key;
+    V value;
+};
+
+///基于epoch的内存回收：读者进出临界区只改自己分片上的计数，写者等旧epoch的读者全部退出后再释放摘下的节点
+///  epoch按奇偶分两组计数，Synchronize把epoch加1，然后等上一组计数归零
+///  计数按线程分片并各占一个cache line，读者之间不抢同一个cache line
+class SkipListEpoch{
+public:
+    SkipListEpoch(){
+        for(auto& stripe:stripes_){
+            stripe.readers[0].store(0,std::memory_order_relaxed);
+            stripe.readers[1].store(0,std::memory_order_relaxed);
+        }
+    }
+    SkipListEpoch(const SkipListEpoch&)=delete;
+    SkipListEpoch& operator=(const SkipListEpoch&)=delete;
+
+    ///进入读临界区
+    /// \return 传给Exit的凭证
+    uint32_t Enter(){
+        uint32_t stripe=ThreadStripe();
+        while(true){
+            uint64_t epoch=epoch_.load();
+            auto parity=static_cast<uint32_t>(epoch&1);
+            stripes_[stripe].readers[parity].fetch_add(1);
+            //计数加上之前epoch已经变了，这一组可能已经被Synchronize检查过，换到新的一组
+            if(epoch_.load()==epoch) return (stripe<<1)|parity;
+            stripes_[stripe].readers[parity].fetch_sub(1);
+        }
+    }
+    ///退出读临界区
+    void Exit(uint32_t token){
+        stripes_[token>>1].readers[token&1].fetch_sub(1,std::memory_order_release);
+    }
+    ///等待调用前已进入临界区的读者全部退出，只能由写者调用
+    ///  上一次Synchronize已经等完另一组，所以这里只需要等当前这一组
+    ///  计数必须用seq_cst读：和Enter里"先加计数再读epoch"构成Dekker式配对，
+    ///  写者看不到读者的计数时，读者一定看得到新epoch而重试；用acquire读会让两边都看到旧值
+    void Synchronize(){
+        auto parity=static_cast<uint32_t>(epoch_.fetch_add(1)&1);
+        for(auto& stripe:stripes_){
+            while(stripe.readers[parity].load(std::memory_order_seq_cst)!=0) std::this_thread::yield();
+        }
+    }
+
+private:
+    constexpr static uint32_t STRIPES=16;
+    struct alignas(64) Stripe{
+        std::atomic<uint32_t> readers[2];
+    };
+    ///每个线程固定用一个分片
+    static uint32_t ThreadStripe(){
+        static std::atomic<uint32_t> next{0};
+        thread_local uint32_t stripe=next.fetch_add(1,std::memory_order_relaxed)%STRIPES;
+        return stripe;
+    }
+
+    std::atomic<uint64_t> epoch_{0};
+    Stripe stripes_[STRIPES];
+};
+
+///val==>节点的开放寻址索引，单写者多读者
+///  槽里存节点指针，读者用acquire读槽，不加锁；删除留墓碑，不移动其他元素，读者的探测链不会被打断
+///  扩容时建新表再整体发布，旧表由调用方在Synchronize之后FreeRetired
+template<class Node,class V,class H>
+class ConcurrentNodeIndex{
+public:
+    ConcurrentNodeIndex(){
+        table_.store(NewTable(MIN_CAPACITY),std::memory_order_relaxed);
+    }
+    ~ConcurrentNodeIndex(){
+        FreeRetired();
+        ::operator delete(table_.load(std::memory_order_relaxed));
+    }
+    ConcurrentNodeIndex(const ConcurrentNodeIndex&)=delete;
+    ConcurrentNodeIndex& operator=(const ConcurrentNodeIndex&)=delete;
+
+    ///查找val的节点，读者和写者都可以调用
+    Node* Find(const V& val) const{
+        Table* table=table_.load(std::memory_order_acquire);
+        std::atomic<Node*>* slot=findSlot(table,val);
+        return slot?slot->load(std::memory_order_acquire):nullptr;
+    }
+    ///插入一个确定不存在的节点，只能由写者调用
+    void Insert(Node* node){
+        Table* table=table_.load(std::memory_order_relaxed);
+        if((used_+1)*MAX_LOAD_DEN>table->capacity*MAX_LOAD_NUM){
+            table=rehash();
+        }
+        std::size_t index=homeIndex(table,node->value);
+        while(true){
+            Node* cur=table->slots()[index].load(std::memory_order_relaxed);
+            if(cur==nullptr||cur==Tombstone()){
+                if(cur==nullptr) used_++;
+                table->slots()[index].store(node,std::memory_order_release);
+                size_++;
+                return;
+            }
+            index=(index+1)&table->mask;
+        }
+    }
+    ///把val相同的旧节点换成新节点，只能由写者调用
+    void Replace(Node* node){
+        std::atomic<Node*>* slot=findSlot(table_.load(std::memory_order_relaxed),node->value);
+        if(slot) slot->store(node,std::memory_order_release);
+    }
+    ///删除val，只能由写者调用
+    bool Erase(const V& val){
+        std::atomic<Node*>* slot=findSlot(table_.load(std::memory_order_relaxed),val);
+        if(slot== nullptr) return false;
+        slot->store(Tombstone(),std::memory_order_release);
+        size_--;
+        return true;
+    }
+    ///换成一张空表，只能由写者调用
+    void Clear(){
+        retired_.push_back(table_.load(std::memory_order_relaxed));
+        table_.store(NewTable(MIN_CAPACITY),std::memory_order_release);
+        size_=0;
+        used_=0;
+    }
+    std::size_t size() const{ return size_; }
+    ///释放被替换下来的旧表，调用前需要保证没有读者还在用它们
+    void FreeRetired(){
+        for(Table* table:retired_) ::operator delete(table);
+        retired_.clear();
+    }
+
+private:
+    struct Table{
+        std::size_t capacity;
+        std::size_t mask;
+        int shift;
+        std::atomic<Node*>* slots(){
+            return reinterpret_cast<std::atomic<Node*>*>(this+1);
+        }
+    };
+    //槽数(含墓碑)最大负载 3/4，保证探测链上总有空槽
+    constexpr static std::size_t MAX_LOAD_NUM=3;
+    constexpr static std::size_t MAX_LOAD_DEN=4;
+    constexpr static std::size_t MIN_CAPACITY=16;
+
+    static Node* Tombstone(){
+        static char mark;
+        return reinterpret_cast<Node*>(&mark);
+    }
+    static Table* NewTable(std::size_t capacity){
+        static_assert(alignof(Table)%alignof(std::atomic<Node*>)==0,"槽数组需要紧跟表头对齐");
+        auto* table=static_cast<Table*>(::operator new(sizeof(Table)+sizeof(std::atomic<Node*>)*capacity));
+        table->capacity=capacity;
+        table->mask=capacity-1;
+        table->shift=64;
+        for(std::size_t c=capacity;c>1;c>>=1) table->shift--;
+        for(std::size_t i=0;i<capacity;i++) new(table->slots()+i) std::atomic<Node*>(nullptr);
+        return table;
+    }
+    static std::size_t homeIndex(const Table* table,const V& val){
+        uint64_t h=static_cast<uint64_t>(H()(val))*0x9E3779B97F4A7C15ULL;
+        return static_cast<std::size_t>(h>>table->shift);
+    }
+    static std::atomic<Node*>* findSlot(Table* table,const V& val){
+        std::size_t index=homeIndex(table,val);
+        while(true){
+            Node* cur=table->slots()[index].load(std::memory_order_acquire);
+            if(cur==nullptr) return nullptr;
+            if(cur!=Tombstone()&&cur->value==val) return &table->slots()[index];
+            index=(index+1)&table->mask;
+        }
+    }
+    ///按存活元素数重建，顺便清掉墓碑
+    Table* rehash(){
+        Table* old=table_.load(std::memory_order_relaxed);
+        std::size_t capacity=MIN_CAPACITY;
+        while((size_+1)*2>capacity) capacity*=2;
+        Table* table=NewTable(capacity);
+        for(std::size_t i=0;i<old->capacity;i++){
+            Node* node=old->slots()[i].load(std::memory_order_relaxed);
+            if(node== nullptr||node==Tombstone()) continue;
+            std::size_t index=homeIndex(table,node->value);
+            while(table->slots()[index].load(std::memory_order_relaxed)) index=(index+1)&table->mask;
+            table->slots()[index].store(node,std::memory_order_relaxed);
+        }
+        used_=size_;
+        table_.store(table,std::memory_order_release);
+        retired_.push_back(old);
+        return table;
+    }
+
+    std::atomic<Table*> table_{nullptr};
+    //存活节点数
+    std::size_t size_=0;
+    //存活节点+墓碑数
+    std::size_t used_=0;
+    std::vector<Table*> retired_;
+};
+
+///单写者、多读者的排序跳表，排序规则和RankSkipList一致：key大的在前，key相同时val大的在前
+///  写：InsertOrUpdate/DeleteNode/Clear由write_mutex_串行化，改分时摘下旧节点、插入新节点
+///  读：不加锁，seqlock方式读——先读seq_，在epoch保护下遍历并把结果拷贝出来，再读seq_，两次相同才采用结果
+///     seq_为奇数表示写者正在修改，读者重试；连续重试READ_RETRY次后退出epoch，改为持有write_mutex_读
+///  一致性：读到的排名、span和拷贝出来的数据都来自同一个已完成写操作之后的状态，不会看到一半的修改
+///     (例如span已加1但节点还没接上)；两次读之间可能插入了其他写，读者之间不保证看到同一个版本
+///  回收：摘下的节点先挂到retired_，攒够RECLAIM_BATCH个后Synchronize等待之前进来的读者退出，再归还arena
+///     读者拿到的节点在退出epoch之前不会被释放，节点的key/value在释放前不会被修改
+///  读接口不返回节点指针，一律拷贝
+template<class K,class V,class H=std::hash<V>,class P=SkipListPolicy<>>
+class ConcurrentRankSkipList{
+    using Node=ConcurrentSkipListNode<K,V>;
+public:
+    using Entry=ConcurrentSkipListEntry<K,V>;
+    //链表最大层数
+    constexpr static int32_t SKIPLIST_MAX_LEVEL=P::SKIPLIST_MAX_LEVEL;
+    //用于控制随机层数的系数
+    constexpr static double SKIPLIST_P=P::SKIPLIST_P;
+private:
+    //乐观读的最大重试次数
+    constexpr static uint32_t READ_RETRY=64;
+    //攒够这么多摘下的节点后回收一次
+    constexpr static std::size_t RECLAIM_BATCH=1024;
+
+    //节点内存，只有写者使用，声明在最前面，保证最后析构
+    SkipListArena<Node> arena_;
+    //写者互斥，也是读者多次重试失败后的退路
+    std::mutex write_mutex_;
+    //写序号，奇数表示写者正在修改
+    std::atomic<uint64_t> seq_{0};
+    SkipListEpoch epoch_;
+    ConcurrentNodeIndex<Node,V,H> index_;
+    Node* header_=nullptr;
+    //已有层数
+    std::atomic<int32_t> level_{1};
+    //节点数量
+    std::atomic<uint64_t> length_{0};
+    //最大长度
+    uint64_t max_len_=0;
+    //随机层数生成器状态(splitmix64)
+    uint64_t rand_state_=0;
+    //已摘下、等待回收的节点
+    std::vector<Node*> retired_;
+
+    Node* createNode(int32_t level,const K& key,const V& val){
+        return new(arena_.Allocate(level)) Node(level,key,val);
+    }
+    void freeNode(Node* node){
+        int32_t level=node->level;
+        node->~Node();
+        arena_.Free(node,level);
+    }
+    void beginWrite(){
+        seq_.store(seq_.load(std::memory_order_relaxed)+1,std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+    void endWrite(){
+        seq_.store(seq_.load(std::memory_order_relaxed)+1,std::memory_order_release);
+    }
+    /// 摘下的节点等所有读者退出后再释放
+    void retire(Node* node){
+        retired_.push_back(node);
+    }
+    /// 攒够一批(或force)时等读者退出，释放摘下的节点和索引旧表
+    void reclaim(bool force){
+        if(!force&&retired_.size()<RECLAIM_BATCH) return;
+        epoch_.Synchronize();
+        for(Node* node:retired_) freeNode(node);
+        retired_.clear();
+        index_.FreeRetired();
+    }
+    /// 乐观读：fn()在没有并发写的情况下执行完才采用结果，否则重试，最后退化为加锁读
+    ///   fn在数据不一致时也必须能正常结束，结果只能写到调用方的缓冲区里
+    template<class Fn>
+    auto read(Fn&& fn) -> decltype(fn()){
+        uint32_t token=epoch_.Enter();
+        for(uint32_t retry=0;retry<READ_RETRY;retry++){
+            uint64_t seq=seq_.load(std::memory_order_acquire);
+            if(seq&1){
+                std::this_thread::yield();
+                continue;
+            }
+            auto result=fn();
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(seq_.load(std::memory_order_relaxed)==seq){
+                epoch_.Exit(token);
+                return result;
+            }
+        }
+        //持锁时写者不会回收节点，先退出epoch，避免和持锁等待读者的Synchronize互相等
+        epoch_.Exit(token);
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        return fn();
+    }
+    static Node* next(const Node* node,int32_t i){
+        return node->levels()[i].next.load(std::memory_order_acquire);
+    }
+    static uint64_t span(const Node* node,int32_t i){
+        return node->levels()[i].span.load(std::memory_order_relaxed);
+    }
+    /// node是否排在(key,val)之前
+    static bool before(const Node* node,const K& key,const V& val){
+        return node->key>key||(node->key==key&&node->value>val);
+    }
+    /// 从上往下找(key,val)的每层前节点和它们的排名，只能由写者调用
+    void findPosition(const K& key,const V& val,Node** pre_nodes,uint64_t* rank){
+        Node* tmpNode=header_;
+        int32_t level=level_.load(std::memory_order_relaxed);
+        for(int32_t i=level-1;i>=0;i--){
+            rank[i]=(i==level-1)?0:rank[i+1];
+            while(next(tmpNode,i)&&before(next(tmpNode,i),key,val)){
+                rank[i]+=span(tmpNode,i);
+                tmpNode=next(tmpNode,i);
+            }
+            pre_nodes[i]=tmpNode;
+        }
+    }
+    /// 从上往下找第start个节点的每层前节点，只能由写者调用
+    Node* findByRank(uint64_t start,Node** pre_nodes){
+        Node* tmpNode=header_;
+        uint64_t traversed=0;
+        for(int32_t i=level_.load(std::memory_order_relaxed)-1;i>=0;i--){
+            while(next(tmpNode,i)&&(traversed+span(tmpNode,i))<start){
+                traversed+=span(tmpNode,i);
+                tmpNode=next(tmpNode,i);
+            }
+            pre_nodes[i]=tmpNode;
+        }
+        return next(tmpNode,0);
+    }
+    /// 把节点从各层摘下并修正span，节点自己的next保持不变，正在遍历的读者还能沿它继续走
+    void unlinkNode(Node* node,Node** pre_nodes){
+        int32_t level=level_.load(std::memory_order_relaxed);
+        for(int32_t i=0;i<level;i++){
+            auto& pre=pre_nodes[i]->levels()[i];
+            if(pre.next.load(std::memory_order_relaxed)==node){
+                pre.span.store(span(pre_nodes[i],i)+span(node,i)-1,std::memory_order_relaxed);
+                pre.next.store(next(node,i),std::memory_order_release);
+            }
+            else pre.span.store(span(pre_nodes[i],i)-1,std::memory_order_relaxed);
+        }
+        while(level>1&&next(header_,level-1)== nullptr) level--;
+        level_.store(level,std::memory_order_relaxed);
+        length_.store(length_.load(std::memory_order_relaxed)-1,std::memory_order_relaxed);
+    }
+    /// 把新节点接到pre_nodes之后，节点的next/span先填好，再用release发布
+    void linkNode(Node* node,Node** pre_nodes,uint64_t* rank){
+        int32_t level=level_.load(std::memory_order_relaxed);
+        uint64_t length=length_.load(std::memory_order_relaxed);
+        if(node->level>level){
+            for(int32_t i=level;i<node->level;i++){
+                rank[i]=0;
+                pre_nodes[i]=header_;
+                header_->levels()[i].span.store(length,std::memory_order_relaxed);
+            }
+            level=node->level;
+            level_.store(level,std::memory_order_relaxed);
+        }
+        for(int32_t i=0;i<node->level;i++){
+            auto& pre=pre_nodes[i]->levels()[i];
+            node->levels()[i].next.store(pre.next.load(std::memory_order_relaxed),std::memory_order_relaxed);
+            node->levels()[i].span.store(span(pre_nodes[i],i)-(rank[0]-rank[i]),std::memory_order_relaxed);
+            pre.span.store(rank[0]-rank[i]+1,std::memory_order_relaxed);
+            pre.next.store(node,std::memory_order_release);
+        }
+        for(int32_t i=node->level;i<level;i++){
+            pre_nodes[i]->levels()[i].span.store(span(pre_nodes[i],i)+1,std::memory_order_relaxed);
+        }
+        length_.store(length+1,std::memory_order_relaxed);
+    }
+    /// 摘下节点并从索引里删除，只能在写区间内调用
+    void removeNode(Node* node,Node** pre_nodes){
+        unlinkNode(node,pre_nodes);
+        index_.Erase(node->value);
+        retire(node);
+    }
+    /// 读者用的遍历都只读一次next再使用：写者可能同时把它改成nullptr
+    /// 读者用：从上往下求node的排名，数据不一致时可能返回-1
+    int64_t rankOf(const Node* node) const{
+        const Node* tmpNode=header_;
+        uint64_t rank=0;
+        for(int32_t i=level_.load(std::memory_order_relaxed)-1;i>=0;i--){
+            const Node* nextNode=next(tmpNode,i);
+            while(nextNode&&before(nextNode,node->key,node->value)){
+                rank+=span(tmpNode,i);
+                tmpNode=nextNode;
+                nextNode=next(tmpNode,i);
+            }
+            if(nextNode==node) return static_cast<int64_t>(rank+span(tmpNode,i));
+        }
+        return -1;
+    }
+    /// 读者用：把第start到end名拷贝到buffer
+    uint64_t copyByRank(uint64_t start,uint64_t end,Entry* buffer) const{
+        if(start==0) start=1;
+        if(start>end) return 0;
+        const Node* tmpNode=header_;
+        uint64_t traversed=0;
+        for(int32_t i=level_.load(std::memory_order_relaxed)-1;i>=0;i--){
+            const Node* nextNode=next(tmpNode,i);
+            while(nextNode&&(traversed+span(tmpNode,i))<start){
+                traversed+=span(tmpNode,i);
+                tmpNode=nextNode;
+                nextNode=next(tmpNode,i);
+            }
+        }
+        uint64_t count=0;
+        for(tmpNode=next(tmpNode,0);tmpNode&&count<=end-start;tmpNode=next(tmpNode,0)){
+            buffer[count].key=tmpNode->key;
+            buffer[count].value=tmpNode->value;
+            count++;
+        }
+        return count;
+    }
+    int32_t RandomLevel(){
+        uint64_t bits=NextRandom();
+        if(bits==0) return SKIPLIST_MAX_LEVEL;
+#if defined(__GNUC__)||defined(__clang__)
+        int32_t zeros=__builtin_ctzll(bits);
+#else
+        int32_t zeros=0;
+        while((bits&1)==0){
+            bits>>=1;
+            zeros++;
+        }
+#endif
+        int32_t level=1+zeros/P::SKIPLIST_P_SHIFT;
+        return (level<SKIPLIST_MAX_LEVEL)?level:SKIPLIST_MAX_LEVEL;
+    }
+    /// splitmix64，同RankSkipList
+    uint64_t NextRandom(){
+        uint64_t z=(rand_state_+=0x9E3779B97F4A7C15ULL);
+        z=(z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+        z=(z^(z>>27))*0x94D049BB133111EBULL;
+        return z^(z>>31);
+    }
+
+public:
+    ///
+    /// \param max_len 跳表最大长度
+    /// \param seed 随机层数的种子，0表示用random_device取一个
+    ConcurrentRankSkipList(uint64_t max_len=0,uint64_t seed=0){
+        header_=new(arena_.Allocate(SKIPLIST_MAX_LEVEL)) Node(SKIPLIST_MAX_LEVEL);
+        max_len_=max_len;
+        if(seed==0){
+            std::random_device rd;
+            seed=(static_cast<uint64_t>(rd())<<32)|rd();
+        }
+        rand_state_=seed;
+        retired_.reserve(RECLAIM_BATCH);
+    }
+    /// 析构时不能再有读者
+    ~ConcurrentRankSkipList(){
+        for(Node* node:retired_) node->~Node();
+        Node* node=next(header_,0);
+        while(node){
+            Node* nextNode=next(node,0);
+            node->~Node();
+            node=nextNode;
+        }
+        header_->~Node();
+    }
+    ConcurrentRankSkipList(const ConcurrentRankSkipList&)=delete;
+    ConcurrentRankSkipList& operator=(const ConcurrentRankSkipList&)=delete;
+
+    /// 插入或更新，写者之间互斥
+    ///   更新时旧节点被摘下、新节点接到新位置，读者要么看到旧位置要么看到新位置
+    /// \return 操作后val是否在榜上(超过max_len_被挤掉时为false)
+    bool InsertOrUpdate(const K& key,const V& val){
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        Node* pre_nodes[SKIPLIST_MAX_LEVEL]={nullptr};
+        uint64_t rank[SKIPLIST_MAX_LEVEL]={0};
+        Node* old=index_.Find(val);
+        if(old&&old->key==key) return true;
+        if(old== nullptr){
+            findPosition(key,val,pre_nodes,rank);
+            //长度超过上限且待插入节点位于链尾
+            uint64_t length=length_.load(std::memory_order_relaxed);
+            Node* nextNode=next(pre_nodes[0],0);
+            if(max_len_>0&&length>=max_len_&&(nextNode== nullptr||nextNode->key>key)) return false;
+        }
+        Node* node=createNode(RandomLevel(),key,val);
+        beginWrite();
+        if(old){
+            findPosition(old->key,val,pre_nodes,rank);
+            unlinkNode(old,pre_nodes);
+            retire(old);
+            findPosition(key,val,pre_nodes,rank);
+            linkNode(node,pre_nodes,rank);
+            index_.Replace(node);
+        }
+        else{
+            linkNode(node,pre_nodes,rank);
+            index_.Insert(node);
+        }
+        bool kept=true;
+        if(max_len_>0&&length_.load(std::memory_order_relaxed)>max_len_){
+            Node* last=findByRank(max_len_+1,pre_nodes);
+            kept=last!=node;
+            removeNode(last,pre_nodes);
+        }
+        endWrite();
+        reclaim(false);
+        return kept;
+    }
+    /// 删除val，写者之间互斥
+    bool DeleteNode(const V& val){
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        Node* node=index_.Find(val);
+        if(node== nullptr) return false;
+        Node* pre_nodes[SKIPLIST_MAX_LEVEL]={nullptr};
+        uint64_t rank[SKIPLIST_MAX_LEVEL]={0};
+        beginWrite();
+        findPosition(node->key,val,pre_nodes,rank);
+        removeNode(node,pre_nodes);
+        endWrite();
+        reclaim(false);
+        return true;
+    }
+    /// 清空跳表，等读者退出后归还全部节点
+    void Clear(){
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        Node* node=next(header_,0);
+        beginWrite();
+        for(int32_t i=0;i<SKIPLIST_MAX_LEVEL;i++){
+            header_->levels()[i].next.store(nullptr,std::memory_order_release);
+            header_->levels()[i].span.store(0,std::memory_order_relaxed);
+        }
+        level_.store(1,std::memory_order_relaxed);
+        length_.store(0,std::memory_order_relaxed);
+        index_.Clear();
+        endWrite();
+        while(node){
+            retire(node);
+            node=next(node,0);
+        }
+        reclaim(true);
+    }
+    /// 查询val的排名，不加锁
+    /// \return 排名，从1开始，不存在时为-1
+    int64_t Rank(const V& val){
+        return read([&]{
+            const Node* node=index_.Find(val);
+            return node?rankOf(node):int64_t(-1);
+        });
+    }
+    /// 查询val的key，不加锁
+    /// \param key 输出
+    /// \return 是否存在
+    bool getKey(const V& val,K& key){
+        return read([&]{
+            const Node* node=index_.Find(val);
+            if(node) key=node->key;
+            return node!= nullptr;
+        });
+    }
+    /// 是否存在指定val，不加锁
+    bool has(const V& val){
+        return read([&]{ return index_.Find(val)!= nullptr; });
+    }
+    /// 分数为key的新条目会排在第几名，同RankSkipList::RankByKey，不加锁
+    uint64_t RankByKey(const K& key){
+        return read([&]{
+            const Node* tmpNode=header_;
+            uint64_t traversed=0;
+            for(int32_t i=level_.load(std::memory_order_relaxed)-1;i>=0;i--){
+                const Node* nextNode=next(tmpNode,i);
+                while(nextNode&&nextNode->key>key){
+                    traversed+=span(tmpNode,i);
+                    tmpNode=nextNode;
+                    nextNode=next(tmpNode,i);
+                }
+            }
+            return traversed+1;
+        });
+    }
+    /// 把第start到end名拷贝到buffer，不加锁
+    /// \param buffer 调用方提供，至少能放end-start+1个
+    /// \return 拷贝的个数
+    uint64_t CopyByRank(uint64_t start,uint64_t end,Entry* buffer){
+        return read([&]{ return copyByRank(start,end,buffer); });
+    }
+    /// 查询val的排名以及它前后各n个节点，在同一个版本上完成，不加锁
+    /// \param buffer 调用方提供，至少能放2n+1个，按排名顺序写入，包含val自己
+    /// \param count 输出，写入buffer的个数
+    /// \param first_rank 输出，buffer[0]的排名
+    /// \return val的排名，不存在时为-1且count为0
+    int64_t getAroundRank(const V& val,uint64_t n,Entry* buffer,uint64_t& count,uint64_t& first_rank){
+        return read([&]{
+            count=0;
+            first_rank=0;
+            const Node* node=index_.Find(val);
+            int64_t rank=node?rankOf(node):-1;
+            if(rank<0) return rank;
+            auto self=static_cast<uint64_t>(rank);
+            first_rank=self>n?self-n:1;
+            count=copyByRank(first_rank,self+n,buffer);
+            return rank;
+        });
+    }
+    /// 跳表当前长度
+    uint64_t length() const{
+        return length_.load(std::memory_order_relaxed);
+    }
+};
+
+}
+
+#endif //GAMETOOLS_CONCURRENT_SKIP_LIST_H
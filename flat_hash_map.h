@@ -0,0 +1,234 @@
+//
+// Created by zhangshiping on 26-10-17.
+//
+
+#ifndef GAMETOOLS_FLAT_HASH_MAP_H
+#define GAMETOOLS_FLAT_HASH_MAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <new>
+#include <utility>
+
+namespace GameTools{
+
+///开放寻址哈希表(Robin Hood)，接口与std::unordered_map的常用部分一致
+///  键值对直接存在连续的槽数组里，不为每个元素单独分配节点；另有每槽1字节的探测距离数组，查找时先看它
+///  Robin Hood：插入时探测距离更远的元素抢占距离近的元素的槽，查找失败可以提前结束
+///  删除用backward shift，不留墓碑
+///  插入、删除、扩容都会使迭代器和元素指针失效
+///  槽数组和探测距离数组用Alloc申请(rebind成各自的类型)
+template<class Key,class T,class Hash=std::hash<Key>,class Alloc=std::allocator<char>>
+class FlatHashMap{
+public:
+    struct value_type{
+        Key first;
+        T second;
+    };
+
+    template<bool Const>
+    class Iterator{
+        using Map=typename std::conditional<Const,const FlatHashMap,FlatHashMap>::type;
+        using Value=typename std::conditional<Const,const value_type,value_type>::type;
+    public:
+        Iterator(Map* map,std::size_t index):map_(map),index_(index){ skipEmpty(); }
+        Value& operator*() const{ return map_->slots_[index_]; }
+        Value* operator->() const{ return &map_->slots_[index_]; }
+        Iterator& operator++(){
+            index_++;
+            skipEmpty();
+            return *this;
+        }
+        bool operator==(const Iterator& other) const{ return index_==other.index_; }
+        bool operator!=(const Iterator& other) const{ return index_!=other.index_; }
+    private:
+        void skipEmpty(){
+            while(index_<map_->capacity_&&map_->dist_[index_]==0) index_++;
+        }
+        Map* map_;
+        std::size_t index_;
+    };
+    using iterator=Iterator<false>;
+    using const_iterator=Iterator<true>;
+
+    FlatHashMap()=default;
+    explicit FlatHashMap(const Alloc& alloc):alloc_(alloc){}
+    ~FlatHashMap(){
+        clear();
+        freeArrays(slots_,dist_,capacity_);
+    }
+    FlatHashMap(const FlatHashMap&)=delete;
+    FlatHashMap& operator=(const FlatHashMap&)=delete;
+
+    iterator begin(){ return iterator(this,0); }
+    iterator end(){ return iterator(this,capacity_); }
+    const_iterator begin() const{ return const_iterator(this,0); }
+    const_iterator end() const{ return const_iterator(this,capacity_); }
+
+    std::size_t size() const{ return size_; }
+    bool empty() const{ return size_==0; }
+    ///槽数
+    std::size_t capacity() const{ return capacity_; }
+
+    iterator find(const Key& key){
+        return iterator(this,findIndex(key));
+    }
+    const_iterator find(const Key& key) const{
+        return const_iterator(this,findIndex(key));
+    }
+    ///不存在时插入，存在时不修改
+    /// \return 元素位置，是否插入
+    std::pair<iterator,bool> emplace(const Key& key,const T& value){
+        std::size_t index=findIndex(key);
+        if(index!=capacity_) return {iterator(this,index),false};
+        if((size_+1)*MAX_LOAD_DEN>capacity_*MAX_LOAD_NUM) rehash(capacity_?capacity_*2:MIN_CAPACITY);
+        return {iterator(this,insertNoCheck(value_type{key,value})),true};
+    }
+    ///同上，value移进去，T可以是std::unique_ptr这类只能移动的类型
+    std::pair<iterator,bool> emplace(const Key& key,T&& value){
+        std::size_t index=findIndex(key);
+        if(index!=capacity_) return {iterator(this,index),false};
+        if((size_+1)*MAX_LOAD_DEN>capacity_*MAX_LOAD_NUM) rehash(capacity_?capacity_*2:MIN_CAPACITY);
+        return {iterator(this,insertNoCheck(value_type{key,std::move(value)})),true};
+    }
+    ///删除key
+    /// \return 删除的个数
+    std::size_t erase(const Key& key){
+        std::size_t index=findIndex(key);
+        if(index==capacity_) return 0;
+        slots_[index].~value_type();
+        //backward shift：后面探测距离>1的元素依次前移一格
+        std::size_t next=(index+1)&mask_;
+        while(dist_[next]>1){
+            new(&slots_[index]) value_type(std::move(slots_[next]));
+            slots_[next].~value_type();
+            dist_[index]=static_cast<uint8_t>(dist_[next]-1);
+            index=next;
+            next=(next+1)&mask_;
+        }
+        dist_[index]=0;
+        size_--;
+        return 1;
+    }
+    ///预留至少能放count个元素的空间
+    void reserve(std::size_t count){
+        std::size_t capacity=MIN_CAPACITY;
+        while(count*MAX_LOAD_DEN>capacity*MAX_LOAD_NUM) capacity*=2;
+        if(capacity>capacity_) rehash(capacity);
+    }
+    void clear(){
+        for(std::size_t i=0;i<capacity_;i++){
+            if(dist_[i]){
+                slots_[i].~value_type();
+                dist_[i]=0;
+            }
+        }
+        size_=0;
+    }
+
+private:
+    //最大负载 7/8
+    constexpr static std::size_t MAX_LOAD_NUM=7;
+    constexpr static std::size_t MAX_LOAD_DEN=8;
+    constexpr static std::size_t MIN_CAPACITY=16;
+    //dist_里存探测距离+1，0表示空槽，超过上限时扩容
+    constexpr static uint8_t MAX_DIST=255;
+
+    ///哈希值再做一次乘法混合，std::hash对整数是恒等映射，直接取低位会扎堆
+    std::size_t homeIndex(const Key& key) const{
+        uint64_t h=static_cast<uint64_t>(Hash()(key))*0x9E3779B97F4A7C15ULL;
+        return static_cast<std::size_t>(h>>shift_);
+    }
+    std::size_t findIndex(const Key& key) const{
+        if(size_==0) return capacity_;
+        std::size_t index=homeIndex(key);
+        for(uint8_t dist=1;;dist++){
+            //槽空或者槽里元素离家比自己近，说明key不存在
+            if(dist_[index]<dist) return capacity_;
+            if(dist_[index]==dist&&slots_[index].first==key) return index;
+            index=(index+1)&mask_;
+        }
+    }
+    ///插入一个确定不存在的元素
+    /// \return 插入的元素最终所在的槽，emplace直接用它构造迭代器，不用再查一遍
+    std::size_t insertNoCheck(value_type&& entry){
+        std::size_t index=homeIndex(entry.first);
+        uint8_t dist=1;
+        //插入的元素第一次落下(空槽或者抢占)的位置，之后手上拿的是被挤出来的元素，它不会再动
+        std::size_t placed=capacity_;
+        while(true){
+            if(dist_[index]==0){
+                new(&slots_[index]) value_type(std::move(entry));
+                dist_[index]=dist;
+                size_++;
+                return placed==capacity_?index:placed;
+            }
+            //抢占离家更近的元素的槽，被抢的元素继续往后找
+            if(dist_[index]<dist){
+                std::swap(slots_[index],entry);
+                std::swap(dist_[index],dist);
+                if(placed==capacity_) placed=index;
+            }
+            index=(index+1)&mask_;
+            dist++;
+            if(dist==MAX_DIST){
+                //探测链太长，扩容后重新插入手上的元素；插入的元素已经落下时扩容会挪动它，扩容后按key再找
+                if(placed==capacity_){
+                    rehash(capacity_*2);
+                    return insertNoCheck(std::move(entry));
+                }
+                Key key=slots_[placed].first;
+                rehash(capacity_*2);
+                insertNoCheck(std::move(entry));
+                return findIndex(key);
+            }
+        }
+    }
+    using SlotAlloc=typename std::allocator_traits<Alloc>::template rebind_alloc<value_type>;
+    using DistAlloc=typename std::allocator_traits<Alloc>::template rebind_alloc<uint8_t>;
+    void freeArrays(value_type* slots,uint8_t* dist,std::size_t capacity){
+        if(capacity==0) return;
+        SlotAlloc slot_alloc(alloc_);
+        DistAlloc dist_alloc(alloc_);
+        std::allocator_traits<SlotAlloc>::deallocate(slot_alloc,slots,capacity);
+        std::allocator_traits<DistAlloc>::deallocate(dist_alloc,dist,capacity);
+    }
+    void rehash(std::size_t capacity){
+        value_type* old_slots=slots_;
+        uint8_t* old_dist=dist_;
+        std::size_t old_capacity=capacity_;
+        SlotAlloc slot_alloc(alloc_);
+        DistAlloc dist_alloc(alloc_);
+        slots_=std::allocator_traits<SlotAlloc>::allocate(slot_alloc,capacity);
+        dist_=std::allocator_traits<DistAlloc>::allocate(dist_alloc,capacity);
+        std::memset(dist_,0,capacity);
+        capacity_=capacity;
+        mask_=capacity-1;
+        shift_=64;
+        for(std::size_t c=capacity;c>1;c>>=1) shift_--;
+        size_=0;
+        for(std::size_t i=0;i<old_capacity;i++){
+            if(old_dist[i]){
+                insertNoCheck(std::move(old_slots[i]));
+                old_slots[i].~value_type();
+            }
+        }
+        freeArrays(old_slots,old_dist,old_capacity);
+    }
+
+    Alloc alloc_;
+    value_type* slots_=nullptr;
+    uint8_t* dist_=nullptr;
+    std::size_t capacity_=0;
+    std::size_t mask_=0;
+    std::size_t size_=0;
+    int shift_=64;
+};
+
+}
+
+#endif //GAMETOOLS_FLAT_HASH_MAP_H
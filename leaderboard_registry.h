@@ -0,0 +1,432 @@
+//
+// Created by zhangshiping on 26-10-17.
+//
+
+#ifndef GAMETOOLS_LEADERBOARD_REGISTRY_H
+#define GAMETOOLS_LEADERBOARD_REGISTRY_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "flat_hash_map.h"
+#include "skip_list.h"
+
+namespace GameTools{
+
+///小榜中的一条记录，就是SkipListEntry：跳表节点也是它，两种模式返回同一种指针
+template<class K,class V>
+using CompactRankEntry=SkipListEntry<K,V>;
+
+///CompactRankList的迭代器：数组模式在数组上移动，跳表模式沿第0层走；增删条目后之前的迭代器可能失效
+template<class K,class V,bool Reverse=false>
+class CompactRankIterator{
+public:
+    using iterator_category=std::forward_iterator_tag;
+    using value_type=CompactRankEntry<K,V>;
+    using difference_type=std::ptrdiff_t;
+    using pointer=const value_type*;
+    using reference=const value_type&;
+
+    /// \param entry 当前条目，nullptr表示end
+    /// \param first,last 数组模式下数组的第一个和最后一个条目，跳表模式为nullptr
+    explicit CompactRankIterator(pointer entry= nullptr,pointer first= nullptr,pointer last= nullptr)
+            :entry_(entry),first_(first),last_(last){}
+    reference operator*() const{ return *entry_; }
+    pointer operator->() const{ return entry_; }
+    CompactRankIterator& operator++(){
+        if(first_){
+            if(entry_==(Reverse?first_:last_)) entry_= nullptr;
+            else entry_=Reverse?entry_-1:entry_+1;
+        }else{
+            auto* node=static_cast<const SkipListNode<K,V>*>(entry_);
+            entry_=Reverse?node->pre:node->levels()[0].next;
+        }
+        return *this;
+    }
+    CompactRankIterator operator++(int){
+        CompactRankIterator old=*this;
+        ++(*this);
+        return old;
+    }
+    bool operator==(const CompactRankIterator& other) const{ return entry_==other.entry_; }
+    bool operator!=(const CompactRankIterator& other) const{ return entry_!=other.entry_; }
+private:
+    pointer entry_;
+    pointer first_;
+    pointer last_;
+};
+
+///小榜用有序数组、大榜用RankSkipList的排行榜，排序规则、max_len淘汰、变化日志事件同RankSkipList
+///  长度超过PROMOTE_AT时整体转成跳表(BuildFromSorted一次建好)，删到DEMOTE_AT以下时转回数组，两个阈值错开避免来回切换；转换本身不产生变化日志事件
+///  数组模式：按val线性查找，按(key,val)二分找位置，插入删除移动后面的元素；几十个元素时都在一两个cache line内
+///  跳表模式的节点来自构造时传入的arena，多个榜共享一个arena时没有每个榜一个slab的开销
+///  接口同RankSkipList，差别只在返回条目的地方：
+///    InsertOrUpdate/getNodeByRank返回const Entry*，getAroundRank的buffer是const Entry**，ForEachByRank/ForEachByKey的fn参数是const Entry&；
+///      跳表模式下就是节点(SkipListNode继承Entry)，数组模式下指向数组元素，到下一次修改前有效
+///    getKey返回const K*：数组模式下改key会破坏顺序
+///    迭代器是CompactRankIterator，value_type是Entry；没有printSkipList
+template<class K,class V,class H=std::hash<V>,class P=SkipListPolicy<>>
+class CompactRankList{
+public:
+    using List=RankSkipList<K,V,H,P>;
+    using Arena=typename List::Arena;
+    using Entry=CompactRankEntry<K,V>;
+    using iterator=CompactRankIterator<K,V,false>;
+    using reverse_iterator=CompactRankIterator<K,V,true>;
+    //数组长度超过它时转成跳表
+    constexpr static uint64_t PROMOTE_AT=64;
+    //跳表长度低于它时转回数组
+    constexpr static uint64_t DEMOTE_AT=32;
+private:
+    std::vector<Entry> small_;
+    std::unique_ptr<List> large_;
+    Arena* arena_=nullptr;
+    uint64_t max_len_=0;
+    uint64_t seed_=0;
+    //变化日志，为nullptr时不记录
+    SkipListChangeLog<K,V>* change_log_=nullptr;
+
+    void emitChange(SkipListChange type,const K& key,const V& val,uint64_t old_rank,uint64_t new_rank){
+        if(change_log_) change_log_->Append(type,key,val,old_rank,new_rank);
+    }
+    /// entry是否排在(key,val)之前
+    static bool before(const Entry& entry,const K& key,const V& val){
+        return entry.key>key||(entry.key==key&&entry.value>val);
+    }
+    /// 按val线性查找，不存在时返回small_.size()
+    std::size_t findSmall(const V& val) const{
+        std::size_t i=0;
+        while(i<small_.size()&&!(small_[i].value==val)) i++;
+        return i;
+    }
+    /// (key,val)在数组中的插入位置
+    std::size_t positionSmall(const K& key,const V& val) const{
+        return static_cast<std::size_t>(std::partition_point(small_.begin(),small_.end(),[&](const Entry& entry){
+            return before(entry,key,val);
+        })-small_.begin());
+    }
+    /// 数组中前多少个条目满足is_before，is_before对排名靠前的一段为true
+    template<class Pred>
+    std::size_t countSmall(Pred&& is_before) const{
+        return static_cast<std::size_t>(std::partition_point(small_.begin(),small_.end(),is_before)-small_.begin());
+    }
+    /// 删除数组中[begin,end)的条目，每个都按begin+1的排名记Left，和RankSkipList连续删除一致
+    uint64_t eraseSmall(std::size_t begin,std::size_t end){
+        for(std::size_t i=begin;i<end;i++) emitChange(SkipListChange::Left,small_[i].key,small_[i].value,begin+1,0);
+        small_.erase(small_.begin()+static_cast<std::ptrdiff_t>(begin),small_.begin()+static_cast<std::ptrdiff_t>(end));
+        return end-begin;
+    }
+    void promote(){
+        std::vector<std::pair<K,V>> items;
+        items.reserve(small_.size());
+        for(auto& entry:small_) items.emplace_back(entry.key,entry.value);
+        large_.reset(new List(max_len_,seed_,arena_));
+        large_->BuildFromSorted(items.begin(),items.end());
+        large_->SetChangeLog(change_log_);
+        std::vector<Entry>().swap(small_);
+    }
+    void demote(){
+        small_.reserve(large_->length());
+        large_->ForEachByRank(1,large_->length(),[&](const Entry& entry){
+            small_.push_back(entry);
+        });
+        large_.reset();
+    }
+    void demoteIfShort(){
+        if(large_&&large_->length()<DEMOTE_AT) demote();
+    }
+    /// 用跳表的批量建表，建完后不超过PROMOTE_AT时转回数组
+    template<class Fn>
+    uint64_t rebuild(Fn&& build){
+        small_.clear();
+        large_.reset(new List(max_len_,seed_,arena_));
+        large_->SetChangeLog(change_log_);
+        build(*large_);
+        if(large_->length()<=PROMOTE_AT) demote();
+        return length();
+    }
+
+public:
+    ///
+    /// \param max_len 最大长度，0表示不限
+    /// \param seed 转成跳表时的随机层数种子，0表示用random_device取一个
+    /// \param arena 跳表模式的节点arena，nullptr表示转成跳表时用跳表自己的
+    CompactRankList(uint64_t max_len=0,uint64_t seed=0,Arena* arena= nullptr)
+            : arena_(arena), max_len_(max_len), seed_(seed)
+    {
+    }
+    CompactRankList(const CompactRankList&)=delete;
+    CompactRankList& operator=(const CompactRankList&)=delete;
+
+    /// 当前是否是数组模式
+    bool IsSmall() const{
+        return large_== nullptr;
+    }
+    /// 重新设置随机层数的种子，之后转成跳表时也用它
+    void Seed(uint64_t seed){
+        seed_=seed;
+        if(large_) large_->Seed(seed);
+    }
+    /// 设置变化日志，事件同RankSkipList::SetChangeLog；nullptr表示不再记录
+    void SetChangeLog(SkipListChangeLog<K,V>* log){
+        change_log_=log;
+        if(large_) large_->SetChangeLog(log);
+    }
+    void Clear(){
+        emitChange(SkipListChange::Cleared,K(),V(),0,0);
+        large_.reset();
+        small_.clear();
+    }
+    /// 同RankSkipList::BuildFromSorted，结果不超过PROMOTE_AT时是数组模式
+    template<class Iter>
+    uint64_t BuildFromSorted(Iter first,Iter last){
+        return rebuild([&](List& list){ list.BuildFromSorted(first,last); });
+    }
+    /// 同RankSkipList::Build
+    template<class Iter>
+    uint64_t Build(Iter first,Iter last){
+        return rebuild([&](List& list){ list.Build(first,last); });
+    }
+    /// 插入或更新，max_len的淘汰规则同RankSkipList
+    /// \return 条目指针，没能上榜时为nullptr；数组模式下到下一次修改前有效
+    const Entry* InsertOrUpdate(const K& key,const V& val){
+        if(large_) return large_->InsertOrUpdate(key,val);
+        std::size_t old=findSmall(val);
+        bool existed=old<small_.size();
+        if(existed){
+            if(small_[old].key==key){
+                emitChange(SkipListChange::Moved,key,val,old+1,old+1);
+                return &small_[old];
+            }
+            small_.erase(small_.begin()+static_cast<std::ptrdiff_t>(old));
+        }
+        std::size_t pos=positionSmall(key,val);
+        //新条目，已满且排在末尾
+        if(!existed&&max_len_>0&&small_.size()>=max_len_&&pos==small_.size()) return nullptr;
+        small_.insert(small_.begin()+static_cast<std::ptrdiff_t>(pos),Entry{key,val});
+        if(existed) emitChange(SkipListChange::Moved,key,val,old+1,pos+1);
+        else emitChange(SkipListChange::Entered,key,val,0,pos+1);
+        if(max_len_>0&&small_.size()>max_len_) eraseSmall(small_.size()-1,small_.size());
+        if(small_.size()>PROMOTE_AT){
+            promote();
+            return large_->getNodeByRank(pos+1);
+        }
+        return &small_[pos];
+    }
+    /// 同RankSkipList::ApplyBatch，数组模式下逐个执行
+    void ApplyBatch(const SkipListBatchOp<K,V>* ops,std::size_t count){
+        if(large_){
+            large_->ApplyBatch(ops,count);
+            demoteIfShort();
+            return;
+        }
+        for(std::size_t i=0;i<count;i++){
+            if(ops[i].remove) DeleteNode(ops[i].value);
+            else InsertOrUpdate(ops[i].key,ops[i].value);
+        }
+    }
+    bool DeleteNode(const V& val){
+        if(large_){
+            if(!large_->DeleteNode(val)) return false;
+            demoteIfShort();
+            return true;
+        }
+        std::size_t i=findSmall(val);
+        if(i==small_.size()) return false;
+        eraseSmall(i,i+1);
+        return true;
+    }
+    /// 删除第rank名
+    uint64_t DeleteNodeByRank(uint64_t rank){
+        return DeleteNodeByRange(rank,rank);
+    }
+    /// 删除第start到end名，参数越界时不删除
+    uint64_t DeleteNodeByRange(uint64_t start,uint64_t end){
+        if(large_){
+            uint64_t removed=large_->DeleteNodeByRange(start,end);
+            demoteIfShort();
+            return removed;
+        }
+        if(!((start<=end)&&(start>0)&&(end<=small_.size()))) {
+            std::cout<<"DeleteNodeByRange parameter error "<<std::endl;
+            std::cout<<"start="<<start<<" end="<<end<<" length="<<small_.size()<<std::endl;
+            return 0;
+        }
+        return eraseSmall(start-1,end);
+    }
+    /// 删除key在[lo,hi]之间的所有条目
+    uint64_t DeleteNodeByKeyRange(const K& lo,const K& hi){
+        if(large_){
+            uint64_t removed=large_->DeleteNodeByKeyRange(lo,hi);
+            demoteIfShort();
+            return removed;
+        }
+        if(lo>hi) return 0;
+        return eraseSmall(countSmall([&](const Entry& entry){ return entry.key>hi; }),
+                          countSmall([&](const Entry& entry){ return !(lo>entry.key); }));
+    }
+    /// val的排名，不存在时为-1
+    int64_t Rank(const V& val){
+        if(large_) return large_->Rank(val);
+        std::size_t i=findSmall(val);
+        return i==small_.size()?-1:static_cast<int64_t>(i+1);
+    }
+    /// 同RankSkipList::getAroundRank
+    /// \param buffer 至少能放2n+1个，按排名顺序写入，包含val自己
+    int64_t getAroundRank(const V& val,uint64_t n,const Entry** buffer,uint64_t& count,uint64_t& first_rank){
+        count=0;
+        first_rank=0;
+        int64_t rank=Rank(val);
+        if(rank<0) return -1;
+        auto self=static_cast<uint64_t>(rank);
+        first_rank=self>n?self-n:1;
+        ForEachByRank(first_rank,self+n,[&](const Entry& entry){
+            buffer[count++]=&entry;
+        });
+        return rank;
+    }
+    const K* getKey(const V& val){
+        if(large_) return large_->getKey(val);
+        std::size_t i=findSmall(val);
+        return i==small_.size()? nullptr:&small_[i].key;
+    }
+    /// 第rank名的条目，越界时为nullptr
+    const Entry* getNodeByRank(uint64_t rank){
+        if(large_) return large_->getNodeByRank(rank);
+        if(rank==0||rank>small_.size()) return nullptr;
+        return &small_[rank-1];
+    }
+    bool has(const V& val){
+        if(large_) return large_->has(val);
+        return findSmall(val)<small_.size();
+    }
+    uint64_t length() const{
+        return large_?large_->length():small_.size();
+    }
+    /// 从第1名开始正向迭代
+    iterator begin() const{
+        if(large_) return iterator(large_->length()? &*large_->begin(): nullptr);
+        if(small_.empty()) return iterator();
+        return iterator(&small_.front(),&small_.front(),&small_.back());
+    }
+    iterator end() const{
+        return iterator();
+    }
+    /// 从最后一名开始反向迭代
+    reverse_iterator rbegin() const{
+        if(large_) return reverse_iterator(large_->length()? &*large_->rbegin(): nullptr);
+        if(small_.empty()) return reverse_iterator();
+        return reverse_iterator(&small_.back(),&small_.front(),&small_.back());
+    }
+    reverse_iterator rend() const{
+        return reverse_iterator();
+    }
+    /// 分数为key的新条目会排在第几名
+    uint64_t RankByKey(const K& key) const{
+        if(large_) return large_->RankByKey(key);
+        return countSmall([&](const Entry& entry){ return entry.key>key; })+1;
+    }
+    /// (key,val)这一条目的名次，不要求在榜上
+    uint64_t RankByKey(const K& key,const V& val) const{
+        if(large_) return large_->RankByKey(key,val);
+        return positionSmall(key,val)+1;
+    }
+    /// key在[lo,hi]之间的条目数
+    uint64_t CountInKeyRange(const K& lo,const K& hi) const{
+        if(large_) return large_->CountInKeyRange(lo,hi);
+        if(lo>hi) return 0;
+        return countSmall([&](const Entry& entry){ return !(lo>entry.key); })
+              -countSmall([&](const Entry& entry){ return entry.key>hi; });
+    }
+    /// 第rank名的分数，越界时为nullptr
+    const K* KeyAtRank(uint64_t rank){
+        const Entry* entry=getNodeByRank(rank);
+        return entry? &entry->key: nullptr;
+    }
+    /// 同RankSkipList::KeyAtPercentile
+    const K* KeyAtPercentile(double percentile){
+        if(large_) return large_->KeyAtPercentile(percentile);
+        if(small_.empty()||!(percentile>=0&&percentile<=100)) return nullptr;
+        auto rank=static_cast<uint64_t>(std::ceil((100-percentile)/100*static_cast<double>(small_.size())));
+        if(rank<1) rank=1;
+        if(rank>small_.size()) rank=small_.size();
+        return &small_[rank-1].key;
+    }
+    /// 按排名顺序访问第start到end名
+    /// \param fn void(const Entry&)
+    /// \return 访问的个数
+    template<class Fn>
+    uint64_t ForEachByRank(uint64_t start,uint64_t end,Fn&& fn){
+        if(large_) return large_->ForEachByRank(start,end,std::forward<Fn>(fn));
+        if(start==0) return 0;
+        uint64_t visited=0;
+        for(uint64_t rank=start;rank<=end&&rank<=small_.size();rank++,visited++) fn(small_[rank-1]);
+        return visited;
+    }
+    /// 按排名顺序访问key在[lo,hi]之间的条目
+    /// \param fn void(const Entry&)
+    /// \return 访问的个数
+    template<class Fn>
+    uint64_t ForEachByKey(const K& lo,const K& hi,Fn&& fn){
+        if(large_) return large_->ForEachByKey(lo,hi,std::forward<Fn>(fn));
+        if(lo>hi) return 0;
+        uint64_t visited=0;
+        for(std::size_t i=countSmall([&](const Entry& entry){ return entry.key>hi; });i<small_.size()&&!(lo>small_[i].key);i++,visited++){
+            fn(small_[i]);
+        }
+        return visited;
+    }
+};
+
+///大量小排行榜的注册表：按id管理CompactRankList，所有榜转成跳表后共享一个节点arena
+///  单线程使用，和RankSkipList一样不加锁
+template<class K,class V,class H=std::hash<V>,class P=SkipListPolicy<>>
+class LeaderboardRegistry{
+public:
+    using Board=CompactRankList<K,V,H,P>;
+private:
+    //共享的节点arena，声明在最前面，保证最后析构
+    typename Board::Arena arena_;
+    FlatHashMap<uint64_t,std::unique_ptr<Board>> boards_;
+    uint64_t seed_=0;
+
+public:
+    /// \param seed 各个榜的随机层数种子从它派生，0表示用random_device取
+    explicit LeaderboardRegistry(uint64_t seed=0):seed_(seed){}
+    LeaderboardRegistry(const LeaderboardRegistry&)=delete;
+    LeaderboardRegistry& operator=(const LeaderboardRegistry&)=delete;
+
+    /// 创建排行榜，已存在时返回原来的
+    Board* Create(uint64_t id,uint64_t max_len=0){
+        auto iter=boards_.find(id);
+        if(iter!=boards_.end()) return iter->second.get();
+        auto* board=new Board(max_len,seed_?seed_+id:0,&arena_);
+        boards_.emplace(id,std::unique_ptr<Board>(board));
+        return board;
+    }
+    /// 查找排行榜，不存在时为nullptr
+    Board* Find(uint64_t id){
+        auto iter=boards_.find(id);
+        return iter==boards_.end()? nullptr:iter->second.get();
+    }
+    /// 删除排行榜，跳表节点挂回共享arena
+    bool Remove(uint64_t id){
+        auto iter=boards_.find(id);
+        if(iter==boards_.end()) return false;
+        boards_.erase(id);
+        return true;
+    }
+    uint64_t size() const{
+        return boards_.size();
+    }
+};
+
+}
+
+#endif //GAMETOOLS_LEADERBOARD_REGISTRY_H
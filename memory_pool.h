@@ -6,9 +6,27 @@
 #define GAMETOOLS_MEMORY_POOL_H
 
 #include "singleton.h"
-#include <list>
-#include <unordered_map>
+#include <atomic>
+#include <cstdlib>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
 #include <iostream>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <condition_variable>
+#include <thread>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace GameTools{
 
@@ -16,125 +34,1353 @@ namespace GameTools{
 #define ENABLE_MEMORY_POOL 1
 #endif
 
+///调试：块前后加canary检查越界写，记录所有借出的块检查重复归还，内存池析构时报告没归还的块
 #ifndef ENABLE_DEBUG_MEMORY_POOL
 #define ENABLE_DEBUG_MEMORY_POOL 0
 #endif
 
+///按线程计数的分配统计(各级别、各标签的申请/归还次数)，只有本线程写，开销是每次申请/归还两个非原子加法
+#ifndef ENABLE_MEMORY_POOL_STATS
+#define ENABLE_MEMORY_POOL_STATS 1
+#endif
+
+///每个线程缓存一部分空闲内存块，分配和归还大多不加锁
+#ifndef ENABLE_MEMORY_POOL_THREAD_CACHE
+#define ENABLE_MEMORY_POOL_THREAD_CACHE 1
+#endif
+
+///不在块前面放大小头部，归还时从块所在slab开头的描述里取大小级别；为0时块前4个字节记录级别
+#ifndef ENABLE_MEMORY_POOL_HEADERLESS
+#define ENABLE_MEMORY_POOL_HEADERLESS 1
+#endif
+
+///定义成文件路径(字符串)时，MemPoolManager第一次创建时按这个文件预热，Singleton<MemoryPool>::destroy()时把这次的峰值写回去
+#ifdef MEMORY_POOL_PROFILE_PATH
+#define MemPoolManager GameTools::Singleton<GameTools::MemoryPool>::Instance(MEMORY_POOL_PROFILE_PATH)
+#else
 #define MemPoolManager GameTools::Singleton<GameTools::MemoryPool>::Instance()
+#endif
+
+///LoadProfile每个级别最多预热的字节数，文件损坏(块数特别大)时不会一次映射大量内存
+#ifndef MEMORY_POOL_PROFILE_MAX_BYTES
+#define MEMORY_POOL_PROFILE_MAX_BYTES (std::size_t(1)<<30)
+#endif
+
+///slab大小，必须是2的幂；每种大小的内存块从slab上切出来，块大小超过它时一个slab一个块
+#ifndef MEMORY_POOL_SLAB_SIZE
+#define MEMORY_POOL_SLAB_SIZE (64*1024)
+#endif
+
+///超过这个大小(含头部)的申请不走Chunk，直接mmap，归还时munmap
+#ifndef MEMORY_POOL_MMAP_THRESHOLD
+#define MEMORY_POOL_MMAP_THRESHOLD (256*1024)
+#endif
+
+namespace MemorySizeClassDetail{
+    template<class T,std::size_t N>
+    struct Table{
+        T values[N];
+    };
+    //级别数：8，16~128每16字节一级(8级)，128之后每个2的幂之间4级，到2^31
+    constexpr int32_t COUNT=1+8+(31-7)*4;
+    //这个大小以内直接查表
+    constexpr std::size_t LOOKUP_MAX=1024;
+    constexpr int32_t FloorLog2(std::size_t x){
+#if defined(__GNUC__)||defined(__clang__)
+        return 63-__builtin_clzll(static_cast<unsigned long long>(x));
+#else
+        int32_t lg=0;
+        while(x>>=1) lg++;
+        return lg;
+#endif
+    }
+    ///size所在的级别，用最高位下标算
+    constexpr int32_t ComputeIndex(std::size_t size){
+        if(size<=8) return 0;
+        if(size<=128) return static_cast<int32_t>((size+15)>>4);
+        int32_t lg=FloorLog2(size-1);
+        return 9+(lg-7)*4+static_cast<int32_t>((size-1-(static_cast<std::size_t>(1)<<lg))>>(lg-2));
+    }
+    constexpr Table<uint32_t,COUNT> MakeSizes(){
+        Table<uint32_t,COUNT> table{};
+        table.values[0]=8;
+        for(int32_t i=1;i<=8;i++) table.values[i]=static_cast<uint32_t>(16*i);
+        for(int32_t i=9;i<COUNT;i++){
+            int32_t lg=7+(i-9)/4;
+            table.values[i]=static_cast<uint32_t>((static_cast<std::size_t>(1)<<lg)+static_cast<std::size_t>((i-9)%4+1)*(static_cast<std::size_t>(1)<<(lg-2)));
+        }
+        return table;
+    }
+    ///下标k是大小为8k时的级别
+    constexpr Table<uint8_t,LOOKUP_MAX/8+1> MakeLookup(){
+        Table<uint8_t,LOOKUP_MAX/8+1> table{};
+        for(std::size_t k=0;k<=LOOKUP_MAX/8;k++) table.values[k]=static_cast<uint8_t>(ComputeIndex(k*8));
+        return table;
+    }
+    constexpr Table<uint32_t,COUNT> SIZES=MakeSizes();
+    constexpr Table<uint8_t,LOOKUP_MAX/8+1> LOOKUP=MakeLookup();
+}
+
+///内存块大小分级(jemalloc式)：8，16~128每16字节一级，之后每个2的幂之间分4级(160,192,224,256,320,...)，最大2^31
+///  内部碎片不超过20%(2的幂时接近50%)；两张表都在编译期生成
+///  大小==>级别：1024字节以内按8字节粒度查表，更大的用最高位下标算；级别==>大小查表
+struct MemorySizeClass{
+    //级别数
+    constexpr static int32_t COUNT=MemorySizeClassDetail::COUNT;
+    //最大的块
+    constexpr static std::size_t MAX_SIZE=static_cast<std::size_t>(1)<<31;
+
+    ///能放下size字节的最小级别，size不能超过MAX_SIZE
+    static constexpr int32_t Index(std::size_t size){
+        return size<=MemorySizeClassDetail::LOOKUP_MAX?MemorySizeClassDetail::LOOKUP.values[(size+7)>>3]
+                                                     :MemorySizeClassDetail::ComputeIndex(size);
+    }
+    ///级别index的块大小
+    static constexpr std::size_t Size(int32_t index){
+        return MemorySizeClassDetail::SIZES.values[index];
+    }
+    ///能放下size字节、块大小是align的倍数的最小级别，align是2的幂且不超过64
+    static constexpr int32_t AlignedIndex(std::size_t size,std::size_t align){
+        int32_t index=Index(size<align?align:size);
+        while(Size(index)%align!=0) index++;
+        return index;
+    }
+};
 
 ///相同大小内存块的管理
+///  内存按slab整块申请，同一种大小的块在内存里挨着
+///  slab按SLAB_SIZE对齐，开头64字节是描述(所属Chunk和大小级别)，块地址抹掉低位就找到描述
+///  空闲块用块自己的前8个字节串成单链表，申请、归还只改两个指针，不额外分配内存
+///  空闲链空了才从当前slab上切下一块，slab切完再申请新的slab，没用到的部分不会被写
+///  Trim把完全空闲的slab用madvise(MADV_DONTNEED)还给操作系统，slab的地址留着，之后需要新slab时先重用它们
 class Chunk{
 public:
+    constexpr static std::size_t SLAB_SIZE=MEMORY_POOL_SLAB_SIZE;
+    static_assert((SLAB_SIZE&(SLAB_SIZE-1))==0,"MEMORY_POOL_SLAB_SIZE must be a power of two");
+    //不属于任何级别、直接mmap的大块的size_class
+    constexpr static int32_t LARGE_CLASS=-2;
+
+    ///slab开头的描述，占一个cache line，块从它后面开始切，所以块起点都按64字节对齐
+    struct alignas(64) SlabHeader{
+        Chunk* chunk;
+        int32_t size_class;
+        //slab上的块数
+        uint32_t blocks;
+        //直接mmap的大块：映射的字节数
+        std::size_t mapped;
+        //Trim时统计的空闲块数，以及是否要还给操作系统
+        uint32_t trim_free;
+        bool trim_release;
+    };
+    static_assert(SLAB_SIZE>sizeof(SlabHeader),"MEMORY_POOL_SLAB_SIZE too small");
+
     Chunk(){};
     ~Chunk(){
-        for(auto p:mem_list_){
-            delete p;
+        for(auto slab:slabs_){
+            if(!inRegion(slab)) std::free(slab);
+        }
+        for(auto slab:idle_slabs_){
+            if(!inRegion(slab)) std::free(slab);
+        }
+        for(auto& region:regions_){
+            munmap(region.first,region.second);
         }
-        mem_list_.clear();
+        slabs_.clear();
+        idle_slabs_.clear();
+        regions_.clear();
     }
-    ///设置内存块大小
-    bool SetChunkSize(std::size_t size){
+    ///设置内存块大小，至少能放下一个指针
+    /// \param size_class 记在slab描述里的大小级别
+    bool SetChunkSize(std::size_t size,int32_t size_class=-1){
         if(chunk_size_==0){
-            chunk_size_=size;
+            chunk_size_=size<sizeof(FreeBlock)?sizeof(FreeBlock):size;
+            size_class_=size_class;
             return true;
         }
         return false;
     }
+    std::size_t ChunkSize() const{
+        return chunk_size_;
+    }
     ///获取内存块,优先从链上获得
     char* GemMemory(){
-        bool is_empty=false;
-        do{
-            std::lock_guard<std::mutex> lock(mutex_);
-            if(mem_list_.empty()){
-                is_empty=true;
-                break;
-            }
-            auto pointer=mem_list_.front();
-            mem_list_.pop_front();
-            return pointer;
-        }while(true);
-        if(is_empty){
-            char* new_char=new char[chunk_size_];
-            return new_char;
+        std::lock_guard<std::mutex> lock(mutex_);
+        return pop();
+    }
+    ///归还内存块 ，加入到链中；debug_tag不使用，保留原来的签名
+    void GiveBack(char* pointer,[[maybe_unused]] std::string debug_tag=""){
+        std::lock_guard<std::mutex> lock(mutex_);
+        push(pointer);
+    }
+    ///一次取count个内存块，链上不够时从slab上切
+    /// \return 取到的个数，申请slab失败时少于count
+    std::size_t FetchBatch(char** out,std::size_t count){
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::size_t got=0;
+        while(got<count){
+            char* pointer=pop();
+            if(pointer== nullptr) break;
+            out[got++]=pointer;
         }
-        return nullptr;
+        return got;
     }
-    ///归还内存块 ，加入到链中
-    void GiveBack(char* pointer,std::string debug_tag=""){
+    ///一次归还count个内存块
+    void ReleaseBatch(char* const* pointers,std::size_t count){
         std::lock_guard<std::mutex> lock(mutex_);
-        mem_list_.push_back(pointer);
+        for(std::size_t i=0;i<count;i++) push(pointers[i]);
     }
-    ///剩余内存块个数
+    ///剩余内存块个数(空闲链上的加上slab上还没切的)，不含各线程缓存中的
     std::size_t Size(){
-        return mem_list_.size();
+        std::lock_guard<std::mutex> lock(mutex_);
+        return free_count_+uncarved();
+    }
+    ///持有内存的slab个数，不含已经还给操作系统的
+    std::size_t SlabCount(){
+        std::lock_guard<std::mutex> lock(mutex_);
+        return slabs_.size();
+    }
+    ///借出去的块数(含在各线程缓存中的)
+    std::size_t InUse(){
+        std::lock_guard<std::mutex> lock(mutex_);
+        return in_use_;
+    }
+    ///借出去的块数的历史最大值
+    std::size_t PeakInUse(){
+        std::lock_guard<std::mutex> lock(mutex_);
+        return peak_in_use_;
+    }
+    ///预留的块数
+    std::size_t Reserved(){
+        std::lock_guard<std::mutex> lock(mutex_);
+        return reserved_;
+    }
+    ///预留：至少能放count块(借出的加空闲的)，不够的部分先用还给操作系统的slab，再一次mmap(MAP_POPULATE)一段连续的内存分成slab
+    ///  新slab上的块全部切好挂到空闲链上，页都已经分配好，之后申请不再缺页；之后非force的Trim不会把块数减到count以下
+    /// \return 是否预留到了count块
+    bool Reserve(std::size_t count){
+        std::lock_guard<std::mutex> lock(mutex_);
+        if(count>reserved_) reserved_=count;
+        std::size_t have=in_use_+free_count_+uncarved();
+        if(have>=count) return true;
+        std::size_t size=SlabBytes();
+        std::size_t per_slab=(size-sizeof(SlabHeader))/chunk_size_;
+        std::size_t need=(count-have+per_slab-1)/per_slab;
+        std::vector<char*> fresh;
+        while(fresh.size()<need&&!idle_slabs_.empty()){
+            fresh.push_back(idle_slabs_.back());
+            idle_slabs_.pop_back();
+        }
+        if(fresh.size()<need&&size==SLAB_SIZE){
+            std::size_t length=(need-fresh.size())*SLAB_SIZE;
+            char* region=mapAligned(length,true);
+            if(region){
+                regions_.emplace_back(region,length);
+                for(std::size_t offset=0;offset<length;offset+=SLAB_SIZE) fresh.push_back(region+offset);
+            }
+        }
+        //大块的slab不是SLAB_SIZE的倍数，连续映射时中间要空出对齐的间隙，所以逐个申请
+        while(fresh.size()<need){
+            void* memory=nullptr;
+            if(posix_memalign(&memory,SLAB_SIZE,size)!=0) break;
+            fresh.push_back(static_cast<char*>(memory));
+        }
+        //倒着挂，按地址从低到高取出
+        for(auto iter=fresh.rbegin();iter!=fresh.rend();iter++){
+            char* slab=*iter;
+            new(slab) SlabHeader{this,size_class_,static_cast<uint32_t>(per_slab),0,0,false};
+            slabs_.push_back(slab);
+            for(std::size_t i=per_slab;i>0;i--) link(slab+sizeof(SlabHeader)+(i-1)*chunk_size_);
+        }
+        return fresh.size()==need;
+    }
+    ///已经还给操作系统、等待重用的slab个数
+    std::size_t IdleSlabCount(){
+        std::lock_guard<std::mutex> lock(mutex_);
+        return idle_slabs_.size();
+    }
+    ///把完全空闲的slab还给操作系统，留下最近用量高峰需要的空闲块
+    ///  高水位是上次Trim以来同时借出(含在各线程缓存中)的最多块数；保留高水位-当前借出数个空闲块，然后高水位重置为当前借出数
+    ///  所以高峰刚过的那次Trim不释放，之后一个周期里没有再到高峰才释放；Reserve过的，高水位不低于预留的块数
+    /// \param force 为true时不保留空闲块
+    /// \return 还给操作系统的字节数
+    std::size_t Trim(bool force=false){
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::size_t floor=high_water_>reserved_?high_water_:reserved_;
+        std::size_t keep=force||floor<in_use_?0:floor-in_use_;
+        high_water_=in_use_;
+        std::size_t total_free=free_count_+uncarved();
+        if(slabs_.empty()||total_free<=keep) return 0;
+        //按slab统计空闲块
+        for(auto slab:slabs_) header(slab)->trim_free=0;
+        for(FreeBlock* block=free_list_;block;block=block->next) SlabOf(block)->trim_free++;
+        if(uncarved()) SlabOf(carve_)->trim_free+=static_cast<uint32_t>(uncarved());
+        std::size_t release_blocks=0;
+        for(auto slab:slabs_){
+            SlabHeader* desc=header(slab);
+            desc->trim_release=desc->trim_free==desc->blocks&&total_free-release_blocks>=keep+desc->blocks;
+            if(desc->trim_release) release_blocks+=desc->blocks;
+        }
+        if(release_blocks==0) return 0;
+        //空闲链上去掉要释放的slab上的块
+        FreeBlock** link=&free_list_;
+        while(*link){
+            if(SlabOf(*link)->trim_release){
+                *link=(*link)->next;
+                free_count_--;
+            }else{
+                link=&(*link)->next;
+            }
+        }
+        if(uncarved()&&SlabOf(carve_)->trim_release) carve_=carve_end_=nullptr;
+        std::size_t bytes=0;
+        std::size_t kept=0;
+        for(auto slab:slabs_){
+            if(header(slab)->trim_release){
+                bytes+=decommit(slab);
+                idle_slabs_.push_back(slab);
+            }else{
+                slabs_[kept++]=slab;
+            }
+        }
+        slabs_.resize(kept);
+        return bytes;
+    }
+    ///每个slab的字节数：放不下描述加一个块时，slab就是描述加一个块，块起点仍在slab的前SLAB_SIZE字节内
+    std::size_t SlabBytes() const{
+        std::size_t size=sizeof(SlabHeader)+chunk_size_;
+        return size<SLAB_SIZE?SLAB_SIZE:size;
+    }
+    ///块所在slab的描述，pointer必须是Chunk切出来的块(或块的前SLAB_SIZE字节内)
+    static SlabHeader* SlabOf(const void* pointer){
+        return reinterpret_cast<SlabHeader*>(reinterpret_cast<uintptr_t>(pointer)&~static_cast<uintptr_t>(SLAB_SIZE-1));
+    }
+    ///直接mmap一块能放下size字节的内存，前面是SlabHeader，返回描述后的地址，失败时为nullptr
+    static char* MapLarge(std::size_t size){
+        if(size>SIZE_MAX-sizeof(SlabHeader)-2*SLAB_SIZE) return nullptr;
+        std::size_t length=pageAlign(sizeof(SlabHeader)+size);
+        char* base=mapAligned(length);
+        if(base== nullptr) return nullptr;
+        new(base) SlabHeader{nullptr,LARGE_CLASS,1,length,0,false};
+        return base+sizeof(SlabHeader);
+    }
+    ///归还MapLarge的内存
+    /// \return 映射的字节数
+    static std::size_t UnmapLarge(char* pointer){
+        SlabHeader* desc=SlabOf(pointer);
+        std::size_t length=desc->mapped;
+        munmap(desc,length);
+        return length;
     }
 
 private:
+    ///空闲块的前8个字节
+    struct FreeBlock{
+        FreeBlock* next;
+    };
+    static SlabHeader* header(char* slab){
+        return reinterpret_cast<SlabHeader*>(slab);
+    }
+    static std::size_t pageAlign(std::size_t size){
+        static const std::size_t page=static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        return (size+page-1)/page*page;
+    }
+    ///mmap起点按SLAB_SIZE对齐的length字节，length是页的整数倍
+    /// \param populate 是否马上分配物理页
+    static char* mapAligned(std::size_t length,bool populate=false){
+        //多映射SLAB_SIZE，把起点对齐到SLAB_SIZE后两头多余的部分unmap掉
+        void* memory=mmap(nullptr,length+SLAB_SIZE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|(populate?MAP_POPULATE:0),-1,0);
+        if(memory==MAP_FAILED) return nullptr;
+        auto begin=reinterpret_cast<uintptr_t>(memory);
+        uintptr_t aligned=(begin+SLAB_SIZE-1)&~static_cast<uintptr_t>(SLAB_SIZE-1);
+        if(aligned>begin) munmap(memory,aligned-begin);
+        if(aligned+length<begin+length+SLAB_SIZE) munmap(reinterpret_cast<void*>(aligned+length),begin+length+SLAB_SIZE-aligned-length);
+        return reinterpret_cast<char*>(aligned);
+    }
+    ///slab是否在Reserve映射的连续内存里，这样的slab不能单独free
+    bool inRegion(const char* slab) const{
+        for(auto& region:regions_){
+            if(slab>=region.first&&slab<region.first+region.second) return true;
+        }
+        return false;
+    }
+    ///需要持有mutex_
+    std::size_t uncarved() const{
+        return static_cast<std::size_t>(carve_end_-carve_)/chunk_size_;
+    }
+    ///需要持有mutex_
+    char* pop(){
+        char* pointer;
+        if(free_list_){
+            FreeBlock* block=free_list_;
+            free_list_=block->next;
+            free_count_--;
+            pointer=reinterpret_cast<char*>(block);
+        }else{
+            if(carve_==carve_end_&&!newSlab()) return nullptr;
+            pointer=carve_;
+            carve_+=chunk_size_;
+        }
+        if(++in_use_>high_water_){
+            high_water_=in_use_;
+            if(high_water_>peak_in_use_) peak_in_use_=high_water_;
+        }
+        return pointer;
+    }
+    ///需要持有mutex_
+    void push(char* pointer){
+        link(pointer);
+        in_use_--;
+    }
+    ///挂到空闲链上，需要持有mutex_
+    void link(char* pointer){
+        auto* block=reinterpret_cast<FreeBlock*>(pointer);
+        block->next=free_list_;
+        free_list_=block;
+        free_count_++;
+    }
+    ///slab的内存还给操作系统，地址保留；整页的部分才能还
+    /// \return 还掉的字节数
+    std::size_t decommit(char* slab){
+        static const std::size_t page=static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        std::size_t length=SlabBytes()/page*page;
+        if(length==0||madvise(slab,length,MADV_DONTNEED)!=0) return 0;
+        return length;
+    }
+    bool newSlab(){
+        std::size_t size=SlabBytes();
+        char* slab=nullptr;
+        if(!idle_slabs_.empty()){
+            //重用还给操作系统的slab，访问时重新分配物理页
+            slab=idle_slabs_.back();
+            idle_slabs_.pop_back();
+        }else{
+            void* memory=nullptr;
+            if(posix_memalign(&memory,SLAB_SIZE,size)!=0) return false;
+            slab=static_cast<char*>(memory);
+        }
+        std::size_t blocks=(size-sizeof(SlabHeader))/chunk_size_;
+        new(slab) SlabHeader{this,size_class_,static_cast<uint32_t>(blocks),0,0,false};
+        slabs_.push_back(slab);
+        carve_=slab+sizeof(SlabHeader);
+        carve_end_=carve_+blocks*chunk_size_;
+        return true;
+    }
+
     std::size_t chunk_size_=0;
+    int32_t size_class_=-1;
+    std::mutex mutex_;
+    FreeBlock* free_list_=nullptr;///空闲内存块链，后进先出，刚归还的块还在cache里
+    std::size_t free_count_=0;
+    //当前slab上还没切的部分[carve_,carve_end_)
+    char* carve_=nullptr;
+    char* carve_end_=nullptr;
+    //持有内存的slab
+    std::vector<char*> slabs_;
+    //已经madvise还给操作系统的slab，地址还是自己的
+    std::vector<char*> idle_slabs_;
+    //Reserve一次映射的连续内存(起点，字节数)，析构时整段unmap
+    std::vector<std::pair<char*,std::size_t>> regions_;
+    //Reserve的块数，Trim不减到它以下
+    std::size_t reserved_=0;
+    //借出去的块数(含在线程缓存中的)，以及上次Trim以来的最大值
+    std::size_t in_use_=0;
+    std::size_t high_water_=0;
+    std::size_t peak_in_use_=0;
+
+};
+
+///一个线程在一个内存池上的分配计数
+///  只有所属线程写，用relaxed的读+写代替原子加，没有lock前缀；MemoryPool::Stats从其他线程relaxed读
+struct MemoryPoolCounters{
+    constexpr static int32_t MAX_CLASS=MemorySizeClass::COUNT;
+    //标签数，0表示不带标签
+    constexpr static uint32_t MAX_TAGS=64;
+
+    std::atomic<uint64_t> class_allocs[MAX_CLASS]{};
+    std::atomic<uint64_t> class_frees[MAX_CLASS]{};
+    //标签的字节数按块大小(直接mmap的按映射大小)计；标签0不计，由总数减去其他标签得到
+    std::atomic<uint64_t> tag_allocs[MAX_TAGS]{};
+    std::atomic<uint64_t> tag_frees[MAX_TAGS]{};
+    std::atomic<uint64_t> tag_alloc_bytes[MAX_TAGS]{};
+    std::atomic<uint64_t> tag_free_bytes[MAX_TAGS]{};
+    //直接mmap的大块
+    std::atomic<uint64_t> large_allocs{0};
+    std::atomic<uint64_t> large_frees{0};
+    std::atomic<uint64_t> large_alloc_bytes{0};
+    std::atomic<uint64_t> large_free_bytes{0};
+
+    ///只能由唯一写这个计数的线程调用
+    static void Add(std::atomic<uint64_t>& counter,uint64_t value){
+        counter.store(counter.load(std::memory_order_relaxed)+value,std::memory_order_relaxed);
+    }
+    ///other的计数加到自己上
+    void Merge(const MemoryPoolCounters& other){
+        for(int32_t i=0;i<MAX_CLASS;i++){
+            Add(class_allocs[i],other.class_allocs[i].load(std::memory_order_relaxed));
+            Add(class_frees[i],other.class_frees[i].load(std::memory_order_relaxed));
+        }
+        for(uint32_t i=0;i<MAX_TAGS;i++){
+            Add(tag_allocs[i],other.tag_allocs[i].load(std::memory_order_relaxed));
+            Add(tag_frees[i],other.tag_frees[i].load(std::memory_order_relaxed));
+            Add(tag_alloc_bytes[i],other.tag_alloc_bytes[i].load(std::memory_order_relaxed));
+            Add(tag_free_bytes[i],other.tag_free_bytes[i].load(std::memory_order_relaxed));
+        }
+        Add(large_allocs,other.large_allocs.load(std::memory_order_relaxed));
+        Add(large_frees,other.large_frees.load(std::memory_order_relaxed));
+        Add(large_alloc_bytes,other.large_alloc_bytes.load(std::memory_order_relaxed));
+        Add(large_free_bytes,other.large_free_bytes.load(std::memory_order_relaxed));
+    }
+};
+
+///所有线程共享的部分：每个大小级别一个Chunk，按级别下标，创建后不再移动
+///  线程缓存持有它的shared_ptr，线程退出时MemoryPool已析构也能把缓存还回来
+///  各线程的计数登记在这里，线程退出时并入retired_
+class MemoryPoolCentral{
+public:
+    constexpr static int32_t MAX_CLASS=MemorySizeClass::COUNT;
+
+    MemoryPoolCentral(){
+        for(auto& chunk:chunks_) chunk.store(nullptr,std::memory_order_relaxed);
+    }
+    ~MemoryPoolCentral(){
+        for(auto& chunk:chunks_) delete chunk.load(std::memory_order_relaxed);
+    }
+    ///取下标为index的Chunk，不存在时创建；已存在时不加锁
+    Chunk* GetChunk(int32_t index){
+        Chunk* chunk=chunks_[index].load(std::memory_order_acquire);
+        if(chunk!= nullptr) return chunk;
+        std::lock_guard<std::mutex> lock(create_mutex_);
+        chunk=chunks_[index].load(std::memory_order_relaxed);
+        if(chunk== nullptr){
+            chunk=new Chunk();
+            chunk->SetChunkSize(MemorySizeClass::Size(index),index);
+            chunks_[index].store(chunk,std::memory_order_release);
+        }
+        return chunk;
+    }
+    ///取下标为index的Chunk，不存在时为nullptr
+    Chunk* FindChunk(int32_t index) const{
+        return chunks_[index].load(std::memory_order_acquire);
+    }
+    ///每个Chunk做一次Trim
+    /// \return 还给操作系统的字节数
+    std::size_t Trim(bool force=false){
+        std::size_t bytes=0;
+        for(int32_t index=0;index<MAX_CLASS;index++){
+            if(Chunk* chunk=FindChunk(index)) bytes+=chunk->Trim(force);
+        }
+        return bytes;
+    }
+    ///直接mmap的大块
+    char* MapLarge(std::size_t size){
+        char* pointer=Chunk::MapLarge(size);
+        if(pointer) large_bytes_.fetch_add(Chunk::SlabOf(pointer)->mapped,std::memory_order_relaxed);
+        return pointer;
+    }
+    /// \return 映射的字节数
+    std::size_t UnmapLarge(char* pointer){
+        std::size_t bytes=Chunk::UnmapLarge(pointer);
+        large_bytes_.fetch_sub(bytes,std::memory_order_relaxed);
+        return bytes;
+    }
+    ///直接mmap、还没归还的字节数
+    std::size_t LargeBytes() const{
+        return large_bytes_.load(std::memory_order_relaxed);
+    }
+
+    ///登记一个线程的计数
+    void AttachCounters(const MemoryPoolCounters* counters){
+        std::lock_guard<std::mutex> lock(counters_mutex_);
+        attached_.push_back(counters);
+    }
+    ///线程退出：计数并入retired_，不再登记
+    void RetireCounters(const MemoryPoolCounters* counters){
+        std::lock_guard<std::mutex> lock(counters_mutex_);
+        retired_.Merge(*counters);
+        for(auto iter=attached_.begin();iter!=attached_.end();iter++){
+            if(*iter==counters){
+                attached_.erase(iter);
+                break;
+            }
+        }
+    }
+    ///所有线程(含已退出的)的计数加到sum上
+    void SumCounters(MemoryPoolCounters& sum){
+        std::lock_guard<std::mutex> lock(counters_mutex_);
+        sum.Merge(retired_);
+        for(auto counters:attached_) sum.Merge(*counters);
+    }
+    ///注册标签，同名的返回同一个id；标签用完时返回0
+    uint16_t RegisterTag(const std::string& name){
+        std::lock_guard<std::mutex> lock(counters_mutex_);
+        for(std::size_t id=0;id<tag_names_.size();id++){
+            if(tag_names_[id]==name) return static_cast<uint16_t>(id);
+        }
+        if(tag_names_.size()>=MemoryPoolCounters::MAX_TAGS) return 0;
+        tag_names_.push_back(name);
+        return static_cast<uint16_t>(tag_names_.size()-1);
+    }
+    ///标签名，下标是标签id
+    std::vector<std::string> TagNames(){
+        std::lock_guard<std::mutex> lock(counters_mutex_);
+        return tag_names_;
+    }
+
+private:
+    std::atomic<Chunk*> chunks_[MAX_CLASS];
+    std::mutex create_mutex_;
+    std::atomic<std::size_t> large_bytes_{0};
+    std::mutex counters_mutex_;
+    std::vector<const MemoryPoolCounters*> attached_;
+    MemoryPoolCounters retired_;
+    std::vector<std::string> tag_names_{"untagged"};
+};
+
+///一个线程在一个内存池上的缓存：每个大小级别一个小栈
+///  空了从Chunk一次取一批，满了一次还一半，只有批量搬运时才加Chunk的锁
+///  每个级别最多缓存的字节数有上限，大块只缓存几个；所有级别的栈在一个数组里
+///  也存放本线程的分配计数；关掉线程缓存时只用来计数，不分配栈
+class MemoryPoolThreadCache{
+public:
+    //每个级别最多缓存的块数
+    constexpr static uint32_t MAX_CACHED=64;
+    //每个级别最多缓存的字节数
+    constexpr static std::size_t MAX_CACHED_BYTES=256*1024;
+
+    MemoryPoolThreadCache(uint64_t pool_id,std::shared_ptr<MemoryPoolCentral> central)
+            : pool_id_(pool_id), central_(std::move(central))
+    {
+#if ENABLE_MEMORY_POOL_THREAD_CACHE
+        std::size_t total=0;
+        for(int32_t index=0;index<MemoryPoolCentral::MAX_CLASS;index++) total+=Capacity(index);
+        storage_.resize(total);
+        std::size_t offset=0;
+        for(int32_t index=0;index<MemoryPoolCentral::MAX_CLASS;index++){
+            bins_[index].items=storage_.data()+offset;
+            bins_[index].capacity=Capacity(index);
+            offset+=bins_[index].capacity;
+        }
+#endif
+#if ENABLE_MEMORY_POOL_STATS
+        central_->AttachCounters(&counters_);
+#endif
+    }
+    ~MemoryPoolThreadCache(){
+        Flush();
+#if ENABLE_MEMORY_POOL_STATS
+        central_->RetireCounters(&counters_);
+#endif
+    }
+    MemoryPoolThreadCache(const MemoryPoolThreadCache&)=delete;
+    MemoryPoolThreadCache& operator=(const MemoryPoolThreadCache&)=delete;
+
+    uint64_t PoolId() const{
+        return pool_id_;
+    }
+    ///本线程的分配计数
+    MemoryPoolCounters& Counters(){
+        return counters_;
+    }
+    ///级别index缓存了几个块
+    uint32_t Cached(int32_t index) const{
+        return bins_[index].count;
+    }
+    ///缓存的块全部还给Chunk
+    void Flush(){
+        for(int32_t index=0;index<MemoryPoolCentral::MAX_CLASS;index++){
+            Bin& bin=bins_[index];
+            if(bin.count) central_->GetChunk(index)->ReleaseBatch(bin.items,bin.count);
+            bin.count=0;
+        }
+    }
+    char* Get(int32_t index){
+        Bin& bin=bins_[index];
+        if(bin.count==0){
+            bin.count=static_cast<uint32_t>(central_->GetChunk(index)->FetchBatch(bin.items,bin.capacity/2));
+            if(bin.count==0) return nullptr;
+        }
+        return bin.items[--bin.count];
+    }
+    void Put(int32_t index,char* pointer){
+        Bin& bin=bins_[index];
+        if(bin.count==bin.capacity){
+            //还掉较早的一半，留下刚归还的
+            uint32_t batch=bin.capacity/2;
+            central_->GetChunk(index)->ReleaseBatch(bin.items,batch);
+            for(uint32_t i=batch;i<bin.count;i++) bin.items[i-batch]=bin.items[i];
+            bin.count-=batch;
+        }
+        bin.items[bin.count++]=pointer;
+    }
+    ///级别index最多缓存的块数，至少2个
+    static uint32_t Capacity(int32_t index){
+        std::size_t by_bytes=MAX_CACHED_BYTES/MemorySizeClass::Size(index);
+        if(by_bytes<2) return 2;
+        return by_bytes<MAX_CACHED?static_cast<uint32_t>(by_bytes):MAX_CACHED;
+    }
+
+private:
+    struct Bin{
+        char** items=nullptr;
+        uint32_t count=0;
+        uint32_t capacity=0;
+    };
+    uint64_t pool_id_;
+    std::shared_ptr<MemoryPoolCentral> central_;
+    Bin bins_[MemoryPoolCentral::MAX_CLASS];
+    std::vector<char*> storage_;
+    MemoryPoolCounters counters_;
+};
+
+
+///后台定期Trim的线程，只能还各个Chunk里的空闲块，各线程缓存里的不动
+class MemoryPoolTrimThread{
+public:
+    MemoryPoolTrimThread(std::shared_ptr<MemoryPoolCentral> central,std::chrono::milliseconds interval)
+            : central_(std::move(central)), interval_(interval), thread_([this]{ run(); })
+    {
+    }
+    ~MemoryPoolTrimThread(){
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_=true;
+        }
+        cond_.notify_one();
+        thread_.join();
+    }
+    MemoryPoolTrimThread(const MemoryPoolTrimThread&)=delete;
+    MemoryPoolTrimThread& operator=(const MemoryPoolTrimThread&)=delete;
+    ///累计还给操作系统的字节数
+    std::size_t TrimmedBytes() const{
+        return trimmed_.load(std::memory_order_relaxed);
+    }
+
+private:
+    void run(){
+        std::unique_lock<std::mutex> lock(mutex_);
+        while(!cond_.wait_for(lock,interval_,[this]{ return stop_; })){
+            lock.unlock();
+            trimmed_.fetch_add(central_->Trim(),std::memory_order_relaxed);
+            lock.lock();
+        }
+    }
+
+    std::shared_ptr<MemoryPoolCentral> central_;
+    std::chrono::milliseconds interval_;
     std::mutex mutex_;
-    std::list<char*> mem_list_;///空闲内存块链
+    std::condition_variable cond_;
+    bool stop_=false;
+    std::atomic<std::size_t> trimmed_{0};
+    //最后声明，其他成员初始化完再启动线程
+    std::thread thread_;
+};
 
+///一个大小级别的统计
+struct MemoryPoolClassStats{
+    std::size_t block_size=0;
+    uint64_t allocs=0;
+    uint64_t frees=0;
+    //申请减归还
+    uint64_t live_blocks=0;
+    uint64_t live_bytes=0;
+    //同时借出的块数(含在各线程缓存中的)的历史最大值
+    uint64_t peak_blocks=0;
+    //Chunk里剩余的块数，不含各线程缓存中的
+    uint64_t free_blocks=0;
+    uint64_t slabs=0;
+    uint64_t slab_bytes=0;
+};
+///一个标签的统计，字节数按块大小(直接mmap的按映射大小)计
+struct MemoryPoolTagStats{
+    std::string name;
+    uint64_t allocs=0;
+    uint64_t frees=0;
+    uint64_t live_blocks=0;
+    uint64_t live_bytes=0;
 };
+///MemoryPool::Stats导出的统计快照，各线程的计数分别读，不是同一时刻的精确值
+struct MemoryPoolStats{
+    //取快照时的steady_clock，纳秒
+    uint64_t time_ns=0;
+    //含直接mmap的大块
+    uint64_t total_allocs=0;
+    uint64_t total_frees=0;
+    uint64_t live_blocks=0;
+    uint64_t live_bytes=0;
+    uint64_t large_allocs=0;
+    uint64_t large_frees=0;
+    uint64_t large_live_bytes=0;
+    //各级别借出块数峰值之和加上当前直接mmap的字节数，是用量峰值的上界
+    uint64_t peak_bytes=0;
+    //slab和直接mmap占用的字节数，不含已经还给操作系统的
+    uint64_t held_bytes=0;
+    //用过的级别
+    std::vector<MemoryPoolClassStats> classes;
+    //下标是标签id，0是不带标签的
+    std::vector<MemoryPoolTagStats> tags;
 
+    ///从earlier到这次快照每秒的申请次数
+    double AllocRate(const MemoryPoolStats& earlier) const{
+        return rate(total_allocs-earlier.total_allocs,earlier);
+    }
+    ///从earlier到这次快照每秒的归还次数
+    double FreeRate(const MemoryPoolStats& earlier) const{
+        return rate(total_frees-earlier.total_frees,earlier);
+    }
+
+private:
+    double rate(uint64_t count,const MemoryPoolStats& earlier) const{
+        if(time_ns<=earlier.time_ns) return 0;
+        return static_cast<double>(count)*1e9/static_cast<double>(time_ns-earlier.time_ns);
+    }
+};
 
 ///内存池
+///  块大小按MemorySizeClass分级，每个级别一个Chunk；每个线程在Chunk前面有一层缓存，常见路径只访问线程自己的缓存，不加锁
+///  线程退出时缓存的块还给Chunk；块可以在一个线程申请、另一个线程归还
+///  默认无头部：返回的就是块起点，归还时从slab描述取级别，或者用GiveBack(pointer,size)直接算
+///  超过MEMORY_POOL_MMAP_THRESHOLD的申请直接mmap；Trim或后台线程把空闲的slab还给操作系统
+///  ENABLE_MEMORY_POOL_STATS时按级别、按标签计数，计数在各线程自己的缓存里，Stats汇总
+///  ENABLE_DEBUG_MEMORY_POOL时每块前后加金丝雀并登记所有借出的块，检查重复归还和越界写，析构时报告泄漏
 class MemoryPool{
 private:
-    std::unordered_map<std::size_t ,Chunk> pool_;
-    /// return 大于等于num的最小2的次方
-    /// \param num
-    /// \return
-    int32_t upToPowerOfTwo(int32_t num){
-        if(num<=0) return  0;
-        int count=0;
-        num--;///防止num本就是2的次方
-        while(num!=0){
-            num=num>>1;
-            count++;
-        }
-        return 1<<count;
+    uint64_t id_;
+    std::shared_ptr<MemoryPoolCentral> central_;
+    std::unique_ptr<MemoryPoolTrimThread> trim_thread_;
+    //构造时预热、析构时写峰值的文件，空表示不用
+    std::string profile_path_;
+    //头部模式下直接mmap的大块记的级别
+    constexpr static std::uint32_t LARGE_TAG=0xff;
+#if ENABLE_DEBUG_MEMORY_POOL
+    //金丝雀的字节值
+    constexpr static unsigned char CANARY=0xfd;
+    //泄漏报告最多逐个列出的块数
+    constexpr static std::size_t LEAK_REPORT_LIMIT=16;
+    ///借出的块：申请的大小、标签、返回地址离块起点的字节数
+    struct DebugBlock{
+        std::size_t size;
+        uint16_t tag;
+        std::size_t offset;
+    };
+    std::mutex debug_mutex_;
+    std::unordered_map<const char*,DebugBlock> debug_blocks_;
+#endif
+    static uint64_t nextPoolId(){
+        static std::atomic<uint64_t> next_id{1};
+        return next_id.fetch_add(1,std::memory_order_relaxed);
+    }
+#if ENABLE_MEMORY_POOL_THREAD_CACHE||ENABLE_MEMORY_POOL_STATS
+    ///本线程在各个内存池上的缓存，线程退出时析构
+    struct ThreadCaches{
+        std::vector<std::unique_ptr<MemoryPoolThreadCache>> caches;
+        MemoryPoolThreadCache* last=nullptr;
+    };
+    static ThreadCaches& threadCaches(){
+        thread_local ThreadCaches caches;
+        return caches;
+    }
+    ///本线程在这个内存池上的缓存，第一次使用时创建
+    MemoryPoolThreadCache* threadCache(){
+        ThreadCaches& local=threadCaches();
+        if(local.last&&local.last->PoolId()==id_) return local.last;
+        for(auto& cache:local.caches){
+            if(cache->PoolId()==id_){
+                local.last=cache.get();
+                return local.last;
+            }
+        }
+        local.caches.emplace_back(new MemoryPoolThreadCache(id_,central_));
+        local.last=local.caches.back().get();
+        return local.last;
+    }
+#endif
+    ///本线程的缓存，一次申请/归还只取一次；既不缓存也不计数时为nullptr
+    MemoryPoolThreadCache* localCache(){
+#if ENABLE_MEMORY_POOL_THREAD_CACHE||ENABLE_MEMORY_POOL_STATS
+        return threadCache();
+#else
+        return nullptr;
+#endif
+    }
+    char* getBlock(MemoryPoolThreadCache* cache,int32_t index){
+#if ENABLE_MEMORY_POOL_THREAD_CACHE
+        return cache->Get(index);
+#else
+        (void)cache;
+        return central_->GetChunk(index)->GemMemory();
+#endif
+    }
+    void putBlock(MemoryPoolThreadCache* cache,int32_t index,char* block){
+#if ENABLE_MEMORY_POOL_THREAD_CACHE
+        cache->Put(index,block);
+#else
+        (void)cache;
+        central_->GetChunk(index)->GiveBack(block);
+#endif
+    }
+    ///返回地址离块起点的字节数：头部和金丝雀放在前面，再按align取整(align为0表示默认对齐)
+    constexpr static std::size_t offsetFor(std::size_t align){
+        return align<=1?HEADER_SIZE+DEBUG_PREFIX:(HEADER_SIZE+DEBUG_PREFIX+align-1)/align*align;
+    }
+    ///size字节的申请在级别里要占的字节数，超过MMAP_THRESHOLD时直接mmap
+    constexpr static std::size_t blockBytes(std::size_t size,std::size_t offset){
+        return size>MMAP_THRESHOLD?MMAP_THRESHOLD+1:offset+size+DEBUG_SUFFIX;
+    }
+    constexpr static int32_t classFor(std::size_t bytes,std::size_t align){
+        return align<=1?MemorySizeClass::Index(bytes):MemorySizeClass::AlignedIndex(bytes,align);
+    }
+    ///记一次申请或归还；index为Chunk::LARGE_CLASS时是直接mmap的大块，bytes是映射的字节数
+    void count(MemoryPoolThreadCache* cache,bool alloc,int32_t index,uint16_t tag,std::size_t bytes){
+#if ENABLE_MEMORY_POOL_STATS
+        MemoryPoolCounters& counters=cache->Counters();
+        if(index==Chunk::LARGE_CLASS){
+            MemoryPoolCounters::Add(alloc?counters.large_allocs:counters.large_frees,1);
+            MemoryPoolCounters::Add(alloc?counters.large_alloc_bytes:counters.large_free_bytes,bytes);
+        }else{
+            MemoryPoolCounters::Add(alloc?counters.class_allocs[index]:counters.class_frees[index],1);
+        }
+        if(tag==0||tag>=MemoryPoolCounters::MAX_TAGS) return;
+        MemoryPoolCounters::Add(alloc?counters.tag_allocs[tag]:counters.tag_frees[tag],1);
+        MemoryPoolCounters::Add(alloc?counters.tag_alloc_bytes[tag]:counters.tag_free_bytes[tag],bytes);
+#else
+        (void)cache;
+        (void)alloc;
+        (void)index;
+        (void)tag;
+        (void)bytes;
+#endif
+    }
+#if ENABLE_DEBUG_MEMORY_POOL
+    ///写金丝雀并登记
+    void debugAcquire(char* pointer,std::size_t size,uint16_t tag,std::size_t offset){
+        std::memset(pointer-HEADER_SIZE-DEBUG_PREFIX,CANARY,DEBUG_PREFIX);
+        std::memset(pointer+size,CANARY,DEBUG_SUFFIX);
+        std::lock_guard<std::mutex> lock(debug_mutex_);
+        debug_blocks_[pointer]=DebugBlock{size,tag,offset};
+    }
+    static bool canaryIntact(const char* begin,std::size_t length){
+        for(std::size_t i=0;i<length;i++){
+            if(static_cast<unsigned char>(begin[i])!=CANARY) return false;
+        }
+        return true;
+    }
+    ///取消登记并检查金丝雀
+    /// \param size 归还时传的大小，SIZE_MAX表示不知道
+    /// \return 是否是借出的块，不是时不能归还
+    bool debugRelease(char* pointer,std::size_t size,uint16_t tag,const std::string& debug_tag,DebugBlock& block){
+        {
+            std::lock_guard<std::mutex> lock(debug_mutex_);
+            auto iter=debug_blocks_.find(pointer);
+            if(iter==debug_blocks_.end()){
+                std::cout<<"内存池: "<<static_cast<void*>(pointer)<<" 重复归还或不是内存池分配的 "<<debug_tag<<std::endl;
+                return false;
+            }
+            block=iter->second;
+            debug_blocks_.erase(iter);
+        }
+        if(!canaryIntact(pointer-HEADER_SIZE-DEBUG_PREFIX,DEBUG_PREFIX)){
+            std::cout<<"内存池: "<<static_cast<void*>(pointer)<<" 前面的金丝雀被改写 "<<debug_tag<<std::endl;
+        }
+        if(!canaryIntact(pointer+block.size,DEBUG_SUFFIX)){
+            std::cout<<"内存池: "<<static_cast<void*>(pointer)<<" 写越界("<<block.size<<"字节) "<<debug_tag<<std::endl;
+        }
+        if(size!=SIZE_MAX&&(size!=block.size||tag!=block.tag)){
+            std::cout<<"内存池: "<<static_cast<void*>(pointer)<<" 归还的大小/标签"<<size<<"/"<<tag
+                     <<"和申请时的"<<block.size<<"/"<<block.tag<<"不一致 "<<debug_tag<<std::endl;
+        }
+        return true;
+    }
+#endif
+    ///从级别index申请一块，返回块起点后offset字节的地址
+    ///  头部模式下返回地址前4个字节记录offset(高24位)和级别+1(低8位)，为0表示不是内存池分配的
+    char* getMemory(int32_t index,std::size_t offset,std::size_t size,uint16_t tag){
+        MemoryPoolThreadCache* cache=localCache();
+        char* block=getBlock(cache,index);
+        if(block== nullptr) return nullptr;
+#if !ENABLE_MEMORY_POOL_HEADERLESS
+        *reinterpret_cast<std::uint32_t *>(block+offset-sizeof(std::uint32_t))=static_cast<std::uint32_t>(offset<<8)|static_cast<std::uint32_t>(index+1);
+#endif
+        count(cache,true,index,tag,MemorySizeClass::Size(index));
+#if ENABLE_DEBUG_MEMORY_POOL
+        debugAcquire(block+offset,size,tag,offset);
+#else
+        (void)size;
+#endif
+        return block+offset;
+    }
+    ///直接mmap，返回起点后offset字节的地址；头部模式下级别记为LARGE_TAG
+    char* getLarge(std::size_t size,std::size_t offset,uint16_t tag){
+        if(size>SIZE_MAX-offset-DEBUG_SUFFIX) return nullptr;
+        char* block=central_->MapLarge(size+offset+DEBUG_SUFFIX);
+        if(block== nullptr) return nullptr;
+#if !ENABLE_MEMORY_POOL_HEADERLESS
+        *reinterpret_cast<std::uint32_t *>(block+offset-sizeof(std::uint32_t))=static_cast<std::uint32_t>(offset<<8)|LARGE_TAG;
+#endif
+        count(localCache(),true,Chunk::LARGE_CLASS,tag,Chunk::SlabOf(block)->mapped);
+#if ENABLE_DEBUG_MEMORY_POOL
+        debugAcquire(block+offset,size,tag,offset);
+#endif
+        return block+offset;
+    }
+    ///归还块起点在block的一块；index为Chunk::LARGE_CLASS时unmap
+    void putMemory(int32_t index,char* block,uint16_t tag){
+        MemoryPoolThreadCache* cache=localCache();
+        if(index==Chunk::LARGE_CLASS){
+            count(cache,false,index,tag,central_->UnmapLarge(block));
+            return;
+        }
+        count(cache,false,index,tag,MemorySizeClass::Size(index));
+        putBlock(cache,index,block);
     }
 public:
-    MemoryPool(){};
+    //块前面头部的字节数
+#if ENABLE_MEMORY_POOL_HEADERLESS
+    constexpr static std::size_t HEADER_SIZE=0;
+#else
+    constexpr static std::size_t HEADER_SIZE=sizeof(std::uint32_t);
+#endif
+    //调试模式下头部前面、申请的内存后面金丝雀的字节数
+#if ENABLE_DEBUG_MEMORY_POOL
+    constexpr static std::size_t DEBUG_PREFIX=16;
+    constexpr static std::size_t DEBUG_SUFFIX=8;
+#else
+    constexpr static std::size_t DEBUG_PREFIX=0;
+    constexpr static std::size_t DEBUG_SUFFIX=0;
+#endif
+    //GetMemory(size,align)支持的最大对齐
+    constexpr static std::size_t MAX_ALIGN=64;
+    //超过它(含头部)的申请直接mmap
+    constexpr static std::size_t MMAP_THRESHOLD=MEMORY_POOL_MMAP_THRESHOLD;
+    static_assert(MMAP_THRESHOLD>=MAX_ALIGN&&MMAP_THRESHOLD<=MemorySizeClass::MAX_SIZE,"MEMORY_POOL_MMAP_THRESHOLD out of range");
+
+    MemoryPool():id_(nextPoolId()),central_(std::make_shared<MemoryPoolCentral>()){};
+    ///按profile_path预热(LoadProfile)，析构时把峰值写回去(SaveProfile)；文件不存在时只在析构时写
+    ///  全局的用Singleton<MemoryPool>::Instance(path)在第一次使用MemPoolManager之前创建，或者定义MEMORY_POOL_PROFILE_PATH
+    explicit MemoryPool(const std::string& profile_path):MemoryPool(){
+        profile_path_=profile_path;
+        LoadProfile(profile_path_);
+    }
     ~MemoryPool(){
-        pool_.clear();
+        if(!profile_path_.empty()) SaveProfile(profile_path_);
+#if ENABLE_DEBUG_MEMORY_POOL
+        //Singleton<MemoryPool>::destroy()时也在这里报告
+        ReportLeaks();
+#endif
+#if ENABLE_MEMORY_POOL_THREAD_CACHE||ENABLE_MEMORY_POOL_STATS
+        //本线程的缓存立即还回去，其他线程的缓存在线程退出时还，central_到那时才释放
+        ThreadCaches& local=threadCaches();
+        if(local.last&&local.last->PoolId()==id_) local.last=nullptr;
+        for(auto iter=local.caches.begin();iter!=local.caches.end();iter++){
+            if((*iter)->PoolId()==id_){
+                local.caches.erase(iter);
+                break;
+            }
+        }
+#endif
     }
-    ///申请内存
+    ///申请内存，无头部模式下size超过8时按16字节对齐
     char* GetMemory(std::size_t size){
-        size= upToPowerOfTwo(size+sizeof(uint32_t));
 #if !ENABLE_MEMORY_POOL
-        return new char[size];
+        return static_cast<char*>(std::malloc(size));
 #endif
-        auto iter=pool_.find(size);
-        if(iter==pool_.end()){
-            pool_[size].SetChunkSize(size);
-        }
-        auto p=reinterpret_cast<std::uint32_t *>(pool_[size].GemMemory());
-        if(p== nullptr) return nullptr;
-        *p=size;///前四个字节记录分配内存大小
-        return reinterpret_cast<char*>(p) + sizeof(std::uint32_t );///指针偏移
+        constexpr std::size_t offset=offsetFor(0);
+        std::size_t bytes=blockBytes(size,offset);
+        if(bytes>MMAP_THRESHOLD) return getLarge(size,offset,0);
+        return getMemory(MemorySizeClass::Index(bytes),offset,size,0);
+    }
+    ///申请编译期已知大小的内存，级别在编译期算好
+    template<std::size_t N>
+    char* GetMemory(){
+        constexpr std::size_t offset=offsetFor(0);
+        constexpr bool large=blockBytes(N,offset)>MMAP_THRESHOLD;
+        constexpr int32_t index=MemorySizeClass::Index(large?0:blockBytes(N,offset));
+#if !ENABLE_MEMORY_POOL
+        return static_cast<char*>(std::malloc(N));
+#endif
+        if(large) return getLarge(N,offset,0);
+        return getMemory(index,offset,N,0);
+    }
+    ///申请按align字节对齐的内存，align必须是2的幂且不超过MAX_ALIGN，为0时同GetMemory(size)，否则返回nullptr
+    ///  块大小取align的倍数，块起点本来就对齐；头部模式下在块起点后空出align字节放头部
+    /// \param tag RegisterTag返回的标签，按标签统计；带标签申请的内存要用同样的size/align/tag归还
+    char* GetMemory(std::size_t size,std::size_t align,uint16_t tag=0){
+        if((align&(align-1))!=0||align>MAX_ALIGN) return nullptr;
+#if !ENABLE_MEMORY_POOL
+        (void)tag;
+        if(align==0) return static_cast<char*>(std::malloc(size));
+        return static_cast<char*>(std::aligned_alloc(align,(size+align-1)/align*align));
+#endif
+        std::size_t offset=offsetFor(align);
+        std::size_t bytes=blockBytes(size,offset);
+        if(bytes>MMAP_THRESHOLD) return getLarge(size,offset,tag);
+        return getMemory(classFor(bytes,align),offset,size,tag);
     }
 
-    ///归还内存
-    void GiveBack(char *pointer,std::string debug_tag=""){
+    ///归还内存：无头部模式从slab描述取级别，头部模式从块前的头部取
+    ///  不知道标签，按标签0统计(调试模式下用登记的标签)
+    ///  debug_tag只在调试模式的报告里打印，不参与统计；统计只认RegisterTag的数字标签，要按标签统计用GiveBack(pointer,size,align,tag)
+    void GiveBack(char *pointer,[[maybe_unused]] std::string debug_tag=""){
 #if !ENABLE_MEMORY_POOL
-        delete pointer;
+        std::free(pointer);
         return;
 #endif
         if(pointer== nullptr)   return;
-        auto size=*(reinterpret_cast<std::uint32_t *>(pointer-sizeof(uint32_t)));
-        if(size== 0){
-            delete (pointer-sizeof(std::uint32_t ));
-            return ;
+        uint16_t tag=0;
+#if ENABLE_DEBUG_MEMORY_POOL
+        DebugBlock block;
+        if(!debugRelease(pointer,SIZE_MAX,0,debug_tag,block)) return;
+        tag=block.tag;
+#endif
+#if ENABLE_MEMORY_POOL_HEADERLESS
+        int32_t size_class=Chunk::SlabOf(pointer)->size_class;
+#if ENABLE_DEBUG_MEMORY_POOL
+        pointer-=block.offset;
+#endif
+        putMemory(size_class,pointer,tag);
+#else
+        auto header=*(reinterpret_cast<std::uint32_t *>(pointer-sizeof(uint32_t)));
+        if(header== 0) return ;///不是内存池分配的
+        int32_t size_class=(header&0xff)==LARGE_TAG?Chunk::LARGE_CLASS:static_cast<int32_t>(header&0xff)-1;
+        putMemory(size_class,pointer-(header>>8),tag);
+#endif
+    }
+    ///按大小归还，size、align和tag传申请时的值(GetMemory(size)申请的align传0)
+    ///  无头部模式下直接算出级别，不读slab描述；头部模式从头部取级别
+    void GiveBack(char *pointer,std::size_t size,std::size_t align=0,uint16_t tag=0){
+#if !ENABLE_MEMORY_POOL
+        std::free(pointer);
+        return;
+#endif
+        if(pointer== nullptr)   return;
+#if ENABLE_DEBUG_MEMORY_POOL
+        DebugBlock block;
+        if(!debugRelease(pointer,size,tag,"",block)) return;
+        //以登记的为准
+        size=block.size;
+        tag=block.tag;
+#endif
+#if ENABLE_MEMORY_POOL_HEADERLESS
+        std::size_t offset=offsetFor(align);
+        std::size_t bytes=blockBytes(size,offset);
+        putMemory(bytes>MMAP_THRESHOLD?Chunk::LARGE_CLASS:classFor(bytes,align),pointer-offset,tag);
+#else
+        (void)size;
+        (void)align;
+        auto header=*(reinterpret_cast<std::uint32_t *>(pointer-sizeof(uint32_t)));
+        int32_t size_class=(header&0xff)==LARGE_TAG?Chunk::LARGE_CLASS:static_cast<int32_t>(header&0xff)-1;
+        putMemory(size_class,pointer-(header>>8),tag);
+#endif
+    }
+    ///预热：size字节(align同GetMemory)所在的级别至少能放count块，缺的一次申请连续的内存切好，之后申请不再找系统要内存
+    ///  之后非force的Trim不会把这个级别减到count块以下
+    /// \return 是否预留到了count块；size大到直接mmap时没有级别，返回false
+    bool Reserve(std::size_t size,std::size_t count,std::size_t align=0){
+#if !ENABLE_MEMORY_POOL
+        return false;
+#endif
+        if((align&(align-1))!=0||align>MAX_ALIGN) return false;
+        std::size_t offset=offsetFor(align);
+        std::size_t bytes=blockBytes(size,offset);
+        if(bytes>MMAP_THRESHOLD) return false;
+        return central_->GetChunk(classFor(bytes,align))->Reserve(count);
+    }
+    ///把各级别借出块数的峰值(含各线程缓存中的)写到path，每行"块大小 块数"；先写临时文件，fsync后再改名，改名后fsync所在目录
+    ///  不低于预留的块数，按预热文件启动后运行时间很短也不会把文件写小；要重新统计时删掉文件
+    /// \return 是否写成功
+    bool SaveProfile(const std::string& path){
+        std::ostringstream out;
+        out<<"# block_size peak_blocks\n";
+        for(int32_t index=0;index<MemoryPoolCentral::MAX_CLASS;index++){
+            Chunk* chunk=central_->FindChunk(index);
+            if(chunk== nullptr) continue;
+            std::size_t peak=chunk->PeakInUse();
+            std::size_t reserved=chunk->Reserved();
+            if(reserved>peak) peak=reserved;
+            if(peak) out<<chunk->ChunkSize()<<" "<<peak<<"\n";
+        }
+        std::string body=out.str();
+        std::string temp=path+".tmp";
+        FILE* file=std::fopen(temp.c_str(),"w");
+        if(file== nullptr){
+            std::cout<<"内存池: 写不了预热文件 "<<temp<<std::endl;
+            return false;
+        }
+        bool ok=std::fwrite(body.data(),body.size(),1,file)==1;
+        //rename之前落盘，掉电后不会留下新名字、旧内容(或空文件)的预热文件
+        ok=ok&&std::fflush(file)==0&&fsync(fileno(file))==0;
+        ok=(std::fclose(file)==0)&&ok;
+        if(!ok||std::rename(temp.c_str(),path.c_str())!=0){
+            std::cout<<"内存池: 写预热文件失败 "<<path<<std::endl;
+            std::remove(temp.c_str());
+            return false;
+        }
+        //改名本身记在目录里，目录也要落盘
+        std::string::size_type slash=path.find_last_of('/');
+        std::string dir=slash==std::string::npos?".":(slash==0?"/":path.substr(0,slash));
+        int fd=open(dir.c_str(),O_RDONLY|O_DIRECTORY);
+        if(fd>=0){
+            fsync(fd);
+            close(fd);
+        }
+        return true;
+    }
+    ///按SaveProfile写的文件预热，块大小不是某个级别大小的行、格式不对的行跳过
+    ///  每个级别最多预热MEMORY_POOL_PROFILE_MAX_BYTES字节，超过的块数截断
+    /// \return 预热的级别数，文件不存在时为0
+    std::size_t LoadProfile(const std::string& path){
+        std::ifstream in(path);
+        std::size_t warmed=0;
+        std::string line;
+        while(std::getline(in,line)){
+            if(line.empty()||line[0]=='#') continue;
+            std::istringstream fields(line);
+            std::size_t size=0;
+            std::size_t count=0;
+            if(!(fields>>size>>count)||count==0||size>MMAP_THRESHOLD) continue;
+            int32_t index=MemorySizeClass::Index(size);
+            if(MemorySizeClass::Size(index)!=size) continue;
+            if(count>MEMORY_POOL_PROFILE_MAX_BYTES/size){
+                std::cout<<"内存池: 预热文件 "<<path<<" 块大小"<<size<<"的块数"<<count<<"太大，截断"<<std::endl;
+                count=MEMORY_POOL_PROFILE_MAX_BYTES/size;
+            }
+            if(central_->GetChunk(index)->Reserve(count)) warmed++;
+        }
+        return warmed;
+    }
+    ///注册统计用的标签，同名的返回同一个id；最多MemoryPoolCounters::MAX_TAGS-1个，用完时返回0(不带标签)
+    uint16_t RegisterTag(const std::string& name){
+        return central_->RegisterTag(name);
+    }
+    ///汇总各线程的计数和各Chunk的状态；没有ENABLE_MEMORY_POOL_STATS时计数都是0
+    MemoryPoolStats Stats(){
+        MemoryPoolStats stats;
+        stats.time_ns=static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+        MemoryPoolCounters sum;
+        central_->SumCounters(sum);
+        auto load=[](const std::atomic<uint64_t>& counter){ return counter.load(std::memory_order_relaxed); };
+        //减到0为止：归还的线程先于申请的线程被读到时，归还数可能暂时多于申请数
+        auto minus=[](uint64_t a,uint64_t b){ return a>b?a-b:0; };
+        for(int32_t index=0;index<MemoryPoolCentral::MAX_CLASS;index++){
+            Chunk* chunk=central_->FindChunk(index);
+            if(chunk== nullptr) continue;
+            MemoryPoolClassStats item;
+            item.block_size=MemorySizeClass::Size(index);
+            item.allocs=load(sum.class_allocs[index]);
+            item.frees=load(sum.class_frees[index]);
+            item.live_blocks=minus(item.allocs,item.frees);
+            item.live_bytes=item.live_blocks*item.block_size;
+            item.peak_blocks=chunk->PeakInUse();
+            item.free_blocks=chunk->Size();
+            item.slabs=chunk->SlabCount();
+            item.slab_bytes=item.slabs*chunk->SlabBytes();
+            stats.total_allocs+=item.allocs;
+            stats.total_frees+=item.frees;
+            stats.live_blocks+=item.live_blocks;
+            stats.live_bytes+=item.live_bytes;
+            stats.peak_bytes+=item.peak_blocks*item.block_size;
+            stats.held_bytes+=item.slab_bytes;
+            stats.classes.push_back(item);
+        }
+        stats.large_allocs=load(sum.large_allocs);
+        stats.large_frees=load(sum.large_frees);
+        stats.large_live_bytes=minus(load(sum.large_alloc_bytes),load(sum.large_free_bytes));
+        stats.total_allocs+=stats.large_allocs;
+        stats.total_frees+=stats.large_frees;
+        stats.live_blocks+=minus(stats.large_allocs,stats.large_frees);
+        stats.live_bytes+=stats.large_live_bytes;
+        stats.peak_bytes+=LargeBytes();
+        stats.held_bytes+=LargeBytes();
+        std::vector<std::string> names=central_->TagNames();
+        stats.tags.resize(names.size());
+        MemoryPoolTagStats& untagged=stats.tags[0];
+        untagged.name=names[0];
+        untagged.allocs=stats.total_allocs;
+        untagged.frees=stats.total_frees;
+        uint64_t tagged_live_bytes=0;
+        for(std::size_t id=1;id<names.size();id++){
+            MemoryPoolTagStats& item=stats.tags[id];
+            item.name=names[id];
+            item.allocs=load(sum.tag_allocs[id]);
+            item.frees=load(sum.tag_frees[id]);
+            item.live_blocks=minus(item.allocs,item.frees);
+            item.live_bytes=minus(load(sum.tag_alloc_bytes[id]),load(sum.tag_free_bytes[id]));
+            untagged.allocs=minus(untagged.allocs,item.allocs);
+            untagged.frees=minus(untagged.frees,item.frees);
+            tagged_live_bytes+=item.live_bytes;
+        }
+        untagged.live_blocks=minus(untagged.allocs,untagged.frees);
+        untagged.live_bytes=minus(stats.live_bytes,tagged_live_bytes);
+        return stats;
+    }
+#if ENABLE_DEBUG_MEMORY_POOL
+    ///打印还没归还的块(最多LEAK_REPORT_LIMIT个)和按标签的合计
+    /// \return 没归还的块数
+    std::size_t ReportLeaks(){
+        std::lock_guard<std::mutex> lock(debug_mutex_);
+        if(debug_blocks_.empty()) return 0;
+        std::vector<std::string> names=central_->TagNames();
+        std::vector<std::size_t> blocks(names.size()+1,0);
+        std::vector<std::size_t> bytes(names.size()+1,0);
+        std::cout<<"内存池泄漏 "<<debug_blocks_.size()<<"块"<<std::endl;
+        std::size_t listed=0;
+        for(auto& item:debug_blocks_){
+            std::size_t tag=item.second.tag<names.size()?item.second.tag:names.size();
+            blocks[tag]++;
+            bytes[tag]+=item.second.size;
+            if(listed++<LEAK_REPORT_LIMIT){
+                std::cout<<"    "<<static_cast<const void*>(item.first)<<" "<<item.second.size<<"字节 标签"<<item.second.tag<<std::endl;
+            }
         }
-        return pool_[size].GiveBack(pointer-sizeof(uint32_t),debug_tag);
+        for(std::size_t tag=0;tag<blocks.size();tag++){
+            if(blocks[tag]==0) continue;
+            std::cout<<"    标签 "<<(tag<names.size()?names[tag]:"未注册")<<" "<<blocks[tag]<<"块 "<<bytes[tag]<<"字节"<<std::endl;
+        }
+        return debug_blocks_.size();
+    }
+#endif
+    ///把各个Chunk里空闲的slab还给操作系统，先把本线程的缓存还给Chunk；保留多少见Chunk::Trim
+    /// \param force 为true时不按高水位保留
+    /// \return 还给操作系统的字节数
+    std::size_t Trim(bool force=false){
+#if ENABLE_MEMORY_POOL_THREAD_CACHE
+        threadCache()->Flush();
+#endif
+        return central_->Trim(force);
+    }
+    ///启动后台线程，每隔interval做一次Trim(不动各线程的缓存)；已经启动时按新的间隔重启
+    ///  和StopTrimThread不能在多个线程同时调用
+    void StartTrimThread(std::chrono::milliseconds interval){
+        trim_thread_.reset();
+        trim_thread_.reset(new MemoryPoolTrimThread(central_,interval));
+    }
+    void StopTrimThread(){
+        trim_thread_.reset();
+    }
+    ///后台线程累计还给操作系统的字节数
+    std::size_t BackgroundTrimmedBytes() const{
+        return trim_thread_?trim_thread_->TrimmedBytes():0;
+    }
+    ///直接mmap、还没归还的字节数
+    std::size_t LargeBytes() const{
+        return central_->LargeBytes();
     }
     ///打印
     void DebugPrint(){
-        std::cout<<"内存池中有"<<pool_.size()<<"种不同大小的内存块"<<std::endl;
-        for(auto iter=pool_.begin();iter!=pool_.end();iter++){
-            std::cout<<"    内存块大小为 "<<iter->first<<"还有 "<<iter->second.Size()<<"个"<<std::endl;
+        std::size_t kinds=0;
+        for(int32_t index=0;index<MemoryPoolCentral::MAX_CLASS;index++){
+            if(central_->FindChunk(index)) kinds++;
+        }
+        std::cout<<"内存池中有"<<kinds<<"种不同大小的内存块"<<std::endl;
+        for(int32_t index=0;index<MemoryPoolCentral::MAX_CLASS;index++){
+            Chunk* chunk=central_->FindChunk(index);
+            if(chunk== nullptr) continue;
+#if ENABLE_MEMORY_POOL_THREAD_CACHE
+            std::cout<<"    内存块大小为 "<<chunk->ChunkSize()<<"还有 "<<chunk->Size()<<"个，本线程缓存 "<<threadCache()->Cached(index)<<"个，slab "<<chunk->SlabCount()<<"个，已还给系统的slab "<<chunk->IdleSlabCount()<<"个"<<std::endl;
+#else
+            std::cout<<"    内存块大小为 "<<chunk->ChunkSize()<<"还有 "<<chunk->Size()<<"个，slab "<<chunk->SlabCount()<<"个，已还给系统的slab "<<chunk->IdleSlabCount()<<"个"<<std::endl;
+#endif
         }
+        std::cout<<"    直接mmap的大块 "<<LargeBytes()<<"字节"<<std::endl;
     }
 
 };
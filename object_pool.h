@@ -0,0 +1,128 @@
+//
+// Created by zhangshiping on 26-10-17.
+//
+
+#ifndef GAMETOOLS_OBJECT_POOL_H
+#define GAMETOOLS_OBJECT_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "memory_pool.h"
+
+namespace GameTools{
+
+///类型化的对象池：内存来自MemoryPool，Create构造、Destroy析构并归还
+///  按sizeof(T)/alignof(T)申请和归还(GiveBack(pointer,size,align))，归还时不读slab描述
+///  本身只记一个MemoryPool指针和统计标签，可以随意拷贝；对象可以在一个线程创建、另一个线程销毁
+template<class T>
+class ObjectPool{
+    static_assert(alignof(T)<=MemoryPool::MAX_ALIGN,"alignof(T) too large for MemoryPool");
+public:
+    ///unique_ptr的删除器，析构对象并还给内存池
+    struct Deleter{
+        MemoryPool* pool=nullptr;
+        uint16_t tag=0;
+        void operator()(T* object) const{
+            object->~T();
+            pool->GiveBack(reinterpret_cast<char*>(object),sizeof(T),alignof(T),tag);
+        }
+    };
+    using Handle=std::unique_ptr<T,Deleter>;
+
+    /// \param pool 内存池，默认用全局的MemPoolManager
+    /// \param tag 统计标签(MemoryPool::RegisterTag)，0表示不带标签
+    explicit ObjectPool(MemoryPool* pool=MemPoolManager,uint16_t tag=0):pool_(pool),tag_(tag){}
+
+    ///申请内存并构造对象，内存不足时返回nullptr；构造函数抛异常时内存还回去再抛出
+    template<class... Args>
+    T* Create(Args&&... args){
+        char* memory=pool_->GetMemory(sizeof(T),alignof(T),tag_);
+        if(memory== nullptr) return nullptr;
+        try{
+            return new(memory) T(std::forward<Args>(args)...);
+        }catch(...){
+            pool_->GiveBack(memory,sizeof(T),alignof(T),tag_);
+            throw;
+        }
+    }
+    ///析构对象并归还内存，object必须是Create返回的
+    void Destroy(T* object){
+        if(object== nullptr) return;
+        Deleter{pool_,tag_}(object);
+    }
+    ///同Create，返回离开作用域时自动Destroy的句柄
+    template<class... Args>
+    Handle MakeUnique(Args&&... args){
+        return Handle(Create(std::forward<Args>(args)...),Deleter{pool_,tag_});
+    }
+    MemoryPool* Pool() const{
+        return pool_;
+    }
+    uint16_t Tag() const{
+        return tag_;
+    }
+
+private:
+    MemoryPool* pool_;
+    uint16_t tag_;
+};
+
+///满足C++ Allocator要求的适配器，std::unordered_map、std::list、RankSkipList(SkipListPolicy的Alloc)等可以从MemoryPool取内存
+///  allocate(n)按n*sizeof(T)、alignof(T)申请，deallocate按同样的大小归还；内存池申请失败时抛std::bad_alloc
+///  默认构造用全局的MemPoolManager；指向同一个内存池、标签相同的两个分配器相等，rebind保留标签
+template<class T>
+class PoolAllocator{
+    static_assert(alignof(T)<=MemoryPool::MAX_ALIGN,"alignof(T) too large for MemoryPool");
+public:
+    using value_type=T;
+    using propagate_on_container_move_assignment=std::true_type;
+    using propagate_on_container_swap=std::true_type;
+    using is_always_equal=std::false_type;
+    template<class U>
+    struct rebind{
+        using other=PoolAllocator<U>;
+    };
+
+    PoolAllocator() noexcept:pool_(MemPoolManager){}
+    /// \param tag 统计标签(MemoryPool::RegisterTag)，0表示不带标签
+    explicit PoolAllocator(MemoryPool* pool,uint16_t tag=0) noexcept:pool_(pool),tag_(tag){}
+    template<class U>
+    PoolAllocator(const PoolAllocator<U>& other) noexcept:pool_(other.Pool()),tag_(other.Tag()){}
+
+    T* allocate(std::size_t n){
+        if(n>SIZE_MAX/sizeof(T)) throw std::bad_alloc();
+        char* memory=pool_->GetMemory(n*sizeof(T),alignof(T),tag_);
+        if(memory== nullptr) throw std::bad_alloc();
+        return reinterpret_cast<T*>(memory);
+    }
+    void deallocate(T* pointer,std::size_t n) noexcept{
+        pool_->GiveBack(reinterpret_cast<char*>(pointer),n*sizeof(T),alignof(T),tag_);
+    }
+    MemoryPool* Pool() const noexcept{
+        return pool_;
+    }
+    uint16_t Tag() const noexcept{
+        return tag_;
+    }
+
+private:
+    MemoryPool* pool_;
+    uint16_t tag_=0;
+};
+
+template<class T,class U>
+bool operator==(const PoolAllocator<T>& a,const PoolAllocator<U>& b) noexcept{
+    return a.Pool()==b.Pool()&&a.Tag()==b.Tag();
+}
+template<class T,class U>
+bool operator!=(const PoolAllocator<T>& a,const PoolAllocator<U>& b) noexcept{
+    return !(a==b);
+}
+
+}
+
+#endif //GAMETOOLS_OBJECT_POOL_H
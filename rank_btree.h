@@ -0,0 +1,512 @@
+//
+// Created by zhangshiping on 26-10-17.
+//
+
+#ifndef GAMETOOLS_RANK_BTREE_H
+#define GAMETOOLS_RANK_BTREE_H
+
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <utility>
+#include "flat_hash_map.h"
+
+namespace GameTools{
+
+///B+树中的一条记录，字段名与SkipListNode一致
+template<class K,class V>
+struct RankBTreeEntry{
+    K key;
+    V value;
+};
+
+///B+树参数
+///  LeafLines   叶子占的cache line数，叶子容量由它和条目大小算出
+///  InnerFanout 内部节点最多的孩子数
+template<int32_t LeafLines=4,int32_t InnerFanout=32>
+struct RankBTreePolicy{
+    static_assert(LeafLines>=1&&LeafLines<=64,"LeafLines must be in [1,64]");
+    static_assert(InnerFanout>=4&&InnerFanout<=256,"InnerFanout must be in [4,256]");
+    constexpr static int32_t LEAF_LINES=LeafLines;
+    constexpr static int32_t INNER_FANOUT=InnerFanout;
+};
+
+///带子树计数的B+树排行榜，排序规则和接口同RankSkipList：key大的在前，key相同时value大的在前
+///  叶子是按序排列的{key,value}数组，按cache line对齐、大小是整数个cache line，一个叶子里的比较是对连续内存的无分支计数，编译器可以向量化
+///  内部节点存每个孩子的下界和子树条目数，Rank/getNodeByRank一次下降，每层只访问一两个节点，比跳表逐个节点跳转的cache miss少
+///  value==>key存在FlatHashMap里，Rank先查key再按(key,value)下降
+///  与RankSkipList的差别：条目在叶子里会移动，没有稳定的节点指针，InsertOrUpdate返回bool，getNodeByRank/getKey返回的指针到下一次修改前有效
+template<class K,class V,class H=std::hash<V>,class P=RankBTreePolicy<>>
+class RankBTree{
+public:
+    using Entry=RankBTreeEntry<K,V>;
+    //叶子容量：整数个cache line里放下条目数组和next指针、条目数
+    constexpr static uint32_t LEAF_CAP=static_cast<uint32_t>((P::LEAF_LINES*64-2*sizeof(void*))/sizeof(Entry));
+    constexpr static uint32_t INNER_CAP=P::INNER_FANOUT;
+    static_assert(LEAF_CAP>=4,"entry too large for LeafLines, increase LeafLines");
+private:
+    //条目数少于它时和兄弟合并或者从兄弟借
+    constexpr static uint32_t LEAF_MIN=LEAF_CAP/4;
+    constexpr static uint32_t INNER_MIN=INNER_CAP/4;
+    struct alignas(64) Leaf{
+        Entry entries[LEAF_CAP];
+        Leaf* next=nullptr;
+        uint32_t count=0;
+    };
+    struct alignas(64) Inner{
+        //lower[i]是第i个孩子的下界：孩子i里的条目都不排在它前面，孩子i-1里的条目都排在它前面
+        Entry lower[INNER_CAP];
+        //第i个孩子子树的条目数
+        uint64_t counts[INNER_CAP];
+        void* children[INNER_CAP];
+        uint32_t count=0;
+    };
+    //height_为0时根是叶子
+    void* root_=nullptr;
+    uint32_t height_=0;
+    uint64_t length_=0;
+    //最大长度，0表示不限
+    uint64_t max_len_=0;
+    FlatHashMap<V,K,H> key_map_;
+
+    /// (ak,av)是否排在(bk,bv)之前
+    static bool before(const K& ak,const V& av,const K& bk,const V& bv){
+        return ak>bk||(ak==bk&&av>bv);
+    }
+    /// 有序数组中排在(key,val)之前的个数，无分支计数
+    static uint32_t countBefore(const Entry* entries,uint32_t n,const K& key,const V& val){
+        uint32_t count=0;
+        for(uint32_t i=0;i<n;i++){
+            count+=static_cast<uint32_t>((entries[i].key>key)|((entries[i].key==key)&(entries[i].value>val)));
+        }
+        return count;
+    }
+    /// (key,val)所在的孩子：下界不排在(key,val)之后的最后一个孩子
+    static uint32_t route(const Inner* inner,const K& key,const V& val){
+        uint32_t child=0;
+        for(uint32_t i=1;i<inner->count;i++){
+            child+=static_cast<uint32_t>(!((key>inner->lower[i].key)|((key==inner->lower[i].key)&(val>inner->lower[i].value))));
+        }
+        return child;
+    }
+    static uint64_t subtreeCount(void* node,uint32_t level){
+        if(level==0) return static_cast<Leaf*>(node)->count;
+        auto* inner=static_cast<Inner*>(node);
+        uint64_t total=0;
+        for(uint32_t i=0;i<inner->count;i++) total+=inner->counts[i];
+        return total;
+    }
+    static void freeTree(void* node,uint32_t level){
+        if(level==0){
+            delete static_cast<Leaf*>(node);
+            return;
+        }
+        auto* inner=static_cast<Inner*>(node);
+        for(uint32_t i=0;i<inner->count;i++) freeTree(inner->children[i],level-1);
+        delete inner;
+    }
+    void initRoot(){
+        root_=new Leaf();
+        height_=0;
+        length_=0;
+    }
+    /// 在inner的第pos个位置插入孩子
+    static void insertChild(Inner* inner,uint32_t pos,const Entry& lower,void* child,uint64_t count){
+        for(uint32_t i=inner->count;i>pos;i--){
+            inner->lower[i]=inner->lower[i-1];
+            inner->counts[i]=inner->counts[i-1];
+            inner->children[i]=inner->children[i-1];
+        }
+        inner->lower[pos]=lower;
+        inner->counts[pos]=count;
+        inner->children[pos]=child;
+        inner->count++;
+    }
+    static void removeChild(Inner* inner,uint32_t pos){
+        for(uint32_t i=pos+1;i<inner->count;i++){
+            inner->lower[i-1]=inner->lower[i];
+            inner->counts[i-1]=inner->counts[i];
+            inner->children[i-1]=inner->children[i];
+        }
+        inner->count--;
+    }
+    /// 把(key,val)插入node子树
+    /// \param level node的高度，0为叶子
+    /// \param lower 输出，分裂出的右兄弟的下界
+    /// \return 分裂出的右兄弟，没有分裂时为nullptr
+    void* insertInto(void* node,uint32_t level,const K& key,const V& val,Entry& lower){
+        if(level==0){
+            auto* leaf=static_cast<Leaf*>(node);
+            uint32_t pos=countBefore(leaf->entries,leaf->count,key,val);
+            Leaf* right=nullptr;
+            if(leaf->count==LEAF_CAP){
+                right=new Leaf();
+                uint32_t keep=LEAF_CAP/2;
+                for(uint32_t i=keep;i<LEAF_CAP;i++) right->entries[i-keep]=std::move(leaf->entries[i]);
+                right->count=LEAF_CAP-keep;
+                leaf->count=keep;
+                right->next=leaf->next;
+                leaf->next=right;
+                if(pos>keep){
+                    leaf=right;
+                    pos-=keep;
+                }
+            }
+            for(uint32_t i=leaf->count;i>pos;i--) leaf->entries[i]=std::move(leaf->entries[i-1]);
+            leaf->entries[pos]=Entry{key,val};
+            leaf->count++;
+            if(right) lower=right->entries[0];
+            return right;
+        }
+        auto* inner=static_cast<Inner*>(node);
+        uint32_t child=route(inner,key,val);
+        Entry child_lower;
+        void* split=insertInto(inner->children[child],level-1,key,val,child_lower);
+        inner->counts[child]++;
+        if(split== nullptr) return nullptr;
+        uint64_t split_count=subtreeCount(split,level-1);
+        inner->counts[child]-=split_count;
+        Inner* right=nullptr;
+        if(inner->count==INNER_CAP){
+            right=new Inner();
+            uint32_t keep=INNER_CAP/2;
+            for(uint32_t i=keep;i<INNER_CAP;i++){
+                right->lower[i-keep]=inner->lower[i];
+                right->counts[i-keep]=inner->counts[i];
+                right->children[i-keep]=inner->children[i];
+            }
+            right->count=INNER_CAP-keep;
+            inner->count=keep;
+            if(child+1>keep) insertChild(right,child+1-keep,child_lower,split,split_count);
+            else insertChild(inner,child+1,child_lower,split,split_count);
+            lower=right->lower[0];
+        }
+        else insertChild(inner,child+1,child_lower,split,split_count);
+        return right;
+    }
+    /// 插入一条新记录，调用方保证val不在树里
+    void insertEntry(const K& key,const V& val){
+        Entry lower;
+        void* split=insertInto(root_,height_,key,val,lower);
+        length_++;
+        if(split== nullptr) return;
+        //根分裂，树长高一层
+        auto* root=new Inner();
+        root->lower[0]=lower;
+        root->children[0]=root_;
+        root->counts[0]=subtreeCount(root_,height_);
+        root->lower[1]=lower;
+        root->children[1]=split;
+        root->counts[1]=subtreeCount(split,height_);
+        root->count=2;
+        root_=root;
+        height_++;
+    }
+    /// inner的第child个孩子条目太少时，和相邻的兄弟合并，合并后放不下就两边平分
+    void rebalance(Inner* inner,uint32_t child,uint32_t level){
+        if(inner->count<2) return;
+        uint32_t left=child>0?child-1:child;
+        uint32_t right=left+1;
+        if(level==0){
+            auto* a=static_cast<Leaf*>(inner->children[left]);
+            auto* b=static_cast<Leaf*>(inner->children[right]);
+            uint32_t total=a->count+b->count;
+            if(total<=LEAF_CAP){
+                for(uint32_t i=0;i<b->count;i++) a->entries[a->count+i]=std::move(b->entries[i]);
+                a->count=total;
+                a->next=b->next;
+                inner->counts[left]+=inner->counts[right];
+                removeChild(inner,right);
+                delete b;
+                return;
+            }
+            uint32_t target=total/2;
+            if(a->count<target){
+                //从b的前面搬到a的后面
+                uint32_t move=target-a->count;
+                for(uint32_t i=0;i<move;i++) a->entries[a->count+i]=std::move(b->entries[i]);
+                for(uint32_t i=move;i<b->count;i++) b->entries[i-move]=std::move(b->entries[i]);
+                a->count+=move;
+                b->count-=move;
+            }
+            else{
+                //从a的后面搬到b的前面
+                uint32_t move=a->count-target;
+                for(uint32_t i=b->count;i>0;i--) b->entries[i-1+move]=std::move(b->entries[i-1]);
+                for(uint32_t i=0;i<move;i++) b->entries[i]=std::move(a->entries[target+i]);
+                a->count-=move;
+                b->count+=move;
+            }
+            inner->counts[left]=a->count;
+            inner->counts[right]=b->count;
+            inner->lower[right]=b->entries[0];
+            return;
+        }
+        auto* a=static_cast<Inner*>(inner->children[left]);
+        auto* b=static_cast<Inner*>(inner->children[right]);
+        b->lower[0]=inner->lower[right];
+        uint32_t total=a->count+b->count;
+        if(total<=INNER_CAP){
+            for(uint32_t i=0;i<b->count;i++){
+                a->lower[a->count+i]=b->lower[i];
+                a->counts[a->count+i]=b->counts[i];
+                a->children[a->count+i]=b->children[i];
+            }
+            a->count=total;
+            inner->counts[left]+=inner->counts[right];
+            removeChild(inner,right);
+            delete b;
+            return;
+        }
+        uint32_t target=total/2;
+        if(a->count<target){
+            uint32_t move=target-a->count;
+            for(uint32_t i=0;i<move;i++){
+                a->lower[a->count+i]=b->lower[i];
+                a->counts[a->count+i]=b->counts[i];
+                a->children[a->count+i]=b->children[i];
+            }
+            for(uint32_t i=move;i<b->count;i++){
+                b->lower[i-move]=b->lower[i];
+                b->counts[i-move]=b->counts[i];
+                b->children[i-move]=b->children[i];
+            }
+            a->count+=move;
+            b->count-=move;
+        }
+        else{
+            uint32_t move=a->count-target;
+            for(uint32_t i=b->count;i>0;i--){
+                b->lower[i-1+move]=b->lower[i-1];
+                b->counts[i-1+move]=b->counts[i-1];
+                b->children[i-1+move]=b->children[i-1];
+            }
+            for(uint32_t i=0;i<move;i++){
+                b->lower[i]=a->lower[target+i];
+                b->counts[i]=a->counts[target+i];
+                b->children[i]=a->children[target+i];
+            }
+            a->count-=move;
+            b->count+=move;
+        }
+        inner->counts[left]=subtreeCount(a,level);
+        inner->counts[right]=subtreeCount(b,level);
+        inner->lower[right]=b->lower[0];
+    }
+    /// 从node子树删除条目，只在一个叶子内删除
+    /// \param target 不为nullptr时按(key,val)定位要删的一条；否则删除下标index(从0开始)起的至多n条
+    /// \param erase_map 是否同时删除key_map_中的记录
+    /// \return 删除的条数
+    uint64_t eraseFrom(void* node,uint32_t level,const Entry* target,uint64_t index,uint64_t n,bool erase_map){
+        if(level==0){
+            auto* leaf=static_cast<Leaf*>(node);
+            uint32_t pos;
+            if(target){
+                pos=countBefore(leaf->entries,leaf->count,target->key,target->value);
+                if(pos==leaf->count||!(leaf->entries[pos].value==target->value)) return 0;
+                n=1;
+            }
+            else{
+                pos=static_cast<uint32_t>(index);
+                if(n>leaf->count-pos) n=leaf->count-pos;
+            }
+            auto removed=static_cast<uint32_t>(n);
+            if(erase_map){
+                for(uint32_t i=pos;i<pos+removed;i++) key_map_.erase(leaf->entries[i].value);
+            }
+            for(uint32_t i=pos+removed;i<leaf->count;i++) leaf->entries[i-removed]=std::move(leaf->entries[i]);
+            leaf->count-=removed;
+            return removed;
+        }
+        auto* inner=static_cast<Inner*>(node);
+        uint32_t child=0;
+        if(target) child=route(inner,target->key,target->value);
+        else{
+            while(child+1<inner->count&&index>=inner->counts[child]) index-=inner->counts[child++];
+        }
+        uint64_t removed=eraseFrom(inner->children[child],level-1,target,index,n,erase_map);
+        inner->counts[child]-=removed;
+        if(removed){
+            bool underfull=level==1?inner->counts[child]<LEAF_MIN:static_cast<Inner*>(inner->children[child])->count<INNER_MIN;
+            if(underfull) rebalance(inner,child,level-1);
+        }
+        return removed;
+    }
+    /// 删除后根只剩一个孩子时树降低一层
+    void shrinkRoot(){
+        while(height_>0&&static_cast<Inner*>(root_)->count==1){
+            auto* root=static_cast<Inner*>(root_);
+            root_=root->children[0];
+            delete root;
+            height_--;
+        }
+    }
+    uint64_t eraseEntry(const Entry& target,bool erase_map){
+        uint64_t removed=eraseFrom(root_,height_,&target,0,1,erase_map);
+        length_-=removed;
+        shrinkRoot();
+        return removed;
+    }
+    /// 排在(key,val)之前的条目数
+    uint64_t countAhead(const K& key,const V& val) const{
+        const void* node=root_;
+        uint64_t ahead=0;
+        for(uint32_t level=height_;level>0;level--){
+            auto* inner=static_cast<const Inner*>(node);
+            uint32_t child=route(inner,key,val);
+            for(uint32_t i=0;i<child;i++) ahead+=inner->counts[i];
+            node=inner->children[child];
+        }
+        auto* leaf=static_cast<const Leaf*>(node);
+        return ahead+countBefore(leaf->entries,leaf->count,key,val);
+    }
+    /// 第index个条目(从0开始)所在的叶子
+    /// \param index 输入输出，输出为在叶子中的下标
+    Leaf* leafAt(uint64_t& index) const{
+        void* node=root_;
+        for(uint32_t level=height_;level>0;level--){
+            auto* inner=static_cast<Inner*>(node);
+            uint32_t child=0;
+            while(child+1<inner->count&&index>=inner->counts[child]) index-=inner->counts[child++];
+            node=inner->children[child];
+        }
+        return static_cast<Leaf*>(node);
+    }
+
+public:
+    ///
+    /// \param max_len 最大长度，0表示不限，规则同RankSkipList
+    explicit RankBTree(uint64_t max_len=0):max_len_(max_len){
+        initRoot();
+    }
+    ~RankBTree(){
+        freeTree(root_,height_);
+    }
+    RankBTree(const RankBTree&)=delete;
+    RankBTree& operator=(const RankBTree&)=delete;
+
+    void Clear(){
+        freeTree(root_,height_);
+        key_map_.clear();
+        initRoot();
+    }
+    /// 插入新记录，若存在则更新
+    ///   已满且新记录排在最后时不插入；插入后超过max_len时删除最后一名
+    /// \return 操作后val是否在榜上
+    bool InsertOrUpdate(const K& key,const V& val){
+        auto iter=key_map_.find(val);
+        if(iter!=key_map_.end()){
+            if(iter->second==key) return true;
+            eraseEntry(Entry{iter->second,val},false);
+            iter->second=key;
+            insertEntry(key,val);
+            return true;
+        }
+        if(max_len_>0&&length_>=max_len_&&countAhead(key,val)==length_) return false;
+        insertEntry(key,val);
+        key_map_.emplace(val,key);
+        if(max_len_>0&&length_>max_len_) DeleteNodeByRange(max_len_+1,length_);
+        return true;
+    }
+    bool DeleteNode(const V& val){
+        auto iter=key_map_.find(val);
+        if(iter==key_map_.end()) return false;
+        Entry target{iter->second,val};
+        return eraseEntry(target,true)>0;
+    }
+    /// 删除第rank个条目
+    uint64_t DeleteNodeByRank(uint64_t rank){
+        if(rank>length_){
+            std::cout<<"DeleteNodeByRank parameter error "<<std::endl;
+            std::cout<<"rank="<<rank<<" length="<<length_<<std::endl;
+            return 0;
+        }
+        return DeleteNodeByRange(rank,rank);
+    }
+    /// 删除第start个到end个条目，每次删掉一个叶子里的一段
+    /// \return 删除的条数
+    uint64_t DeleteNodeByRange(uint64_t start,uint64_t end){
+        if(!((start<=end)&&(start>0)&&(end<=length_))){
+            std::cout<<"DeleteNodeByRange parameter error "<<std::endl;
+            std::cout<<"start="<<start<<" end="<<end<<" length="<<length_<<std::endl;
+            return 0;
+        }
+        uint64_t total=end-start+1;
+        if(total==length_){
+            Clear();
+            return total;
+        }
+        uint64_t left=total;
+        while(left>0){
+            uint64_t removed=eraseFrom(root_,height_, nullptr,start-1,left,true);
+            length_-=removed;
+            left-=removed;
+            shrinkRoot();
+        }
+        return total;
+    }
+    /// 查询val的排名
+    /// \return 排名，从1开始，不存在时为-1
+    int64_t Rank(const V& val) const{
+        auto iter=key_map_.find(val);
+        if(iter==key_map_.end()) return -1;
+        return static_cast<int64_t>(countAhead(iter->second,val)+1);
+    }
+    /// 分数为key的新条目会排在第几名
+    uint64_t RankByKey(const K& key) const{
+        //下界的key>key时，这个孩子之前的条目key都更大
+        uint64_t ahead=0;
+        const void* node=root_;
+        for(uint32_t level=height_;level>0;level--){
+            auto* inner=static_cast<const Inner*>(node);
+            uint32_t child=0;
+            while(child+1<inner->count&&inner->lower[child+1].key>key) ahead+=inner->counts[child++];
+            node=inner->children[child];
+        }
+        auto* leaf=static_cast<const Leaf*>(node);
+        uint32_t pos=0;
+        while(pos<leaf->count&&leaf->entries[pos].key>key) pos++;
+        return ahead+pos+1;
+    }
+    /// 查找val的key，到下一次修改前有效
+    const K* getKey(const V& val) const{
+        auto iter=key_map_.find(val);
+        if(iter==key_map_.end()) return nullptr;
+        return &iter->second;
+    }
+    /// 第rank个条目，到下一次修改前有效
+    const Entry* getNodeByRank(uint64_t rank) const{
+        if(rank==0||rank>length_) return nullptr;
+        uint64_t index=rank-1;
+        Leaf* leaf=leafAt(index);
+        return &leaf->entries[index];
+    }
+    bool has(const V& val) const{
+        return key_map_.find(val)!=key_map_.end();
+    }
+    uint64_t length() const{
+        return length_;
+    }
+    /// 按排名顺序访问第start到end名
+    /// \param fn void(const RankBTreeEntry<K,V>&)
+    /// \return 访问的条数
+    template<class Fn>
+    uint64_t ForEachByRank(uint64_t start,uint64_t end,Fn&& fn) const{
+        if(start==0) start=1;
+        if(start>end||start>length_) return 0;
+        uint64_t index=start-1;
+        const Leaf* leaf=leafAt(index);
+        uint64_t visited=0;
+        uint64_t total=end-start+1;
+        while(leaf&&visited<total){
+            for(auto i=static_cast<uint32_t>(index);i<leaf->count&&visited<total;i++,visited++) fn(leaf->entries[i]);
+            index=0;
+            leaf=leaf->next;
+        }
+        return visited;
+    }
+};
+
+}
+
+#endif //GAMETOOLS_RANK_BTREE_H
@@ -0,0 +1,214 @@
+//
+// Created by zhangshiping on 26-10-17.
+//
+
+#ifndef GAMETOOLS_SHARDED_RANK_LIST_H
+#define GAMETOOLS_SHARDED_RANK_LIST_H
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <vector>
+#include "skip_list.h"
+
+namespace GameTools{
+
+///按val哈希分片的排行榜，每个分片是一个RankSkipList和一把锁，排序规则同RankSkipList
+///  写：只锁val所在的分片，不同分片的改分可以在不同线程上并行
+///  Rank：先在val的分片里取key，再逐个分片求排在(key,val)前面的节点数，相加+1即全局名次，O(分片数*logn)
+///     每个分片只在计数时加锁，没有并发写时结果精确；有并发写时每一项都是该分片加锁那一刻的精确值
+///  翻页/前N名：锁住全部分片(按下标顺序加锁，写者只锁一个分片，不会死锁)，
+///     先按分片二分定位第start名在每个分片中的位置，再从这些位置开始k路归并，O(分片数^2*log^2 n+页大小*log分片数)
+///  不支持max_len
+template<class K,class V,class H=std::hash<V>,class P=SkipListPolicy<>>
+class ShardedRankList{
+public:
+    using List=RankSkipList<K,V,H,P>;
+    using Node=SkipListNode<K,V>;
+private:
+    //各分片占独立的cache line，不同线程改不同分片时锁不互相干扰
+    struct alignas(64) Shard{
+        std::mutex mutex;
+        List list;
+        explicit Shard(uint64_t seed):list(0,seed){}
+    };
+    std::vector<std::unique_ptr<Shard>> shards_;
+
+    /// a是否排在b之前
+    static bool before(const Node* a,const Node* b){
+        return a->key>b->key||(a->key==b->key&&a->value>b->value);
+    }
+    /// 锁住全部分片
+    std::vector<std::unique_lock<std::mutex>> lockAll(){
+        std::vector<std::unique_lock<std::mutex>> locks;
+        locks.reserve(shards_.size());
+        for(auto& shard:shards_) locks.emplace_back(shard->mutex);
+        return locks;
+    }
+    /// 找全局第start名在每个分片中的位置，需要持有全部分片的锁
+    ///   维护每个分片的候选区间[lo,hi)(分片内下标，从0开始)：lo之前的都排在目标之前，hi及之后的都排在目标之后
+    ///   每轮取候选区间最大的分片的中点作为pivot，求它在每个分片中前面的个数，全局下标等于目标时结束，否则收缩所有区间
+    /// \param start 全局名次，从1开始，不超过总长度
+    /// \param offsets 输出，offsets[i]是第i个分片中排在目标之前的节点数
+    void locate(uint64_t start,std::vector<uint64_t>& offsets){
+        std::size_t count=shards_.size();
+        std::vector<uint64_t> lo(count,0),hi(count,0);
+        for(std::size_t i=0;i<count;i++) hi[i]=shards_[i]->list.length();
+        uint64_t target=start-1;
+        offsets.assign(count,0);
+        while(true){
+            std::size_t widest=0;
+            for(std::size_t i=1;i<count;i++){
+                if(hi[i]-lo[i]>hi[widest]-lo[widest]) widest=i;
+            }
+            uint64_t mid=lo[widest]+(hi[widest]-lo[widest])/2;
+            const Node* pivot=shards_[widest]->list.getNodeByRank(mid+1);
+            uint64_t before_pivot=0;
+            for(std::size_t i=0;i<count;i++){
+                offsets[i]=(i==widest)?mid:shards_[i]->list.RankByKey(pivot->key,pivot->value)-1;
+                before_pivot+=offsets[i];
+            }
+            if(before_pivot==target) return;
+            for(std::size_t i=0;i<count;i++){
+                if(before_pivot<target){
+                    //pivot及其之前的都排在目标之前
+                    uint64_t bound=(i==widest)?mid+1:offsets[i];
+                    lo[i]=std::max(lo[i],bound);
+                }
+                else hi[i]=std::min(hi[i],offsets[i]);
+            }
+        }
+    }
+
+public:
+    ///
+    /// \param shard_count 分片数，至少为1
+    /// \param seed 随机层数的种子，第i个分片用seed+i；0表示每个分片各自用random_device取一个
+    explicit ShardedRankList(uint32_t shard_count,uint64_t seed=0){
+        if(shard_count==0) shard_count=1;
+        shards_.reserve(shard_count);
+        for(uint32_t i=0;i<shard_count;i++) shards_.emplace_back(new Shard(seed?seed+i:0));
+    }
+    ShardedRankList(const ShardedRankList&)=delete;
+    ShardedRankList& operator=(const ShardedRankList&)=delete;
+
+    /// 分片数
+    uint32_t ShardCount() const{
+        return static_cast<uint32_t>(shards_.size());
+    }
+    /// val所在的分片，H对整数是恒等映射，乘法混合后再取模
+    uint32_t ShardOf(const V& val) const{
+        uint64_t h=static_cast<uint64_t>(H()(val))*0x9E3779B97F4A7C15ULL;
+        return static_cast<uint32_t>((h>>32)%shards_.size());
+    }
+    /// 插入或更新，只锁val所在的分片
+    /// \return 是否成功
+    bool InsertOrUpdate(const K& key,const V& val){
+        Shard& shard=*shards_[ShardOf(val)];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.list.InsertOrUpdate(key,val)!= nullptr;
+    }
+    /// 删除val，只锁val所在的分片
+    bool DeleteNode(const V& val){
+        Shard& shard=*shards_[ShardOf(val)];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.list.DeleteNode(val);
+    }
+    /// 查询val的key
+    /// \param key 输出
+    /// \return 是否存在
+    bool getKey(const V& val,K& key){
+        Shard& shard=*shards_[ShardOf(val)];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        K* found=shard.list.getKey(val);
+        if(found== nullptr) return false;
+        key=*found;
+        return true;
+    }
+    bool has(const V& val){
+        Shard& shard=*shards_[ShardOf(val)];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.list.has(val);
+    }
+    /// 全局名次：各分片中排在(key,val)前面的节点数之和+1
+    /// \return 名次，从1开始，不存在时为-1
+    int64_t Rank(const V& val){
+        K key;
+        if(!getKey(val,key)) return -1;
+        uint64_t ahead=0;
+        for(auto& shard:shards_){
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            ahead+=shard->list.RankByKey(key,val)-1;
+        }
+        return static_cast<int64_t>(ahead+1);
+    }
+    /// 分数为key的新条目会排在第几名
+    uint64_t RankByKey(const K& key){
+        uint64_t ahead=0;
+        for(auto& shard:shards_){
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            ahead+=shard->list.RankByKey(key)-1;
+        }
+        return ahead+1;
+    }
+    /// 总长度
+    uint64_t length(){
+        uint64_t total=0;
+        for(auto& shard:shards_){
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            total+=shard->list.length();
+        }
+        return total;
+    }
+    /// 按全局排名顺序访问第start到end名，持有全部分片的锁，fn里不能再操作本排行榜
+    /// \param start 从1开始
+    /// \param end 超过总长度时到最后一名为止
+    /// \param fn void(const SkipListNode<K,V>&)
+    /// \return 访问的节点数
+    template<class Fn>
+    uint64_t ForEachByRank(uint64_t start,uint64_t end,Fn&& fn){
+        if(start==0) start=1;
+        if(start>end) return 0;
+        auto locks=lockAll();
+        uint64_t total=0;
+        for(auto& shard:shards_) total+=shard->list.length();
+        if(start>total) return 0;
+        std::vector<uint64_t> offsets;
+        if(start==1) offsets.assign(shards_.size(),0);
+        else locate(start,offsets);
+        //k路归并，堆顶是排名最靠前的分片当前节点
+        std::vector<const Node*> heads;
+        heads.reserve(shards_.size());
+        for(std::size_t i=0;i<shards_.size();i++){
+            const Node* node=shards_[i]->list.getNodeByRank(offsets[i]+1);
+            if(node) heads.push_back(node);
+        }
+        auto after=[](const Node* a,const Node* b){ return before(b,a); };
+        std::make_heap(heads.begin(),heads.end(),after);
+        uint64_t visited=0;
+        while(!heads.empty()&&visited<=end-start){
+            std::pop_heap(heads.begin(),heads.end(),after);
+            const Node* node=heads.back();
+            fn(*node);
+            visited++;
+            if(node->levels()[0].next){
+                heads.back()=node->levels()[0].next;
+                std::push_heap(heads.begin(),heads.end(),after);
+            }
+            else heads.pop_back();
+        }
+        return visited;
+    }
+    /// 前n名，同ForEachByRank(1,n,fn)
+    template<class Fn>
+    uint64_t ForEachTop(uint64_t n,Fn&& fn){
+        return ForEachByRank(1,n,std::forward<Fn>(fn));
+    }
+};
+
+}
+
+#endif //GAMETOOLS_SHARDED_RANK_LIST_H
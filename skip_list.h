@@ -5,20 +5,33 @@
 #ifndef GAMETOOLS_SKIP_LIST_H
 #define GAMETOOLS_SKIP_LIST_H
 
+#include <cstddef>
+#include <cmath>
 #include <cstdint>
 #include <cstdlib>
-#include <unordered_map>
 #include <iostream>
 #include <memory>
 #include <vector>
 #include <random>
+#include <algorithm>
+#include <iterator>
+#include <utility>
+#include <new>
+#include <type_traits>
+#include "flat_hash_map.h"
+#include "skip_list_change_log.h"
 
 namespace GameTools{
-//定义跳表节点 , K为数据，需要排序，V是唯一标识符，用来查找
+//跳表中的一条记录，节点和CompactRankList数组模式的元素都是它，可以用同一种指针访问key/value
 template<class K,class V>
-struct SkipListNode{
+struct SkipListEntry{
     K key;
     V value;
+};
+
+//定义跳表节点 , K为数据，需要排序，V是唯一标识符，用来查找
+template<class K,class V>
+struct SkipListNode:SkipListEntry<K,V>{
     //前节点
     SkipListNode* pre;
     //层数
@@ -29,15 +42,124 @@ struct SkipListNode{
         //span（跨度）是记录当前层中此节点到下一个节点在整条链中相差的节点数量，相邻为1
         uint64_t span=0;
     };
-    //动态数组,levels[i]即第i层
-    std::unique_ptr<SkipListLevel[]> levels;
+    //层数组紧跟在节点头之后，和节点在同一块内存中,levels()[i]即第i层
+    SkipListLevel* levels(){
+        return reinterpret_cast<SkipListLevel*>(this+1);
+    }
+    const SkipListLevel* levels() const{
+        return reinterpret_cast<const SkipListLevel*>(this+1);
+    }
+    ///level层的节点所占内存大小
+    static std::size_t BlockSize(int32_t level){
+        static_assert(alignof(SkipListNode)%alignof(SkipListLevel)==0,"层数组需要紧跟节点头对齐");
+        return sizeof(SkipListNode)+sizeof(SkipListLevel)*static_cast<std::size_t>(level);
+    }
 
-    SkipListNode(int32_t lev)
-            : pre(nullptr), level(lev), levels(new SkipListLevel[level])
+    explicit SkipListNode(int32_t lev)
+            : SkipListEntry<K,V>{K(),V()}, pre(nullptr), level(lev)
     {
+        for(int32_t i=0;i<level;i++) new(levels()+i) SkipListLevel();
+    }
+    SkipListNode(int32_t lev,const K& k,const V& v)
+            : SkipListEntry<K,V>{k,v}, pre(nullptr), level(lev)
+    {
+        for(int32_t i=0;i<level;i++) new(levels()+i) SkipListLevel();
     }
 };
 
+///跳表节点的slab分配器，每个跳表一个
+///  节点头和层数组在同一块内存里，按层数分级：同层数的块大小相同，释放后挂到该层的空闲链上复用
+///  块从slab中顺序切分，析构时整块归还，不逐个释放；第一个slab只有1KB(头节点加几个节点)，之后每个翻倍到64KB，空跳表不占64KB
+///  slab用Alloc申请(rebind成std::max_align_t)
+template<class Node,class Alloc=std::allocator<char>>
+class SkipListArena{
+    using SlabAlloc=typename std::allocator_traits<Alloc>::template rebind_alloc<std::max_align_t>;
+public:
+    SkipListArena()=default;
+    explicit SkipListArena(const Alloc& alloc):alloc_(alloc){}
+    ~SkipListArena(){
+        Release();
+    }
+    SkipListArena(const SkipListArena&)=delete;
+    SkipListArena& operator=(const SkipListArena&)=delete;
+
+    ///分配一个level层节点的内存
+    void* Allocate(int32_t level){
+        auto index=static_cast<std::size_t>(level);
+        if(index<free_lists_.size()&&free_lists_[index]){
+            FreeBlock* block=free_lists_[index];
+            free_lists_[index]=block->next;
+            return block;
+        }
+        std::size_t size=AlignUp(Node::BlockSize(level));
+        if(size>remain_){
+            NewSlab(size);
+        }
+        void* p=cursor_;
+        cursor_+=size;
+        remain_-=size;
+        return p;
+    }
+    ///归还level层节点的内存，挂到空闲链上
+    void Free(void* p,int32_t level){
+        auto index=static_cast<std::size_t>(level);
+        if(index>=free_lists_.size()) free_lists_.resize(index+1,nullptr);
+        auto* block=static_cast<FreeBlock*>(p);
+        block->next=free_lists_[index];
+        free_lists_[index]=block;
+    }
+    ///整块释放所有slab，之前分配出去的节点全部失效
+    void Release(){
+        while(slabs_){
+            Slab* next=slabs_->next;
+            std::allocator_traits<SlabAlloc>::deallocate(alloc_,reinterpret_cast<std::max_align_t*>(slabs_),slabs_->units);
+            slabs_=next;
+        }
+        free_lists_.clear();
+        cursor_=nullptr;
+        remain_=0;
+        next_slab_size_=MIN_SLAB_SIZE;
+    }
+
+private:
+    struct FreeBlock{
+        FreeBlock* next;
+    };
+    struct Slab{
+        Slab* next;
+        //slab大小，单位sizeof(std::max_align_t)
+        std::size_t units;
+    };
+    //第一个slab的大小，之后每个翻倍，最大SLAB_SIZE
+    constexpr static std::size_t MIN_SLAB_SIZE=1024;
+    constexpr static std::size_t SLAB_SIZE=64*1024;
+    constexpr static std::size_t ALIGN=alignof(Node)>alignof(FreeBlock)?alignof(Node):alignof(FreeBlock);
+
+    static std::size_t AlignUp(std::size_t size){
+        return (size+ALIGN-1)&~(ALIGN-1);
+    }
+    void NewSlab(std::size_t min_size){
+        std::size_t head=AlignUp(sizeof(Slab));
+        std::size_t size=head+min_size>next_slab_size_?head+min_size:next_slab_size_;
+        if(next_slab_size_<SLAB_SIZE) next_slab_size_*=2;
+        std::size_t units=(size+sizeof(std::max_align_t)-1)/sizeof(std::max_align_t);
+        auto* slab=reinterpret_cast<Slab*>(std::allocator_traits<SlabAlloc>::allocate(alloc_,units));
+        slab->next=slabs_;
+        slab->units=units;
+        slabs_=slab;
+        cursor_=reinterpret_cast<char*>(slab)+head;
+        remain_=size-head;
+    }
+
+    SlabAlloc alloc_;
+    Slab* slabs_=nullptr;
+    char* cursor_=nullptr;
+    std::size_t remain_=0;
+    std::size_t next_slab_size_=MIN_SLAB_SIZE;
+    //free_lists_[level]为level层节点的空闲链
+    std::vector<FreeBlock*> free_lists_;
+};
+
 //定义跳表的链表, K为数据，需要排序，V是唯一标识符，用来查找
 template<class K,class V>
 struct SkipList{
@@ -48,54 +170,326 @@ struct SkipList{
     int32_t level;
 };
 
+///沿第0层遍历跳表的迭代器，正向用levels()[0].next，反向用pre
+///  迭代器只指向节点本身，不拷贝数据；增删节点后之前的迭代器可能失效
+template<class K,class V,bool Reverse=false>
+class SkipListIterator{
+public:
+    using iterator_category=std::forward_iterator_tag;
+    using value_type=SkipListNode<K,V>;
+    using difference_type=std::ptrdiff_t;
+    using pointer=const SkipListNode<K,V>*;
+    using reference=const SkipListNode<K,V>&;
+
+    explicit SkipListIterator(const SkipListNode<K,V>* node= nullptr):node_(node){}
+    reference operator*() const{ return *node_; }
+    pointer operator->() const{ return node_; }
+    SkipListIterator& operator++(){
+        node_=Reverse?node_->pre:node_->levels()[0].next;
+        return *this;
+    }
+    SkipListIterator operator++(int){
+        SkipListIterator old=*this;
+        ++(*this);
+        return old;
+    }
+    bool operator==(const SkipListIterator& other) const{ return node_==other.node_; }
+    bool operator!=(const SkipListIterator& other) const{ return node_!=other.node_; }
+private:
+    const SkipListNode<K,V>* node_;
+};
+
+///批量更新中的一项：remove为true时删除value，否则把value的key改为key(不存在则插入)
+template<class K,class V>
+struct SkipListBatchOp{
+    V value;
+    K key;
+    bool remove=false;
+};
+
+///跳表参数
+///  MaxLevel 链表最大层数，也是头节点的层数，小排行榜可以用小一点的值
+///  PShift   晋升概率 SKIPLIST_P=1/2^PShift，PShift=1即50%，PShift=2即25%
+///  Alloc    节点slab和rank_map_的内存来源，比如PoolAllocator<char>
+template<int32_t MaxLevel=32,int32_t PShift=1,class Alloc=std::allocator<char>>
+struct SkipListPolicy{
+    static_assert(MaxLevel>=1&&MaxLevel<=64,"MaxLevel must be in [1,64]");
+    static_assert(PShift>=1&&PShift<=8,"PShift must be in [1,8]");
+    constexpr static int32_t SKIPLIST_MAX_LEVEL=MaxLevel;
+    constexpr static int32_t SKIPLIST_P_SHIFT=PShift;
+    constexpr static double SKIPLIST_P=1.0/(1u<<PShift);
+    using Allocator=Alloc;
+};
+
 //定义排序跳表, K为数据，需要排序，V是唯一标识符，用来查找
-template<class K,class V,class H=std::hash<V>> //H 是哈希函数对象的类型。如果你不指定 H，那么它将默认为 std::hash<V>。
+template<class K,class V,class H=std::hash<V>,class P=SkipListPolicy<>> //H 是哈希函数对象的类型。如果你不指定 H，那么它将默认为 std::hash<V>。
 class RankSkipList{
-    using RankMap=typename std::unordered_map<V,SkipListNode<K,V>*>;
+    //开放寻址哈希表，节点指针直接存在槽里，H是它的哈希函数
+    using RankMap=FlatHashMap<V,SkipListNode<K,V>*,H,typename P::Allocator>;
+public:
+    using Arena=SkipListArena<SkipListNode<K,V>,typename P::Allocator>;
+    using iterator=SkipListIterator<K,V,false>;
+    using reverse_iterator=SkipListIterator<K,V,true>;
 private:
+    //节点内存，声明在最前面，保证最后析构
+    Arena arena_;
+    //实际分配节点的arena，默认是自己的arena_，也可以是多个跳表共享的
+    Arena* node_arena_=&arena_;
     //记录所有节点，value==>SKNode*
     RankMap rank_map_;
     SkipList<K,V> skip_list_;
     //最大长度
     uint64_t max_len_=0;
+    //随机层数生成器状态(splitmix64)
+    uint64_t rand_state_=0;
+    //ApplyBatch的临时数组，复用避免每批分配
+    struct BatchItem{
+        const SkipListBatchOp<K,V>* op;
+        SkipListNode<K,V>* node;
+    };
+    std::vector<BatchItem> batch_items_;
+    //变化日志，为nullptr时不记录
+    SkipListChangeLog<K,V>* change_log_=nullptr;
+    //moveNear失败(移动得远)后接下来near_skip_次更新直接下降，连续失败时退避次数翻倍(最多64)，成功后清零
+    uint32_t near_skip_=0;
+    uint32_t near_backoff_=0;
+public:
     //链表最大层数
-    constexpr static int32_t SKIPLIST_MAX_LEVEL=32;
+    constexpr static int32_t SKIPLIST_MAX_LEVEL=P::SKIPLIST_MAX_LEVEL;
     //用于控制随机层数的系数
-    constexpr static double SKIPLIST_P=0.5;
+    constexpr static double SKIPLIST_P=P::SKIPLIST_P;
 private:
     SkipListNode<K,V>* createNode(int32_t level,K key,V val){
-        auto *new_node=new SkipListNode<K,V>(level); // 不同节点level可以是不一样
-        new_node->key=key;
-        new_node->value=val;
-        return new_node;
+        // 不同节点level可以是不一样，节点头和层数组一次分配
+        return new(node_arena_->Allocate(level)) SkipListNode<K,V>(level,key,val);
+    }
+    void emitChange(SkipListChange type,const K& key,const V& val,uint64_t old_rank,uint64_t new_rank){
+        if(change_log_) change_log_->Append(type,key,val,old_rank,new_rank);
+    }
+    void freeNode(SkipListNode<K,V>* node){
+        int32_t level=node->level;
+        node->~SkipListNode<K,V>();
+        node_arena_->Free(node,level);
+    }
+    void initHeader(){
+        skip_list_.header=new(node_arena_->Allocate(SKIPLIST_MAX_LEVEL)) SkipListNode<K,V>(SKIPLIST_MAX_LEVEL);
+        skip_list_.tail= nullptr;
+        skip_list_.length=0;
+        skip_list_.level=1;
+    }
+    /// 析构全部节点(含头节点)，内存由arena_整块释放，只有K/V需要析构时才遍历0层
+    void destroyNodes(){
+        if(!std::is_trivially_destructible<K>::value||!std::is_trivially_destructible<V>::value){
+            SkipListNode<K,V> *node=skip_list_.header->levels()[0].next;
+            SkipListNode<K,V> *next= nullptr;
+            while(node){
+                next=node->levels()[0].next;
+                node->~SkipListNode<K,V>();
+                node=next;
+            }
+            skip_list_.header->~SkipListNode<K,V>();
+        }
+    }
+    /// 归还全部节点(含头节点)：自己的arena整块释放；共享的arena逐个挂回空闲链，留给其他跳表复用
+    void releaseNodes(){
+        if(node_arena_==&arena_){
+            destroyNodes();
+            arena_.Release();
+            return;
+        }
+        SkipListNode<K,V>* node=skip_list_.header;
+        while(node){
+            SkipListNode<K,V>* next=node->levels()[0].next;
+            freeNode(node);
+            node=next;
+        }
+    }
+    /// 清空后逐个插入
+    template<class Iter>
+    uint64_t replay(Iter first,Iter last){
+        Clear();
+        for(;first!=last;++first) InsertOrUpdate(first->first,first->second);
+        return skip_list_.length;
+    }
+    /// 从上往下找第start个节点的每层前节点
+    /// \param start 排名，从1开始
+    /// \param pre_nodes 输出，pre_nodes[i]是第i层中排在start之前的最后一个节点
+    /// \return 第start个节点，不存在时为nullptr
+    SkipListNode<K,V>* findByRank(uint64_t start,SkipListNode<K,V>** pre_nodes){
+        SkipListNode<K,V>* tmpNode=skip_list_.header;
+        uint64_t traversed=0;
+        for(int32_t i=skip_list_.level-1;i>=0;i--){
+            while(tmpNode->levels()[i].next&&(traversed+tmpNode->levels()[i].span)<start){
+                traversed+=tmpNode->levels()[i].span;
+                tmpNode=tmpNode->levels()[i].next;
+            }
+            pre_nodes[i]=tmpNode;
+        }
+        return tmpNode->levels()[0].next;
+    }
+    /// 从上往下找第一个key<=hi的节点的每层前节点
+    /// \param hi
+    /// \param pre_nodes 输出，pre_nodes[i]是第i层中最后一个key>hi的节点(或头节点)
+    /// \return 第一个key<=hi的节点，不存在时为nullptr
+    SkipListNode<K,V>* findByKey(const K& hi,SkipListNode<K,V>** pre_nodes){
+        SkipListNode<K,V>* tmpNode=skip_list_.header;
+        for(int32_t i=skip_list_.level-1;i>=0;i--){
+            while(tmpNode->levels()[i].next&&tmpNode->levels()[i].next->key>hi){
+                tmpNode=tmpNode->levels()[i].next;
+            }
+            pre_nodes[i]=tmpNode;
+        }
+        return tmpNode->levels()[0].next;
+    }
+    /// 统计排在某位置之前的节点数，只沿span累加，不访问rank_map_
+    /// \param is_before bool(const SkipListNode<K,V>*)，对排名靠前的一段节点返回true，之后都返回false
+    /// \return is_before为true的节点数
+    template<class Pred>
+    uint64_t countBefore(Pred&& is_before) const{
+        const SkipListNode<K,V>* tmpNode=skip_list_.header;
+        uint64_t traversed=0;
+        for(int32_t i=skip_list_.level-1;i>=0;i--){
+            while(tmpNode->levels()[i].next&&is_before(tmpNode->levels()[i].next)){
+                traversed+=tmpNode->levels()[i].span;
+                tmpNode=tmpNode->levels()[i].next;
+            }
+        }
+        return traversed;
+    }
+    /// 从pre_nodes[0]的下一个节点开始连续删除，直到keep_going返回false
+    /// \param pre_nodes 第一个被删除节点的每层前节点，删除过程中保持有效
+    /// \param first_rank 第一个被删除节点的排名，后面的节点删除时依次补到这个排名上
+    /// \param keep_going bool(const SkipListNode<K,V>*)
+    /// \return 删除的节点数
+    template<class Pred>
+    uint64_t deleteWhile(SkipListNode<K,V>** pre_nodes,uint64_t first_rank,Pred&& keep_going){
+        SkipListNode<K,V>* tmpNode=pre_nodes[0]->levels()[0].next;
+        uint64_t removed=0;
+        while(tmpNode&&keep_going(tmpNode)){
+            auto* next=tmpNode->levels()[0].next;
+            emitChange(SkipListChange::Left,tmpNode->key,tmpNode->value,first_rank,0);
+            rank_map_.erase(tmpNode->value);//节点归还arena后value不可再用，先删map
+            DeleteNode(tmpNode,pre_nodes);
+            tmpNode=next;
+            removed++;
+        }
+        return removed;
     }
     /// 删除节点
     /// \param node 被删除的节点
     /// \param pre_nodes pre_nodes[i]表示node在第i层中的前节点
     void DeleteNode(SkipListNode<K,V>* node,SkipListNode<K,V>** pre_nodes){
         if(node== nullptr || pre_nodes == nullptr) return;
+        unlinkNode(node,pre_nodes);
+        freeNode(node);
+    }
+    /// 把节点从链中摘下来，不释放节点
+    /// \param node
+    /// \param pre_nodes pre_nodes[i]表示node在第i层中的前节点，摘下后依然是原位置的前节点
+    void unlinkNode(SkipListNode<K,V>* node,SkipListNode<K,V>** pre_nodes){
         //更新
         for(int32_t i=0;i<skip_list_.level;i++){
             //高层不一定包含这个待删除的节点
-            if(node == pre_nodes[i]->levels[i].next){
-                pre_nodes[i]->levels[i].span+= node->levels[i].span - 1;
-                pre_nodes[i]->levels[i].next=node->levels[i].next;
+            if(node == pre_nodes[i]->levels()[i].next){
+                pre_nodes[i]->levels()[i].span+= node->levels()[i].span - 1;
+                pre_nodes[i]->levels()[i].next=node->levels()[i].next;
             }
-            else pre_nodes[i]->levels[i].span--;
+            else pre_nodes[i]->levels()[i].span--;
         }
         //更新pre和tail
-        if(node->levels[0].next){
-            node->levels[0].next->pre=node->pre;
+        if(node->levels()[0].next){
+            node->levels()[0].next->pre=node->pre;
         }
         else{  //node就是队尾
             skip_list_.tail=node->pre;
         }
         //删除空层
-        while(skip_list_.level>1&&skip_list_.header->levels[skip_list_.level-1].next== nullptr){
+        while(skip_list_.level>1&&skip_list_.header->levels()[skip_list_.level-1].next== nullptr){
             skip_list_.level--;
         }
         skip_list_.length--;
-        delete node;
+    }
+    /// 把节点接到pre_nodes之后
+    /// \param node 层数为node->level
+    /// \param pre_nodes pre_nodes[i]是第i层中插入位置的前节点
+    /// \param rank rank[i]是pre_nodes[i]的排名，rank[0]+1是node插入后的排名
+    void linkNode(SkipListNode<K,V>* node,SkipListNode<K,V>** pre_nodes,uint64_t* rank){
+        int32_t level=node->level;
+        if(level>skip_list_.level){
+            //扩展新的层数
+            for(int32_t i=skip_list_.level;i<level;i++){
+                rank[i]=0;
+                pre_nodes[i]=skip_list_.header;
+                pre_nodes[i]->levels()[i].span=skip_list_.length;//span等于队首到队尾
+            }
+            skip_list_.level=level;
+        }
+        for(int32_t i=0;i<level;i++){
+            //插入新节点
+            node->levels()[i].next=pre_nodes[i]->levels()[i].next;
+            pre_nodes[i]->levels()[i].next=node;
+            //计算新节点的span
+            ///  rank[0]就是插入节点的在整条链中位置,rank[i]就是前节点的在整条链中位置
+            /// pre_node    insert_node    next_node
+            ///   |  |__rank0-rank i__|      |
+            ///   |_______________span______|
+            node->levels()[i].span= pre_nodes[i]->levels()[i].span - (rank[0] - rank[i]);
+            //更新插入节点的前节点的span
+            pre_nodes[i]->levels()[i].span= rank[0] - rank[i] + 1;
+        }
+        //插入节点的上层，更新前节点的span
+        for(int32_t i=level;i<skip_list_.level;i++){
+            pre_nodes[i]->levels()[i].span++;
+        }
+        //设置回溯节点
+        node->pre= (pre_nodes[0] == skip_list_.header) ? nullptr : pre_nodes[0];
+        if(node->levels()[0].next) node->levels()[0].next->pre=node;
+        else skip_list_.tail=node;
+
+        skip_list_.length++;
+    }
+    /// node是否排在(key,val)之前：key大的在前，key相同时val大的在前；头节点排在所有节点之前
+    bool before(const SkipListNode<K,V>* node,const K& key,const V& val) const{
+        return node==skip_list_.header||node->key>key||(node->key==key&&node->value>val);
+    }
+    /// 从上往下找(key,val)的每层前节点和它们的排名
+    /// \param pre_nodes 输出，pre_nodes[i]是第i层中最后一个排在(key,val)之前的节点
+    /// \param rank 输出，rank[i]是pre_nodes[i]的排名
+    void findPosition(const K& key,const V& val,SkipListNode<K,V>** pre_nodes,uint64_t* rank){
+        SkipListNode<K,V>* tmpNode=skip_list_.header;
+        //从上层向下层计算rank ，上层节点包含在下层中
+        for(int32_t i=skip_list_.level-1;i>=0;i--){
+            rank[i]=(i==skip_list_.level-1)?0:rank[i+1];
+            while(tmpNode->levels()[i].next
+                &&(tmpNode->levels()[i].next->key>key
+                    ||(tmpNode->levels()[i].next->key==key&&tmpNode->levels()[i].next->value>val)))
+            {
+                rank[i]+=tmpNode->levels()[i].span;//span的累和，是排名
+                tmpNode=tmpNode->levels()[i].next;
+            }
+            pre_nodes[i]=tmpNode;
+        }
+    }
+    /// finger search：已知某个位置的每层前节点，找(key,val)的每层前节点
+    ///   每层从"上一层走到的节点"和"该层原来的前节点"中取更靠后且仍排在(key,val)之前的那个继续向后走，
+    ///   目标离原位置越近走的步数越少；目标在原位置之前时，低层原前节点已在目标之后，改从上一层的位置继续
+    /// \param pre_nodes 输入为原位置的每层前节点，输出为(key,val)的每层前节点
+    /// \param rank 输入输出，rank[i]是pre_nodes[i]的排名
+    void fingerSearch(const K& key,const V& val,SkipListNode<K,V>** pre_nodes,uint64_t* rank){
+        SkipListNode<K,V>* tmpNode=skip_list_.header;
+        uint64_t traversed=0;
+        for(int32_t i=skip_list_.level-1;i>=0;i--){
+            if(rank[i]>traversed&&before(pre_nodes[i],key,val)){
+                tmpNode=pre_nodes[i];
+                traversed=rank[i];
+            }
+            while(tmpNode->levels()[i].next&&before(tmpNode->levels()[i].next,key,val)){
+                traversed+=tmpNode->levels()[i].span;
+                tmpNode=tmpNode->levels()[i].next;
+            }
+            pre_nodes[i]=tmpNode;
+            rank[i]=traversed;
+        }
     }
     /// 随机层数
     ///   理论来讲，一级索引中元素个数应该占原始数据的 50%，二级索引中元素个数占 25%，三级索引12.5% ，一直到最顶层。
@@ -104,83 +498,319 @@ private:
     ///            50%的概率返回 1
     ///            25%的概率返回 2
     ///          12.5%的概率返回 3 ...
+    ///   一个64位随机数里每一位为0/1的概率各50%，末尾连续0的个数就是几何分布，
+    ///   每PShift个0晋升一层，所以一次取数、一次bit-scan就得到层数
     /// \return
     int32_t RandomLevel(){
-        std::random_device rd; // 真实的随机数生成器
-        std::mt19937 gen(rd()); // 使用Mersenne Twister算法的伪随机数生成器
-        std::uniform_int_distribution<> dis(1, 100); // 生成1到100之间的均匀分布的随机数
-        int random_number = dis(gen);
-        int32_t level=1;
-        while(random_number<=SKIPLIST_P*100){
-            random_number=dis(gen);
-            level++;
-        }
+        uint64_t bits=NextRandom();
+        if(bits==0) return SKIPLIST_MAX_LEVEL;
+        int32_t level=1+CountTrailingZero(bits)/P::SKIPLIST_P_SHIFT;
         return (level<SKIPLIST_MAX_LEVEL)?level:SKIPLIST_MAX_LEVEL;
     }
+    /// splitmix64，状态只有8字节，每个跳表一个
+    uint64_t NextRandom(){
+        uint64_t z=(rand_state_+=0x9E3779B97F4A7C15ULL);
+        z=(z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+        z=(z^(z>>27))*0x94D049BB133111EBULL;
+        return z^(z>>31);
+    }
+    static int32_t CountTrailingZero(uint64_t bits){
+#if defined(__GNUC__)||defined(__clang__)
+        return __builtin_ctzll(bits);
+#else
+        int32_t count=0;
+        while((bits&1)==0){
+            bits>>=1;
+            count++;
+        }
+        return count;
+#endif
+    }
+    /// 节点只移动几名时，不从头节点下降，沿第0层的pre/next在原位置附近把节点挪到(key,val)的位置，节点的key改为key
+    ///   越过的节点中最高的层数记为high(至少是节点自己的层数)：只有低于high的层前节点会变，
+    ///   这些层的前节点都是原位置之前第一个层数够高的节点，沿pre往回走到层数>=high的节点就都找到了；
+    ///   high及以上各层前节点不变，摘下时span-1、接上时span+1正好抵消，不用碰
+    ///   排名都用相对原位置的值(去掉节点后)，算span只需要差值
+    /// \return false表示要走的节点超过NEAR_STEPS，什么都没改，调用方改用下降
+    bool moveNear(SkipListNode<K,V>* node,const K& key,const V& val){
+        constexpr int32_t NEAR_STEPS=32;
+        struct Near{
+            SkipListNode<K,V>* node;
+            int64_t rank;
+        };
+        //按离新位置由近到远排列的候选前节点
+        Near near[2*NEAR_STEPS];
+        int32_t count=0;
+        int32_t passed=0;
+        int32_t high=node->level;
+        bool up=node->pre&&!before(node->pre,key,val);
+        if(!up){
+            //往后移：越过next方向排在(key,val)之前的节点，去掉节点后它们的相对排名是0,1,...
+            SkipListNode<K,V>* passed_nodes[NEAR_STEPS];
+            for(SkipListNode<K,V>* next=node->levels()[0].next;next&&before(next,key,val);next=next->levels()[0].next){
+                if(passed==NEAR_STEPS) return false;
+                passed_nodes[passed++]=next;
+            }
+            for(int32_t i=passed-1;i>=0;i--){
+                near[count++]={passed_nodes[i],i};
+                if(passed_nodes[i]->level>high) high=passed_nodes[i]->level;
+            }
+        }
+        SkipListNode<K,V>* pre=node->pre;
+        int64_t rank=-1;
+        if(up){
+            //往前移：越过pre方向不排在(key,val)之前的节点
+            while(pre&&!before(pre,key,val)){
+                if(count==NEAR_STEPS) return false;
+                near[count++]={pre,rank--};
+                if(pre->level>high) high=pre->level;
+                pre=pre->pre;
+            }
+            passed=count;
+        }
+        //继续往回走到层数>=high的节点，低于high的各层前节点都在near里；走到头时头节点的相对排名是rank
+        while(pre){
+            if(count==2*NEAR_STEPS) return false;
+            near[count++]={pre,rank--};
+            if(pre->level>=high) break;
+            pre=pre->pre;
+        }
+        auto cover=[&](int32_t start,int32_t level,int64_t& cover_rank){
+            for(int32_t i=start;i<count;i++){
+                if(near[i].node->level>level){
+                    cover_rank=near[i].rank;
+                    return near[i].node;
+                }
+            }
+            cover_rank=rank;
+            return skip_list_.header;
+        };
+        //原位置的前节点从near中原位置之前的第一个开始找，新位置的从新位置之前的第一个开始找
+        int32_t old_start=up?0:passed;
+        int32_t new_start=up?passed:0;
+        SkipListNode<K,V>* old_pre[SKIPLIST_MAX_LEVEL];
+        SkipListNode<K,V>* new_pre[SKIPLIST_MAX_LEVEL];
+        int64_t new_rank[SKIPLIST_MAX_LEVEL];
+        int64_t unused=0;
+        new_pre[0]=skip_list_.header;//high至少为1，循环一定会覆盖，只是让编译器看得出来
+        for(int32_t i=0;i<high;i++){
+            old_pre[i]=cover(old_start,i,unused);
+            new_pre[i]=cover(new_start,i,new_rank[i]);
+        }
+        //摘下，同unlinkNode，只改低于high的层
+        for(int32_t i=0;i<high;i++){
+            if(i<node->level){
+                old_pre[i]->levels()[i].span+=node->levels()[i].span-1;
+                old_pre[i]->levels()[i].next=node->levels()[i].next;
+            }
+            else old_pre[i]->levels()[i].span--;
+        }
+        if(node->levels()[0].next) node->levels()[0].next->pre=node->pre;
+        else skip_list_.tail=node->pre;
+        node->key=key;
+        //接上，同linkNode
+        for(int32_t i=0;i<high;i++){
+            auto distance=static_cast<uint64_t>(new_rank[0]-new_rank[i]);
+            if(i<node->level){
+                node->levels()[i].next=new_pre[i]->levels()[i].next;
+                new_pre[i]->levels()[i].next=node;
+                node->levels()[i].span=new_pre[i]->levels()[i].span-distance;
+                new_pre[i]->levels()[i].span=distance+1;
+            }
+            else new_pre[i]->levels()[i].span++;
+        }
+        node->pre=(new_pre[0]==skip_list_.header)? nullptr:new_pre[0];
+        if(node->levels()[0].next) node->levels()[0].next->pre=node;
+        else skip_list_.tail=node;
+        return true;
+    }
     /// 更新节点 ，并让更新后的链表依然有序
+    ///   新key依然在前后节点之间时原地修改；否则把同一个节点移到新位置，不重新分配节点、不改rank_map_，之前拿到的节点指针依然有效
+    ///   移动几名时用moveNear在原位置附近挪，不从头节点下降，代价和移动的名次数成正比；最近的更新多数移动得远时退避，少走冤枉路；
+    ///   移动得远，或者设置了变化日志(事件要绝对排名)时，从头节点下降一次找到原位置的每层前节点，摘下后从原位置finger search到新位置
+    ///   原地修改不下降；设置了变化日志时为了事件里的排名下降一次
     /// \param key
     /// \param val
     /// \return 更新节点指针 or nullptr
     SkipListNode<K,V>* UpdateNode(K key,V val){
-        //待更新节点在每一层的前节点
-        SkipListNode<K,V>* pre_nodes[SKIPLIST_MAX_LEVEL]={nullptr};
-//      std::vector<SkipListNode<K,V>*> pre_nodes(SKIPLIST_MAX_LEVEL, nullptr);
-        SkipListNode<K,V>* tmpNode=skip_list_.header;
         auto iter=rank_map_.find(val);
         //如果未找到
         if(iter==rank_map_.end()) return nullptr;
-        //更新前原来的key
-        K& cur_key=iter->second->key;
-        for(int32_t i=skip_list_.level-1;i>=0;i--){
-            while(tmpNode->levels[i].next
-                &&(tmpNode->levels[i].next->key>cur_key||
-                    (tmpNode->levels[i].next->key==cur_key&&tmpNode->levels[i].next->value>val)))
-            {
-                tmpNode=tmpNode->levels[i].next;
-            }
-            pre_nodes[i]=tmpNode;
-        }
-        tmpNode=tmpNode->levels[0].next;
-        if(tmpNode== nullptr||tmpNode->key!=cur_key||tmpNode->value!=val) return nullptr;
+        SkipListNode<K,V>* node=iter->second;
+        SkipListNode<K,V>* next=node->levels()[0].next;
         //如果更新key依然有序
-        if((tmpNode->pre== nullptr||tmpNode->pre->key>key)
-            &&(tmpNode->levels[0].next== nullptr||tmpNode->levels[0].next->key<key))
+        if((node->pre== nullptr||before(node->pre,key,val))
+            &&(next== nullptr||key>next->key||(key==next->key&&val>next->value)))
         {
-            tmpNode->key=key;
-            return tmpNode;
+            node->key=key;
+            if(change_log_){
+                uint64_t same_rank=RankByKey(key,val);
+                emitChange(SkipListChange::Moved,key,val,same_rank,same_rank);
+            }
+            return node;
+        }
+        if(change_log_== nullptr){
+            if(near_skip_>0) near_skip_--;
+            else if(moveNear(node,key,val)){
+                near_backoff_=0;
+                return node;
+            }
+            else{
+                near_backoff_=near_backoff_==0?1:(near_backoff_<64?near_backoff_*2:64);
+                near_skip_=near_backoff_;
+            }
         }
+        //待更新节点在每一层的前节点及其排名
+        SkipListNode<K,V>* pre_nodes[SKIPLIST_MAX_LEVEL]={nullptr};
+        uint64_t rank[SKIPLIST_MAX_LEVEL]={0};
+        findPosition(node->key,val,pre_nodes,rank);
+        if(pre_nodes[0]->levels()[0].next!=node) return nullptr;
         //调整位置使得链有序
-        //删除旧的节点
-        DeleteNode(tmpNode, pre_nodes);
-        rank_map_.erase(val); //这里不能写tmpNode->value,因为tmpNode已经被删除了
-        //插入新节点
-        return InsertOrUpdate(key,val);
+        uint64_t old_rank=rank[0]+1;
+        unlinkNode(node,pre_nodes);
+        node->key=key;
+        fingerSearch(key,val,pre_nodes,rank);
+        linkNode(node,pre_nodes,rank);
+        emitChange(SkipListChange::Moved,key,val,old_rank,rank[0]+1);
+        return node;
     }
 
 public:
     ///
     /// \param max_len 跳表最大长度
-    RankSkipList(uint64_t max_len=0){
-        skip_list_.header=new SkipListNode<K,V>(SKIPLIST_MAX_LEVEL);
-        skip_list_.tail= nullptr;
-        skip_list_.length=0;
-        skip_list_.level=1;
+    /// \param seed 随机层数的种子，相同种子+相同操作序列得到相同的跳表结构；0表示用random_device取一个
+    /// \param arena 共享的节点arena，nullptr表示用自己的；共享时arena必须比跳表活得久，且不能跨线程同时使用
+    RankSkipList(uint64_t max_len=0,uint64_t seed=0,Arena* arena= nullptr){
+        if(arena) node_arena_=arena;
+        initHeader();
         rank_map_.clear();
         max_len_=max_len;
+        Seed(seed);
     }
     ~RankSkipList(){
-        SkipListNode<K,V> *node=skip_list_.header->levels[0].next;
-        SkipListNode<K,V> *next= nullptr;
-        //遍历删除0层全部节点
-        while(node){
-            next=node->levels[0].next;
-            delete node;
-            node=next;
-        }
-        //删除头节点
-        delete skip_list_.header;
+        releaseNodes();
         skip_list_.header= nullptr;
     }
+    RankSkipList(const RankSkipList&)=delete;
+    RankSkipList& operator=(const RankSkipList&)=delete;
+    /// 重新设置随机层数的种子
+    /// \param seed 0表示用random_device取一个
+    void Seed(uint64_t seed){
+        if(seed==0){
+            std::random_device rd;
+            seed=(static_cast<uint64_t>(rd())<<32)|rd();
+        }
+        rand_state_=seed;
+    }
+    /// 设置变化日志，之后的增删改(含max_len淘汰、Clear、批量建表)都按发生顺序追加事件；nullptr表示不再记录
+    ///   设置后ApplyBatch改为逐个执行
+    void SetChangeLog(SkipListChangeLog<K,V>* log){
+        change_log_=log;
+    }
+    /// 清空跳表，节点内存整块归还(共享arena时挂回空闲链)
+    void Clear(){
+        emitChange(SkipListChange::Cleared,K(),V(),0,0);
+        releaseNodes();
+        rank_map_.clear();
+        initHeader();
+    }
+    /// 用已排好序的(key,val)序列批量建表，一次线性遍历连好所有层并算出span，原有数据会被清空
+    ///   序列顺序与跳表一致：key降序，key相同时val降序
+    ///   超过max_len_的部分和逐个InsertOrUpdate一样被丢弃
+    ///   不满足顺序或val重复的元素先跳过，之后同一个val再出现也跳过，建完后按原顺序逐个InsertOrUpdate，val的最终key和逐个插入一样；
+    ///   若同时设置了max_len_，淘汰结果依赖插入历史，这时退化为整个序列逐个InsertOrUpdate，保证结果和逐个插入一致
+    /// \param first
+    /// \param last
+    /// \return 建表后的长度
+    template<class Iter>
+    uint64_t BuildFromSorted(Iter first,Iter last){
+        static_assert(std::is_base_of<std::forward_iterator_tag,
+                typename std::iterator_traits<Iter>::iterator_category>::value,"BuildFromSorted需要前向迭代器");
+        Clear();
+        uint64_t count=static_cast<uint64_t>(std::distance(first,last));
+        rank_map_.reserve(max_len_>0&&count>max_len_?max_len_:count);
+        //last_nodes[i]是第i层当前的最后一个节点，last_rank[i]是它的排名
+        SkipListNode<K,V>* last_nodes[SKIPLIST_MAX_LEVEL];
+        uint64_t last_rank[SKIPLIST_MAX_LEVEL]={0};
+        for(int32_t i=0;i<SKIPLIST_MAX_LEVEL;i++) last_nodes[i]=skip_list_.header;
+        std::vector<std::pair<K,V>> pending;
+        //进了pending的val，后面再出现的也要进pending，否则重放时前面的会覆盖后面的
+        FlatHashMap<V,bool,H,typename P::Allocator> pending_vals;
+        SkipListNode<K,V>* tail= nullptr;
+        uint64_t length=0;
+        int32_t top_level=1;
+        for(Iter iter=first;iter!=last;++iter){
+            const K& key=iter->first;
+            const V& val=iter->second;
+            //顺序不对，或者val重复
+            if((tail&&!(tail->key>key||(tail->key==key&&tail->value>val)))
+                ||rank_map_.find(val)!=rank_map_.end()
+                ||(!pending.empty()&&pending_vals.find(val)!=pending_vals.end()))
+            {
+                if(max_len_>0) return replay(first,last);
+                pending.emplace_back(key,val);
+                pending_vals.emplace(val,true);
+                continue;
+            }
+            //已满，后面的都排在链尾之后
+            if(max_len_>0&&length>=max_len_) continue;
+            int32_t level=RandomLevel();
+            SkipListNode<K,V>* node=createNode(level,key,val);
+            length++;
+            for(int32_t i=0;i<level;i++){
+                last_nodes[i]->levels()[i].next=node;
+                last_nodes[i]->levels()[i].span=length-last_rank[i];
+                last_nodes[i]=node;
+                last_rank[i]=length;
+            }
+            node->pre=tail;
+            tail=node;
+            if(level>top_level) top_level=level;
+            rank_map_.emplace(val,node);
+            emitChange(SkipListChange::Entered,key,val,0,length);
+        }
+        //每层最后一个节点的span是到链尾的距离
+        for(int32_t i=0;i<top_level;i++){
+            last_nodes[i]->levels()[i].span=length-last_rank[i];
+        }
+        skip_list_.tail=tail;
+        skip_list_.length=length;
+        skip_list_.level=top_level;
+        for(auto& item:pending){
+            InsertOrUpdate(item.first,item.second);
+        }
+        return skip_list_.length;
+    }
+    /// 用无序的(key,val)序列批量建表，先排序再线性建表，原有数据会被清空
+    ///   val重复时以序列中最后一个为准，和逐个InsertOrUpdate一致
+    /// \param first
+    /// \param last
+    /// \return 建表后的长度
+    template<class Iter>
+    uint64_t Build(Iter first,Iter last){
+        static_assert(std::is_base_of<std::forward_iterator_tag,
+                typename std::iterator_traits<Iter>::iterator_category>::value,"Build需要前向迭代器");
+        std::vector<std::pair<K,V>> items;
+        items.reserve(static_cast<std::size_t>(std::distance(first,last)));
+        for(Iter iter=first;iter!=last;++iter) items.emplace_back(iter->first,iter->second);
+        //val相同的保持输入顺序排在一起，只留最后一个
+        std::stable_sort(items.begin(),items.end(),[](const std::pair<K,V>& a,const std::pair<K,V>& b){
+            return a.second>b.second;
+        });
+        std::size_t count=0;
+        for(std::size_t i=0;i<items.size();i++){
+            if(i+1<items.size()&&items[i+1].second==items[i].second) continue;
+            if(count!=i) items[count]=std::move(items[i]);
+            count++;
+        }
+        //有重复val又有max_len_时，淘汰结果依赖插入历史
+        if(max_len_>0&&count!=items.size()) return replay(first,last);
+        items.resize(count);
+        std::sort(items.begin(),items.end(),[](const std::pair<K,V>& a,const std::pair<K,V>& b){
+            return a.first>b.first||(a.first==b.first&&a.second>b.second);
+        });
+        return BuildFromSorted(items.begin(),items.end());
+    }
     /// 插入新节点，若存在则更新
     /// \param key
     /// \param val
@@ -188,70 +818,25 @@ public:
     SkipListNode<K,V>* InsertOrUpdate(K key,V val){
         //每一层中待插入节点的前节点,pre_nodes[i]是节点指针，但是新节点并不一定在i层，但一定在0层
         SkipListNode<K,V>* pre_nodes[SKIPLIST_MAX_LEVEL]={nullptr};
-
-        SkipListNode<K,V>* tmpNode=skip_list_.header;
         //节点的排名，rank[i]其实是pre_node[i]在整条链中的排名，rank[0]才是新节点排名
         uint64_t rank[SKIPLIST_MAX_LEVEL]={0};
         //如果节点已经存在
         if(rank_map_.find(val)!=rank_map_.end()){
             return UpdateNode(key,val);
         }
-        //从上层向下层计算rank ，上层节点包含在下层中
-        for(int32_t i=skip_list_.level-1;i>=0;i--){
-            rank[i]=(i==skip_list_.level-1)?0:rank[i+1];
-            while(tmpNode->levels[i].next
-                &&(tmpNode->levels[i].next->key>key
-                    ||(tmpNode->levels[i].next->key==key&&tmpNode->levels[i].next->value>val)))
-            {
-                rank[i]+=tmpNode->levels[i].span;//span的累和，是排名
-                tmpNode=tmpNode->levels[i].next;
-            }
-            pre_nodes[i]=tmpNode;
-        }
+        findPosition(key,val,pre_nodes,rank);
         //长度超过上限
         if(max_len_>0&&skip_list_.length>=max_len_){
             //且待插入节点位于链尾
-            if(pre_nodes[0]->levels[0].next == nullptr
-               || pre_nodes[0]->levels[0].next->key > key){
+            if(pre_nodes[0]->levels()[0].next == nullptr
+               || pre_nodes[0]->levels()[0].next->key > key){
                 return nullptr;
             }
         }
-        //随机层数
-        int32_t level=RandomLevel();
-        if(level>skip_list_.level){
-            //扩展新的层数
-            for(int32_t i=skip_list_.level;i<level;i++){
-                rank[i]=0;
-                pre_nodes[i]=skip_list_.header;
-                pre_nodes[i]->levels[i].span=skip_list_.length;//span等于队首到队尾
-            }
-            skip_list_.level=level;
-        }
-        //创建节点
-        tmpNode= createNode(level,key,val);
-        for(int32_t i=0;i<level;i++){
-            //插入新节点
-            tmpNode->levels[i].next=pre_nodes[i]->levels[i].next;
-            pre_nodes[i]->levels[i].next=tmpNode;
-            //计算新节点的span
-            ///  rank[0]就是插入节点的在整条链中位置,rank[i]就是前节点的在整条链中位置
-            /// pre_node    insert_node    next_node
-            ///   |  |__rank0-rank i__|      |
-            ///   |_______________span______|
-            tmpNode->levels[i].span= pre_nodes[i]->levels[i].span - (rank[0] - rank[i]);
-            //更新插入节点的前节点的span
-            pre_nodes[i]->levels[i].span= rank[0] - rank[i] + 1;
-        }
-        //插入节点的上层，更新前节点的span
-        for(int32_t i=level;i<skip_list_.level;i++){
-            pre_nodes[i]->levels[i].span++;
-        }
-        //设置回溯节点
-        tmpNode->pre= (pre_nodes[0] == skip_list_.header) ? nullptr : pre_nodes[0];
-        if(tmpNode->levels[0].next) tmpNode->levels[0].next->pre=tmpNode;
-        else skip_list_.tail=tmpNode;
-
-        skip_list_.length++;
+        //随机层数，创建节点
+        SkipListNode<K,V>* tmpNode= createNode(RandomLevel(),key,val);
+        linkNode(tmpNode,pre_nodes,rank);
+        emitChange(SkipListChange::Entered,key,val,0,rank[0]+1);
         //更新map
         rank_map_.emplace(val,tmpNode);
         //长度>max_len_
@@ -260,24 +845,132 @@ public:
         }
         return tmpNode;
     }
+    /// 批量更新/删除，结果和按顺序逐个InsertOrUpdate/DeleteNode相同
+    ///   同一个val只取最后一项；先按旧位置顺序摘下所有涉及的节点，再按新位置顺序接回，
+    ///   相邻目标之间复用pre_nodes/rank做finger search，最后统一按max_len_截断一次
+    ///   设置了max_len_且中途可能淘汰时，只有"只插入、只涨分"的批次截断一次和逐个执行等价，
+    ///   其余批次按顺序逐个执行
+    /// \param ops
+    /// \param count
+    void ApplyBatch(const SkipListBatchOp<K,V>* ops,std::size_t count){
+        if(count==0) return;
+        batch_items_.clear();
+        for(std::size_t i=0;i<count;i++) batch_items_.push_back({ops+i,nullptr});
+        //同一个val的项按输入顺序(地址顺序)排在一起
+        std::sort(batch_items_.begin(),batch_items_.end(),[](const BatchItem& a,const BatchItem& b){
+            return a.op->value>b.op->value||(a.op->value==b.op->value&&a.op<b.op);
+        });
+        //每个val只留最后一项，顺便检查能否最后统一截断
+        bool monotone=true;
+        uint64_t new_values=0;
+        std::size_t kept=0;
+        for(std::size_t i=0;i<batch_items_.size();){
+            std::size_t j=i;
+            auto iter=rank_map_.find(batch_items_[i].op->value);
+            SkipListNode<K,V>* node=iter==rank_map_.end()? nullptr:iter->second;
+            const K* pre_key=node?&node->key: nullptr;
+            bool inserted=false;
+            for(;j<batch_items_.size()&&batch_items_[j].op->value==batch_items_[i].op->value;j++){
+                const SkipListBatchOp<K,V>* op=batch_items_[j].op;
+                if(op->remove){
+                    monotone=false;
+                    continue;
+                }
+                if(pre_key&&!(op->key>*pre_key||op->key==*pre_key)) monotone=false;
+                pre_key=&op->key;
+                inserted=true;
+            }
+            if(!node&&inserted) new_values++;
+            batch_items_[kept++]={batch_items_[j-1].op,node};
+            i=j;
+        }
+        batch_items_.resize(kept);
+        //记录变化日志时逐个执行，每个操作的前后排名才准确
+        if(change_log_||(max_len_>0&&skip_list_.length+new_values>max_len_&&!monotone)){
+            for(std::size_t i=0;i<count;i++){
+                if(ops[i].remove) DeleteNode(ops[i].value);
+                else InsertOrUpdate(ops[i].key,ops[i].value);
+            }
+            return;
+        }
+        SkipListNode<K,V>* pre_nodes[SKIPLIST_MAX_LEVEL];
+        uint64_t rank[SKIPLIST_MAX_LEVEL];
+        //按旧位置顺序摘下已有节点
+        std::sort(batch_items_.begin(),batch_items_.end(),[this](const BatchItem& a,const BatchItem& b){
+            if(!a.node||!b.node) return a.node!= nullptr&&b.node== nullptr;
+            return before(a.node,b.node->key,b.node->value);
+        });
+        for(int32_t i=0;i<SKIPLIST_MAX_LEVEL;i++){
+            pre_nodes[i]=skip_list_.header;
+            rank[i]=0;
+        }
+        kept=0;
+        for(auto& item:batch_items_){
+            if(item.node){
+                fingerSearch(item.node->key,item.node->value,pre_nodes,rank);
+                unlinkNode(item.node,pre_nodes);
+                if(item.op->remove){
+                    rank_map_.erase(item.node->value);
+                    freeNode(item.node);
+                    continue;
+                }
+            }
+            if(!item.op->remove) batch_items_[kept++]=item;
+        }
+        batch_items_.resize(kept);
+        //按新位置顺序接回/插入
+        std::sort(batch_items_.begin(),batch_items_.end(),[](const BatchItem& a,const BatchItem& b){
+            return a.op->key>b.op->key||(a.op->key==b.op->key&&a.op->value>b.op->value);
+        });
+        for(int32_t i=0;i<SKIPLIST_MAX_LEVEL;i++){
+            pre_nodes[i]=skip_list_.header;
+            rank[i]=0;
+        }
+        for(auto& item:batch_items_){
+            SkipListNode<K,V>* node=item.node;
+            if(node){
+                node->key=item.op->key;
+            }
+            else{
+                node=createNode(RandomLevel(),item.op->key,item.op->value);
+                rank_map_.emplace(node->value,node);
+            }
+            fingerSearch(node->key,node->value,pre_nodes,rank);
+            linkNode(node,pre_nodes,rank);
+            //新节点排在下一个目标之前，作为下一次finger search的起点
+            uint64_t node_rank=rank[0]+1;
+            for(int32_t i=0;i<node->level;i++){
+                pre_nodes[i]=node;
+                rank[i]=node_rank;
+            }
+        }
+        batch_items_.clear();
+        //长度>max_len_
+        if(max_len_>0&&skip_list_.length>max_len_){
+            DeleteNodeByRange(max_len_+1,skip_list_.length);
+        }
+    }
     bool DeleteNode(V val){
         SkipListNode<K,V>* pre_nodes[SKIPLIST_MAX_LEVEL]={nullptr};
         SkipListNode<K,V>* tmpNode=skip_list_.header;
         auto iter=rank_map_.find(val);
         if(iter==rank_map_.end())  return false;
         K& key=iter->second->key;
+        uint64_t rank=0;
         for(int32_t i=skip_list_.level-1;i>=0;i--){
-            while (tmpNode->levels[i].next
-                &&(tmpNode->levels[i].next->key>key||
-                (tmpNode->levels[i].next->key==key&&tmpNode->levels[i].next->value>val)))
+            while (tmpNode->levels()[i].next
+                &&(tmpNode->levels()[i].next->key>key||
+                (tmpNode->levels()[i].next->key==key&&tmpNode->levels()[i].next->value>val)))
             {
-                tmpNode=tmpNode->levels[i].next;
+                rank+=tmpNode->levels()[i].span;
+                tmpNode=tmpNode->levels()[i].next;
             }
             pre_nodes[i]=tmpNode;
         }
-        tmpNode=tmpNode->levels[0].next; //被删除节点
+        tmpNode=tmpNode->levels()[0].next; //被删除节点
         if(tmpNode&&tmpNode->key==key&&tmpNode->value==val)
         {
+            emitChange(SkipListChange::Left,key,val,rank+1,0);
             DeleteNode(tmpNode,pre_nodes);
             rank_map_.erase(val);
             return true;
@@ -306,26 +999,24 @@ public:
             return 0;
         }
         SkipListNode<K,V>* pre_nodes[SKIPLIST_MAX_LEVEL]={nullptr};
-        SkipListNode<K,V>* tmpNode=skip_list_.header;
-        uint64_t traversed=0,removed=0;
-        for(int32_t i=skip_list_.level-1;i>=0;i--){
-            while(tmpNode->levels[i].next&&(traversed+tmpNode->levels[i].span)<start){
-                traversed+=tmpNode->levels[i].span;
-                tmpNode=tmpNode->levels[i].next;
-            }
-            pre_nodes[i]=tmpNode;
-        }
-        tmpNode=tmpNode->levels[0].next;
-        traversed++;
-        while(tmpNode&&traversed<=end){
-            auto* next=tmpNode->levels[0].next;
-            DeleteNode(tmpNode,pre_nodes);
-            rank_map_.erase(tmpNode->value);
-            tmpNode=next;
-            traversed++;
-            removed++;
-        }
-        return removed;
+        findByRank(start,pre_nodes);
+        uint64_t traversed=start;
+        return deleteWhile(pre_nodes,start,[&](const SkipListNode<K,V>*){
+            return traversed++<=end;
+        });
+    }
+    /// 删除key在[lo,hi]之间的所有节点
+    /// \param lo
+    /// \param hi
+    /// \return 删除的节点数
+    uint64_t DeleteNodeByKeyRange(const K& lo,const K& hi){
+        if(lo>hi) return 0;
+        SkipListNode<K,V>* pre_nodes[SKIPLIST_MAX_LEVEL]={nullptr};
+        findByKey(hi,pre_nodes);
+        uint64_t first_rank=change_log_?RankByKey(hi):0;//第一个key<=hi的节点的排名
+        return deleteWhile(pre_nodes,first_rank,[&](const SkipListNode<K,V>* node){
+            return !(lo>node->key);
+        });
     }
     /// 查询指定val在跳表中的排名(index)
     /// \param val
@@ -337,20 +1028,47 @@ public:
         SkipListNode<K,V>* tmpNode=skip_list_.header;
         uint64_t rank=0;
         for(int32_t i=skip_list_.level-1;i>=0;i--) {
-            while(tmpNode->levels[i].next
-                &&(tmpNode->levels[i].next->key>cur_key
-                ||(tmpNode->levels[i].next->key==cur_key&&tmpNode->levels[i].next->value>val)))
+            while(tmpNode->levels()[i].next
+                &&(tmpNode->levels()[i].next->key>cur_key
+                ||(tmpNode->levels()[i].next->key==cur_key&&tmpNode->levels()[i].next->value>val)))
             {
-                rank+=tmpNode->levels[i].span;
-                tmpNode=tmpNode->levels[i].next;
+                rank+=tmpNode->levels()[i].span;
+                tmpNode=tmpNode->levels()[i].next;
             }
-            if(tmpNode->levels[i].next!= nullptr&&tmpNode->levels[i].next->value==val){
-                rank+=tmpNode->levels[i].span;
+            if(tmpNode->levels()[i].next!= nullptr&&tmpNode->levels()[i].next->value==val){
+                rank+=tmpNode->levels()[i].span;
                 return rank;
             }
         }
         return -1;
     }
+    /// 查询val的排名以及它前后各n个节点("我附近的玩家")
+    ///   一次下降求排名，再从rank_map_里的节点沿pre/next各走n步，O(logn+n)，不分配内存
+    /// \param val
+    /// \param n 前后各取n个，排名靠前或靠后不足n个时有多少取多少
+    /// \param buffer 调用方提供，至少能放2n+1个，按排名顺序写入，包含val自己
+    /// \param count 输出，写入buffer的节点数
+    /// \param first_rank 输出，buffer[0]的排名
+    /// \return val的排名，不存在时为-1
+    int64_t getAroundRank(const V& val,uint64_t n,const SkipListNode<K,V>** buffer,
+                          uint64_t& count,uint64_t& first_rank){
+        count=0;
+        first_rank=0;
+        int64_t rank=Rank(val);
+        if(rank<0) return -1;
+        const SkipListNode<K,V>* tmpNode=rank_map_.find(val)->second;
+        uint64_t before=0;
+        while(before<n&&tmpNode->pre){
+            tmpNode=tmpNode->pre;
+            before++;
+        }
+        first_rank=static_cast<uint64_t>(rank)-before;
+        for(uint64_t i=0;tmpNode&&i<before+1+n;i++){
+            buffer[count++]=tmpNode;
+            tmpNode=tmpNode->levels()[0].next;
+        }
+        return rank;
+    }
     /// 查找指定val的key
     /// \param val
     /// \return key的指针
@@ -363,18 +1081,115 @@ public:
     /// \param rank
     /// \return 节点指针
     SkipListNode<K,V>* getNodeByRank(uint64_t rank){
+        if(rank==0) return nullptr;//否则会返回头节点
         SkipListNode<K,V>* tmpNode=skip_list_.header;
         uint64_t traversed=0;
         for(int32_t i=skip_list_.level-1;i>=0;i--){
-            while(tmpNode->levels[i].next&&(traversed+tmpNode->levels[i].span)<=rank)
+            while(tmpNode->levels()[i].next&&(traversed+tmpNode->levels()[i].span)<=rank)
             {
-                traversed+=tmpNode->levels[i].span;
-                tmpNode=tmpNode->levels[i].next;
+                traversed+=tmpNode->levels()[i].span;
+                tmpNode=tmpNode->levels()[i].next;
             }
             if(traversed==rank) return tmpNode;
         }
         return nullptr;
     }
+    /// 第0层正向迭代，从第1名开始
+    iterator begin() const{
+        return iterator(skip_list_.header->levels()[0].next);
+    }
+    iterator end() const{
+        return iterator();
+    }
+    /// 第0层反向迭代，从最后一名开始
+    reverse_iterator rbegin() const{
+        return reverse_iterator(skip_list_.tail);
+    }
+    reverse_iterator rend() const{
+        return reverse_iterator();
+    }
+    /// 按排名顺序访问第start到第end个节点，一次O(logn)下降后沿第0层顺序访问，不分配内存
+    /// \param start 从1开始
+    /// \param end 超过长度时截到链尾
+    /// \param fn void(const SkipListNode<K,V>&)
+    /// \return 访问的节点数
+    template<class Fn>
+    uint64_t ForEachByRank(uint64_t start,uint64_t end,Fn&& fn){
+        if(start==0||start>end||start>skip_list_.length) return 0;
+        SkipListNode<K,V>* pre_nodes[SKIPLIST_MAX_LEVEL];
+        const SkipListNode<K,V>* tmpNode=findByRank(start,pre_nodes);
+        uint64_t visited=0;
+        for(uint64_t rank=start;tmpNode&&rank<=end;rank++){
+            fn(*tmpNode);
+            tmpNode=tmpNode->levels()[0].next;
+            visited++;
+        }
+        return visited;
+    }
+    /// 按排名顺序访问key在[lo,hi]之间的节点(key大的在前)，一次O(logn)下降后沿第0层顺序访问，不分配内存
+    /// \param lo
+    /// \param hi
+    /// \param fn void(const SkipListNode<K,V>&)
+    /// \return 访问的节点数
+    template<class Fn>
+    uint64_t ForEachByKey(const K& lo,const K& hi,Fn&& fn){
+        if(lo>hi) return 0;
+        SkipListNode<K,V>* pre_nodes[SKIPLIST_MAX_LEVEL];
+        const SkipListNode<K,V>* tmpNode=findByKey(hi,pre_nodes);
+        uint64_t visited=0;
+        while(tmpNode&&!(lo>tmpNode->key)){
+            fn(*tmpNode);
+            tmpNode=tmpNode->levels()[0].next;
+            visited++;
+        }
+        return visited;
+    }
+    /// 分数为key的新条目会排在第几名：key严格更大的节点数+1，同分的已有节点排在它之后。不要求key在榜上
+    /// \param key
+    /// \return 名次，从1开始
+    uint64_t RankByKey(const K& key) const{
+        return countBefore([&](const SkipListNode<K,V>* node){ return node->key>key; })+1;
+    }
+    /// (key,val)这一条目的名次：排在它前面的节点数+1，同分时val大的在前。不要求(key,val)在榜上
+    ///   多个跳表分片时，各分片的RankByKey(key,val)-1之和+1就是全局名次
+    /// \param key
+    /// \param val
+    /// \return 名次，从1开始
+    uint64_t RankByKey(const K& key,const V& val) const{
+        return countBefore([&](const SkipListNode<K,V>* node){
+            return node->key>key||(node->key==key&&node->value>val);
+        })+1;
+    }
+    /// key在[lo,hi]之间的节点数，两次O(logn)下降
+    /// \param lo
+    /// \param hi
+    /// \return 节点数，lo>hi时为0
+    uint64_t CountInKeyRange(const K& lo,const K& hi) const{
+        if(lo>hi) return 0;
+        uint64_t not_less_than_lo=countBefore([&](const SkipListNode<K,V>* node){ return !(lo>node->key); });
+        uint64_t greater_than_hi=countBefore([&](const SkipListNode<K,V>* node){ return node->key>hi; });
+        return not_less_than_lo-greater_than_hi;
+    }
+    /// 第rank名的分数
+    /// \param rank 从1开始
+    /// \return key指针，越界时为nullptr
+    const K* KeyAtRank(uint64_t rank){
+        SkipListNode<K,V>* node=getNodeByRank(rank);
+        if(node== nullptr) return nullptr;
+        return &node->key;
+    }
+    /// 百分位分数：前(100-percentile)%中最后一名的key，即第ceil((100-percentile)%*length)名，至少为第1名
+    ///   percentile=100时为第1名，percentile=0时为最后一名，例如99表示前1%的门槛分
+    /// \param percentile [0,100]
+    /// \return key指针，跳表为空或percentile越界时为nullptr
+    const K* KeyAtPercentile(double percentile){
+        if(skip_list_.length==0||!(percentile>=0&&percentile<=100)) return nullptr;
+        double top=(100-percentile)/100*static_cast<double>(skip_list_.length);
+        auto rank=static_cast<uint64_t>(std::ceil(top));
+        if(rank<1) rank=1;
+        if(rank>skip_list_.length) rank=skip_list_.length;
+        return KeyAtRank(rank);
+    }
     /// 是否存在指定val
     /// \param val
     /// \return
@@ -389,9 +1204,9 @@ public:
     ///逻辑上打印跳表
     void printSkipList(){
         for(int32_t i=skip_list_.level-1;i>=0;i--){
-            for(auto iter=skip_list_.header->levels[i].next;iter!= nullptr; iter=iter->levels[i].next) {
-                std::cout<<"["<<iter->key<<","<<iter->value<<","<<iter->levels[i].span<<"]";
-                if(iter->levels[i].next) std::cout<<" => ";
+            for(auto iter=skip_list_.header->levels()[i].next;iter!= nullptr; iter=iter->levels()[i].next) {
+                std::cout<<"["<<iter->key<<","<<iter->value<<","<<iter->levels()[i].span<<"]";
+                if(iter->levels()[i].next) std::cout<<" => ";
             }
             std::cout<<std::endl;
         }
@@ -0,0 +1,168 @@
+//
+// Created by zhangshiping on 26-10-17.
+//
+
+#ifndef GAMETOOLS_SKIP_LIST_CHANGE_LOG_H
+#define GAMETOOLS_SKIP_LIST_CHANGE_LOG_H
+
+#include <cstdint>
+#include <vector>
+
+namespace GameTools{
+
+///排名变化类型
+enum class SkipListChange : uint8_t{
+    //上榜，old_rank为0
+    Entered,
+    //下榜(删除或被max_len挤掉)，new_rank为0
+    Left,
+    //改分，排名可能不变(old_rank==new_rank)
+    Moved,
+    //整个榜被清空，ranks和key/value都无意义
+    Cleared,
+};
+
+///一条变化事件，排名都是该次操作前后的排名，从1开始
+template<class K,class V>
+struct SkipListChangeEvent{
+    //从1开始连续递增的序号
+    uint64_t seq;
+    uint64_t old_rank;
+    uint64_t new_rank;
+    //操作后的key，Left时为下榜前的key
+    K key;
+    V value;
+    SkipListChange type;
+};
+
+///排名变化日志：预分配的环形缓冲区，写入时不分配内存，写满后覆盖最老的事件
+///  RankSkipList::SetChangeLog之后，跳表的每次增删改都按发生顺序追加事件
+///  订阅者登记一个排名窗口，Poll时只拿到会改变窗口内容的事件；读得太慢被覆盖时报告overrun，应该整体重新拉取一次
+///  和跳表一样不是线程安全的
+template<class K,class V>
+class SkipListChangeLog{
+public:
+    using Event=SkipListChangeEvent<K,V>;
+
+    /// \param capacity 环形缓冲区能放的事件数，向上取整到2的幂
+    explicit SkipListChangeLog(uint64_t capacity=4096){
+        uint64_t size=1;
+        while(size<capacity) size<<=1;
+        ring_.resize(size);
+        mask_=size-1;
+    }
+    SkipListChangeLog(const SkipListChangeLog&)=delete;
+    SkipListChangeLog& operator=(const SkipListChangeLog&)=delete;
+
+    /// 追加一条事件，由跳表调用
+    void Append(SkipListChange type,const K& key,const V& value,uint64_t old_rank,uint64_t new_rank){
+        Event& event=ring_[next_seq_&mask_];
+        event.seq=next_seq_++;
+        event.old_rank=old_rank;
+        event.new_rank=new_rank;
+        event.key=key;
+        event.value=value;
+        event.type=type;
+    }
+    /// 下一条事件的序号，也就是已写入的事件数+1
+    uint64_t NextSeq() const{
+        return next_seq_;
+    }
+    /// 缓冲区里最老事件的序号
+    uint64_t OldestSeq() const{
+        return next_seq_>ring_.size()?next_seq_-ring_.size():1;
+    }
+    /// 从cursor开始顺序读取事件
+    /// \param cursor 输入输出，下一条要读的序号，初始可以用NextSeq()或1
+    /// \param overrun 输出，cursor之前的事件是否已被覆盖(此时从最老的事件开始读)
+    /// \return 写入out的个数
+    uint64_t Read(uint64_t& cursor,Event* out,uint64_t max,bool& overrun) const{
+        overrun=false;
+        if(cursor<OldestSeq()){
+            overrun=true;
+            cursor=OldestSeq();
+        }
+        uint64_t count=0;
+        while(cursor<next_seq_&&count<max) out[count++]=ring_[(cursor++)&mask_];
+        return count;
+    }
+    /// 登记排名窗口[lo,hi]，从当前位置开始接收事件
+    /// \return 订阅id
+    uint32_t Subscribe(uint64_t lo,uint64_t hi){
+        for(uint32_t id=0;id<subscriptions_.size();id++){
+            if(!subscriptions_[id].active){
+                subscriptions_[id]={lo,hi,next_seq_,true};
+                return id;
+            }
+        }
+        subscriptions_.push_back({lo,hi,next_seq_,true});
+        return static_cast<uint32_t>(subscriptions_.size()-1);
+    }
+    void Unsubscribe(uint32_t id){
+        if(id<subscriptions_.size()) subscriptions_[id].active=false;
+    }
+    /// 取出会影响订阅窗口的事件
+    ///   窗口外的改分也会让窗口里的玩家整体平移一名，所以判断的是这次变化影响的排名区间是否和窗口相交
+    /// \param overrun 输出，有事件来不及读已被覆盖，订阅者应当整体重新查询窗口
+    /// \return 写入out的个数
+    uint64_t Poll(uint32_t id,Event* out,uint64_t max,bool& overrun){
+        overrun=false;
+        if(id>=subscriptions_.size()||!subscriptions_[id].active) return 0;
+        Subscription& sub=subscriptions_[id];
+        if(sub.cursor<OldestSeq()){
+            overrun=true;
+            sub.cursor=OldestSeq();
+        }
+        uint64_t count=0;
+        while(sub.cursor<next_seq_&&count<max){
+            const Event& event=ring_[(sub.cursor++)&mask_];
+            if(Affects(event,sub.lo,sub.hi)) out[count++]=event;
+        }
+        return count;
+    }
+    /// 事件是否改变了排名窗口[lo,hi]的内容
+    static bool Affects(const Event& event,uint64_t lo,uint64_t hi){
+        switch(event.type){
+            case SkipListChange::Entered: return event.new_rank<=hi;//新排名及之后的都后移一名
+            case SkipListChange::Left: return event.old_rank<=hi;//旧排名之后的都前移一名
+            case SkipListChange::Moved:{
+                uint64_t from=event.old_rank<event.new_rank?event.old_rank:event.new_rank;
+                uint64_t to=event.old_rank<event.new_rank?event.new_rank:event.old_rank;
+                return from<=hi&&to>=lo;
+            }
+            default: return true;
+        }
+    }
+    /// 按顺序把事件重放到跳表上(崩溃后从快照+日志恢复)
+    ///   Entered/Moved重放为InsertOrUpdate，Left为DeleteNode，Cleared为Clear
+    /// \return 重放的事件数
+    template<class List>
+    static uint64_t Replay(List& list,const Event* events,uint64_t count){
+        for(uint64_t i=0;i<count;i++){
+            const Event& event=events[i];
+            switch(event.type){
+                case SkipListChange::Entered:
+                case SkipListChange::Moved: list.InsertOrUpdate(event.key,event.value); break;
+                case SkipListChange::Left: list.DeleteNode(event.value); break;
+                case SkipListChange::Cleared: list.Clear(); break;
+            }
+        }
+        return count;
+    }
+
+private:
+    struct Subscription{
+        uint64_t lo;
+        uint64_t hi;
+        uint64_t cursor;
+        bool active;
+    };
+    std::vector<Event> ring_;
+    uint64_t mask_=0;
+    uint64_t next_seq_=1;
+    std::vector<Subscription> subscriptions_;
+};
+
+}
+
+#endif //GAMETOOLS_SKIP_LIST_CHANGE_LOG_H
@@ -0,0 +1,366 @@
+//
+// Created by zhangshiping on 26-10-17.
+//
+
+#ifndef GAMETOOLS_SKIP_LIST_SNAPSHOT_H
+#define GAMETOOLS_SKIP_LIST_SNAPSHOT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "skip_list.h"
+
+namespace GameTools{
+
+///快照文件格式(小端，按本机布局直接写，只在同构机器间使用)
+///  [SkipListSnapshotHeader][count个SkipListSnapshotEntry，按排名顺序][count个uint64_t，按value降序排列的条目下标]
+///  checksum是header之后全部字节的FNV-1a
+struct SkipListSnapshotHeader{
+    char magic[8];
+    uint32_t version;
+    uint32_t key_size;
+    uint32_t value_size;
+    uint32_t entry_size;
+    uint64_t count;
+    uint64_t max_len;
+    uint64_t entries_offset;
+    uint64_t index_offset;
+    uint64_t file_size;
+    uint64_t checksum;
+};
+
+///快照中的一条记录，字段名与SkipListNode一致
+template<class K,class V>
+struct SkipListSnapshotEntry{
+    K key;
+    V value;
+};
+
+constexpr char SKIPLIST_SNAPSHOT_MAGIC[8]={'G','T','S','K','I','P','L','S'};
+constexpr uint32_t SKIPLIST_SNAPSHOT_VERSION=1;
+
+inline uint64_t SnapshotChecksum(const unsigned char* data,std::size_t size,uint64_t hash=0xcbf29ce484222325ULL){
+    for(std::size_t i=0;i<size;i++){
+        hash^=data[i];
+        hash*=0x100000001b3ULL;
+    }
+    return hash;
+}
+
+///只读映射一个快照文件，析构时解除映射
+template<class K,class V>
+class SkipListSnapshotFile{
+public:
+    using Entry=SkipListSnapshotEntry<K,V>;
+
+    SkipListSnapshotFile()=default;
+    ~SkipListSnapshotFile(){
+        Close();
+    }
+    SkipListSnapshotFile(const SkipListSnapshotFile&)=delete;
+    SkipListSnapshotFile& operator=(const SkipListSnapshotFile&)=delete;
+
+    /// 映射并校验文件：文件头和各段的范围总是检查
+    /// \param verify 是否校验checksum，需要把整个文件读一遍；不校验时条目内容不可信，但FrozenRankList的查询不会越界
+    /// \return 是否成功，失败时打印原因
+    bool Open(const char* path,bool verify=true){
+        Close();
+        int fd=open(path,O_RDONLY);
+        if(fd<0){
+            std::cout<<"snapshot open failed "<<path<<std::endl;
+            return false;
+        }
+        struct stat st;
+        if(fstat(fd,&st)!=0||static_cast<std::size_t>(st.st_size)<sizeof(SkipListSnapshotHeader)){
+            std::cout<<"snapshot too small "<<path<<std::endl;
+            close(fd);
+            return false;
+        }
+        size_=static_cast<std::size_t>(st.st_size);
+        void* data=mmap(nullptr,size_,PROT_READ,MAP_SHARED,fd,0);
+        close(fd);
+        if(data==MAP_FAILED){
+            std::cout<<"snapshot mmap failed "<<path<<std::endl;
+            size_=0;
+            return false;
+        }
+        data_=static_cast<const unsigned char*>(data);
+        if(!check(verify)){
+            Close();
+            return false;
+        }
+        return true;
+    }
+    void Close(){
+        if(data_) munmap(const_cast<unsigned char*>(data_),size_);
+        data_=nullptr;
+        size_=0;
+    }
+    const SkipListSnapshotHeader& Header() const{
+        return *reinterpret_cast<const SkipListSnapshotHeader*>(data_);
+    }
+    uint64_t Count() const{
+        return data_?Header().count:0;
+    }
+    /// 按排名顺序的条目数组，entries()[rank-1]是第rank名
+    const Entry* Entries() const{
+        return reinterpret_cast<const Entry*>(data_+Header().entries_offset);
+    }
+    /// 按value降序排列的条目下标，来自文件，使用前要检查<Count()
+    const uint64_t* ValueIndex() const{
+        return reinterpret_cast<const uint64_t*>(data_+Header().index_offset);
+    }
+
+private:
+    bool check(bool verify) const{
+        const SkipListSnapshotHeader& header=Header();
+        if(std::memcmp(header.magic,SKIPLIST_SNAPSHOT_MAGIC,sizeof(header.magic))!=0
+            ||header.version!=SKIPLIST_SNAPSHOT_VERSION){
+            std::cout<<"snapshot bad magic or version"<<std::endl;
+            return false;
+        }
+        if(header.key_size!=sizeof(K)||header.value_size!=sizeof(V)||header.entry_size!=sizeof(Entry)){
+            std::cout<<"snapshot K/V size mismatch"<<std::endl;
+            return false;
+        }
+        //count来自文件，先比较偏移再用除法比较个数，不做可能溢出的乘法
+        if(header.file_size!=size_
+            ||header.entries_offset%alignof(Entry)!=0||header.index_offset%alignof(uint64_t)!=0
+            ||header.entries_offset<sizeof(SkipListSnapshotHeader)
+            ||header.entries_offset>header.index_offset||header.index_offset>size_
+            ||header.count>(header.index_offset-header.entries_offset)/sizeof(Entry)
+            ||header.count>(size_-header.index_offset)/sizeof(uint64_t)){
+            std::cout<<"snapshot bad layout"<<std::endl;
+            return false;
+        }
+        if(verify&&SnapshotChecksum(data_+sizeof(SkipListSnapshotHeader),size_-sizeof(SkipListSnapshotHeader))!=header.checksum){
+            std::cout<<"snapshot checksum mismatch"<<std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    const unsigned char* data_=nullptr;
+    std::size_t size_=0;
+};
+
+namespace SnapshotDetail{
+inline uint64_t AlignUp(uint64_t offset,uint64_t align){
+    return (offset+align-1)/align*align;
+}
+///把条目数组适配成BuildFromSorted要的first/second迭代器
+template<class K,class V>
+class EntryIterator{
+public:
+    using iterator_category=std::forward_iterator_tag;
+    using value_type=std::pair<K,V>;
+    using difference_type=std::ptrdiff_t;
+    using pointer=const value_type*;
+    using reference=const value_type&;
+
+    explicit EntryIterator(const SkipListSnapshotEntry<K,V>* entry):entry_(entry){}
+    reference operator*() const{
+        pair_.first=entry_->key;
+        pair_.second=entry_->value;
+        return pair_;
+    }
+    pointer operator->() const{ return &**this; }
+    EntryIterator& operator++(){
+        entry_++;
+        return *this;
+    }
+    bool operator==(const EntryIterator& other) const{ return entry_==other.entry_; }
+    bool operator!=(const EntryIterator& other) const{ return entry_!=other.entry_; }
+private:
+    const SkipListSnapshotEntry<K,V>* entry_;
+    mutable value_type pair_;
+};
+}
+
+/// 把跳表按排名顺序写成快照文件，K/V需要是平凡可拷贝的
+/// \param max_len 写进文件头，供加载方参考
+/// \return 是否成功，失败时打印原因
+template<class K,class V,class H,class P>
+bool SaveSnapshot(const RankSkipList<K,V,H,P>& list,const char* path,uint64_t max_len=0){
+    static_assert(std::is_trivially_copyable<K>::value&&std::is_trivially_copyable<V>::value,"快照只支持平凡可拷贝的K/V");
+    using Entry=SkipListSnapshotEntry<K,V>;
+    std::vector<Entry> entries;
+    for(auto iter=list.begin();iter!=list.end();++iter){
+        Entry entry;
+        std::memset(&entry,0,sizeof(entry));//填充字节清零，保证checksum稳定
+        entry.key=iter->key;
+        entry.value=iter->value;
+        entries.push_back(entry);
+    }
+    std::vector<uint64_t> index(entries.size());
+    for(uint64_t i=0;i<index.size();i++) index[i]=i;
+    std::sort(index.begin(),index.end(),[&](uint64_t a,uint64_t b){ return entries[a].value>entries[b].value; });
+
+    SkipListSnapshotHeader header;
+    std::memset(&header,0,sizeof(header));
+    std::memcpy(header.magic,SKIPLIST_SNAPSHOT_MAGIC,sizeof(header.magic));
+    header.version=SKIPLIST_SNAPSHOT_VERSION;
+    header.key_size=sizeof(K);
+    header.value_size=sizeof(V);
+    header.entry_size=sizeof(Entry);
+    header.count=entries.size();
+    header.max_len=max_len;
+    header.entries_offset=SnapshotDetail::AlignUp(sizeof(header),alignof(Entry));
+    header.index_offset=SnapshotDetail::AlignUp(header.entries_offset+entries.size()*sizeof(Entry),alignof(uint64_t));
+    header.file_size=header.index_offset+index.size()*sizeof(uint64_t);
+
+    std::vector<unsigned char> body(header.file_size-sizeof(header),0);
+    if(!entries.empty()) std::memcpy(body.data()+header.entries_offset-sizeof(header),entries.data(),entries.size()*sizeof(Entry));
+    if(!index.empty()) std::memcpy(body.data()+header.index_offset-sizeof(header),index.data(),index.size()*sizeof(uint64_t));
+    header.checksum=SnapshotChecksum(body.data(),body.size());
+
+    //先写临时文件再rename，读者不会映射到写了一半的文件
+    std::string tmp=std::string(path)+".tmp";
+    FILE* file=std::fopen(tmp.c_str(),"wb");
+    if(file== nullptr){
+        std::cout<<"snapshot create failed "<<tmp<<std::endl;
+        return false;
+    }
+    bool ok=std::fwrite(&header,sizeof(header),1,file)==1
+            &&(body.empty()||std::fwrite(body.data(),body.size(),1,file)==1);
+    //rename之前落盘，掉电后不会留下新名字、旧内容(或空文件)的快照
+    ok=ok&&std::fflush(file)==0&&fsync(fileno(file))==0;
+    ok=(std::fclose(file)==0)&&ok;
+    if(!ok||std::rename(tmp.c_str(),path)!=0){
+        std::cout<<"snapshot write failed "<<path<<std::endl;
+        std::remove(tmp.c_str());
+        return false;
+    }
+    //改名记在目录里，目录也落盘
+    std::string name(path);
+    std::string::size_type slash=name.find_last_of('/');
+    std::string dir=slash==std::string::npos?".":(slash==0?"/":name.substr(0,slash));
+    int fd=open(dir.c_str(),O_RDONLY|O_DIRECTORY);
+    if(fd>=0){
+        fsync(fd);
+        close(fd);
+    }
+    return true;
+}
+
+/// 映射快照文件，用BuildFromSorted一次线性遍历建表，原有数据被清空
+/// \return 是否成功，失败时打印原因，跳表不变
+template<class K,class V,class H,class P>
+bool LoadSnapshot(RankSkipList<K,V,H,P>& list,const char* path){
+    SkipListSnapshotFile<K,V> file;
+    if(!file.Open(path)) return false;
+    const SkipListSnapshotEntry<K,V>* entries=file.Entries();
+    list.BuildFromSorted(SnapshotDetail::EntryIterator<K,V>(entries),
+                         SnapshotDetail::EntryIterator<K,V>(entries+file.Count()));
+    return true;
+}
+
+///只读排行榜：直接在映射的快照上二分查询，不建节点、不分配内存
+///  多个进程映射同一个文件时共享page cache
+///  排名查询O(1)，按value查排名和按key查询O(logn)
+template<class K,class V>
+class FrozenRankList{
+public:
+    using Entry=SkipListSnapshotEntry<K,V>;
+
+    /// \param verify 是否校验checksum
+    bool Open(const char* path,bool verify=true){
+        return file_.Open(path,verify);
+    }
+    uint64_t length() const{
+        return file_.Count();
+    }
+    /// 第rank名，越界时为nullptr
+    const Entry* getNodeByRank(uint64_t rank) const{
+        if(rank==0||rank>length()) return nullptr;
+        return file_.Entries()+rank-1;
+    }
+    /// val的排名，不存在时为-1
+    int64_t Rank(const V& val) const{
+        const Entry* entry=find(val);
+        return entry?entry-file_.Entries()+1:-1;
+    }
+    const K* getKey(const V& val) const{
+        const Entry* entry=find(val);
+        return entry?&entry->key:nullptr;
+    }
+    bool has(const V& val) const{
+        return find(val)!= nullptr;
+    }
+    /// 分数为key的新条目会排在第几名，同RankSkipList::RankByKey
+    uint64_t RankByKey(const K& key) const{
+        return lowerKey(key)+1;
+    }
+    /// key在[lo,hi]之间的条目数
+    uint64_t CountInKeyRange(const K& lo,const K& hi) const{
+        if(lo>hi) return 0;
+        uint64_t first=lowerKey(hi);
+        uint64_t last=notLessKey(lo);
+        return first<last?last-first:0;
+    }
+    /// 按排名顺序访问第start到end名
+    /// \param fn void(const SkipListSnapshotEntry<K,V>&)
+    template<class Fn>
+    uint64_t ForEachByRank(uint64_t start,uint64_t end,Fn&& fn) const{
+        if(start==0) start=1;
+        if(end>length()) end=length();
+        uint64_t visited=0;
+        for(uint64_t rank=start;rank<=end;rank++,visited++) fn(file_.Entries()[rank-1]);
+        return visited;
+    }
+    /// 按排名顺序访问key在[lo,hi]之间的条目
+    template<class Fn>
+    uint64_t ForEachByKey(const K& lo,const K& hi,Fn&& fn) const{
+        if(lo>hi) return 0;
+        uint64_t first=lowerKey(hi);
+        uint64_t last=notLessKey(lo);
+        for(uint64_t i=first;i<last;i++) fn(file_.Entries()[i]);
+        return first<last?last-first:0;
+    }
+
+private:
+    /// key严格大于key的条目数
+    uint64_t lowerKey(const K& key) const{
+        const Entry* entries=file_.Entries();
+        return static_cast<uint64_t>(std::partition_point(entries,entries+length(),[&](const Entry& entry){
+            return entry.key>key;
+        })-entries);
+    }
+    /// key不小于key的条目数
+    uint64_t notLessKey(const K& key) const{
+        const Entry* entries=file_.Entries();
+        return static_cast<uint64_t>(std::partition_point(entries,entries+length(),[&](const Entry& entry){
+            return !(key>entry.key);
+        })-entries);
+    }
+    const Entry* find(const V& val) const{
+        if(length()==0) return nullptr;
+        const uint64_t* index=file_.ValueIndex();
+        const Entry* entries=file_.Entries();
+        //下标越界说明文件坏了，当作找不到
+        bool bad=false;
+        const uint64_t* pos=std::partition_point(index,index+length(),[&](uint64_t i){
+            if(i>=length()) bad=true;
+            return !bad&&entries[i].value>val;
+        });
+        if(bad||pos==index+length()||*pos>=length()||!(entries[*pos].value==val)) return nullptr;
+        return entries+*pos;
+    }
+
+    SkipListSnapshotFile<K,V> file_;
+};
+
+}
+
+#endif //GAMETOOLS_SKIP_LIST_SNAPSHOT_H
@@ -0,0 +1,166 @@
+//
+// Created by zhangshiping on 26-10-17.
+//
+//并发跳表的检查：一个写线程InsertOrUpdate/DeleteNode/Clear，几个读线程不停地翻页、查排名、查附近玩家，
+//每次读的结果必须是某一个完整版本(有序、不重复、条目没有被拆开)，停下后和同样操作的RankSkipList逐条比对
+//写者会不断攒够一批摘下的节点并Synchronize回收，读者同时在遍历：回收早了会读到归还的节点，在ASan/TSan下跑能看出来
+//  cmake -S . -B build-tsan -DSANITIZE=thread && cmake --build build-tsan && ctest --test-dir build-tsan
+#include "concurrent_skip_list.h"
+#include "skip_list.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace GameTools;
+
+namespace{
+
+std::atomic<int> failures{0};
+
+#define CHECK(cond) do{ if(!(cond)){ failures++; std::cout<<__FILE__<<":"<<__LINE__<<" CHECK("#cond") failed"<<std::endl; } }while(0)
+
+using Concurrent=ConcurrentRankSkipList<int64_t,int64_t>;
+using Entry=Concurrent::Entry;
+using List=RankSkipList<int64_t,int64_t>;
+
+//val的取值范围
+constexpr int64_t VALS=500;
+//key=分数*8+(val&7)，读到的条目低3位对不上说明key和val不是同一个节点的
+constexpr int64_t KEY_TAG=8;
+
+int64_t MakeKey(int64_t score,int64_t val){
+    return score*KEY_TAG+(val&(KEY_TAG-1));
+}
+
+/// 一次读出来的若干条：条目完整，按key从大到小、key相同时val从大到小严格有序
+bool Consistent(const Entry* entries,uint64_t count){
+    for(uint64_t i=0;i<count;i++){
+        if(entries[i].value<0||entries[i].value>=VALS) return false;
+        if((entries[i].key&(KEY_TAG-1))!=(entries[i].value&(KEY_TAG-1))) return false;
+        if(i>0){
+            const Entry& pre=entries[i-1];
+            if(!(pre.key>entries[i].key||(pre.key==entries[i].key&&pre.value>entries[i].value))) return false;
+        }
+    }
+    return true;
+}
+
+/// 读线程：翻页、整表拷贝、附近玩家、排名，检查每次读各自一致
+void Reader(Concurrent& list,const std::atomic<bool>& stop,uint64_t seed,uint64_t& reads){
+    std::mt19937_64 gen(seed);
+    std::vector<Entry> buffer(VALS+1);
+    while(!stop.load(std::memory_order_acquire)){
+        reads++;
+        switch(gen()%5){
+            case 0:{
+                uint64_t start=gen()%VALS+1;
+                uint64_t end=start+gen()%20;
+                uint64_t count=list.CopyByRank(start,end,buffer.data());
+                CHECK(count<=end-start+1);
+                CHECK(Consistent(buffer.data(),count));
+                break;
+            }
+            case 1:{
+                uint64_t count=list.CopyByRank(1,VALS,buffer.data());
+                CHECK(Consistent(buffer.data(),count));
+                break;
+            }
+            case 2:{
+                int64_t val=static_cast<int64_t>(gen()%VALS);
+                uint64_t n=gen()%6;
+                uint64_t count=0;
+                uint64_t first_rank=0;
+                int64_t rank=list.getAroundRank(val,n,buffer.data(),count,first_rank);
+                if(rank<0){
+                    CHECK(rank==-1&&count==0);
+                    break;
+                }
+                auto self=static_cast<uint64_t>(rank);
+                //val自己在buffer里，前面正好min(n,rank-1)个
+                CHECK(first_rank==(self>n?self-n:1));
+                CHECK(count>self-first_rank&&count<=2*n+1);
+                CHECK(count>self-first_rank&&buffer[self-first_rank].value==val);
+                CHECK(Consistent(buffer.data(),count));
+                break;
+            }
+            case 3:{
+                int64_t rank=list.Rank(static_cast<int64_t>(gen()%VALS));
+                CHECK(rank==-1||(rank>=1&&rank<=VALS));
+                break;
+            }
+            default:{
+                uint64_t rank=list.RankByKey(MakeKey(static_cast<int64_t>(gen()%64),0));
+                CHECK(rank>=1&&rank<=VALS+1);
+                break;
+            }
+        }
+    }
+}
+
+/// 一个写者、三个读者；写者的每一步同时做在单线程的RankSkipList上，返回值逐个比对，停下后整表比对
+void RunConcurrent(uint64_t max_len,std::size_t ops){
+    Concurrent list(max_len,3);
+    List expect(max_len,3);
+    std::atomic<bool> stop{false};
+    std::vector<uint64_t> reads(3,0);
+    std::vector<std::thread> readers;
+    for(std::size_t i=0;i<reads.size();i++){
+        readers.emplace_back(Reader,std::ref(list),std::cref(stop),i+1,std::ref(reads[i]));
+    }
+    std::mt19937_64 gen(max_len+ops);
+    for(std::size_t i=0;i<ops;i++){
+        int64_t val=static_cast<int64_t>(gen()%VALS);
+        uint64_t op=gen()%1000;
+        if(op==0){
+            list.Clear();
+            expect.Clear();
+        }else if(op<250){
+            CHECK(list.DeleteNode(val)==expect.DeleteNode(val));
+        }else{
+            //分数范围小，key相同的条目很多
+            int64_t key=MakeKey(static_cast<int64_t>(gen()%64),val);
+            bool kept=list.InsertOrUpdate(key,val);
+            expect.InsertOrUpdate(key,val);
+            CHECK(kept==expect.has(val));
+        }
+    }
+    stop.store(true,std::memory_order_release);
+    for(auto& reader:readers) reader.join();
+    for(uint64_t count:reads) CHECK(count>0);
+
+    std::vector<Entry> buffer(VALS+1);
+    uint64_t count=list.CopyByRank(1,VALS,buffer.data());
+    CHECK(count==expect.length());
+    CHECK(list.length()==expect.length());
+    uint64_t index=0;
+    for(auto& node:expect){
+        CHECK(index<count&&buffer[index].key==node.key&&buffer[index].value==node.value);
+        index++;
+    }
+    for(int64_t val=0;val<VALS;val++){
+        CHECK(list.Rank(val)==expect.Rank(val));
+        int64_t key=0;
+        CHECK(list.getKey(val,key)==expect.has(val));
+        CHECK(!expect.has(val)||key==*expect.getKey(val));
+    }
+    for(int64_t score=0;score<=64;score++){
+        CHECK(list.RankByKey(MakeKey(score,0))==expect.RankByKey(MakeKey(score,0)));
+    }
+}
+
+}
+
+int main(){
+    RunConcurrent(0,200000);
+    RunConcurrent(100,200000);
+    if(failures){
+        std::cout<<failures<<" checks failed"<<std::endl;
+        return 1;
+    }
+    std::cout<<"ok"<<std::endl;
+    return 0;
+}
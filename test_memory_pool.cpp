@@ -1,21 +1,422 @@
 //
 // Created by zhangshiping on 24-5-29.
 //
+//内存池的行为检查：大小级别、对齐、归还后重用、按大小归还、大块mmap、Trim、预热文件、统计计数、调试模式的报告，失败时打印并返回非0
+//CMake里按无头部、头部、调试三种模式各编一份，ctest都跑
+//预热文件里每个级别最多预热4MB，损坏文件的检查不用真的映射1GB
+#define MEMORY_POOL_PROFILE_MAX_BYTES (std::size_t(4)<<20)
 #include "memory_pool.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace GameTools;
+
+namespace{
+
+int failures=0;
+
+#define CHECK(cond) do{ if(!(cond)){ failures++; std::cout<<__FILE__<<":"<<__LINE__<<" CHECK("#cond") failed"<<std::endl; } }while(0)
+
+bool Aligned(const void* pointer,std::size_t align){
+    return align<=1||reinterpret_cast<uintptr_t>(pointer)%align==0;
+}
+
+/// 一块借出的内存：地址、申请的大小和对齐、填的字节
+struct Block{
+    char* pointer;
+    std::size_t size;
+    std::size_t align;
+    unsigned char fill;
+};
+
+void Fill(const Block& block){
+    std::memset(block.pointer,block.fill,block.size);
+}
+
+bool Intact(const Block& block){
+    for(std::size_t i=0;i<block.size;i++){
+        if(static_cast<unsigned char>(block.pointer[i])!=block.fill) return false;
+    }
+    return true;
+}
+
+void TestSizeClass(){
+    //每个大小落在能放下它的最小级别上，级别大小递增
+    for(int32_t index=1;index<MemorySizeClass::COUNT;index++) CHECK(MemorySizeClass::Size(index)>MemorySizeClass::Size(index-1));
+    for(std::size_t size=1;size<=(1u<<20);size+=size<4096?1:size/64){
+        int32_t index=MemorySizeClass::Index(size);
+        CHECK(MemorySizeClass::Size(index)>=size);
+        CHECK(index==0||MemorySizeClass::Size(index-1)<size);
+    }
+    for(std::size_t align=1;align<=MemoryPool::MAX_ALIGN;align*=2){
+        for(std::size_t size=1;size<=4096;size+=7){
+            int32_t index=MemorySizeClass::AlignedIndex(size,align);
+            CHECK(MemorySizeClass::Size(index)>=size&&MemorySizeClass::Size(index)%align==0);
+        }
+    }
+}
+
+void TestRoundTrip(){
+    MemoryPool pool;
+    std::mt19937_64 gen(1);
+    std::vector<Block> blocks;
+    //各个级别的块同时借出，互相不重叠；无头部模式下超过8字节的按16字节对齐
+    for(int i=0;i<4000;i++){
+        std::size_t size=1+gen()%(i%10==0?8192:512);
+        Block block{pool.GetMemory(size),size,0,static_cast<unsigned char>(gen())};
+        CHECK(block.pointer!= nullptr);
+        if(block.pointer== nullptr) continue;
+#if ENABLE_MEMORY_POOL_HEADERLESS
+        CHECK(size<=8||Aligned(block.pointer,16));
+#endif
+        Fill(block);
+        blocks.push_back(block);
+    }
+    for(auto& block:blocks) CHECK(Intact(block));
+    //一半按地址归还，一半按大小归还，顺序打乱
+    std::shuffle(blocks.begin(),blocks.end(),gen);
+    for(std::size_t i=0;i<blocks.size();i++){
+        if(i%2) pool.GiveBack(blocks[i].pointer);
+        else pool.GiveBack(blocks[i].pointer,blocks[i].size);
+    }
+    //归还后马上申请同样大小，拿回刚归还的块
+    for(std::size_t size:{1,8,24,100,1000,5000,60000}){
+        char* first=pool.GetMemory(size);
+        pool.GiveBack(first,size);
+        char* second=pool.GetMemory(size);
+        CHECK(second==first);
+        pool.GiveBack(second);
+    }
+}
+
+void TestAlign(){
+    MemoryPool pool;
+    CHECK(pool.GetMemory(64,3)== nullptr);
+    CHECK(pool.GetMemory(64,MemoryPool::MAX_ALIGN*2)== nullptr);
+    std::mt19937_64 gen(2);
+    std::vector<Block> blocks;
+    for(std::size_t align=0;align<=MemoryPool::MAX_ALIGN;align=align?align*2:1){
+        for(std::size_t size:{1,7,8,9,63,64,65,100,1000,4096,70000}){
+            Block block{pool.GetMemory(size,align),size,align,static_cast<unsigned char>(gen())};
+            CHECK(block.pointer!= nullptr&&Aligned(block.pointer,align));
+            if(block.pointer== nullptr) continue;
+            Fill(block);
+            blocks.push_back(block);
+        }
+    }
+    for(auto& block:blocks) CHECK(Intact(block));
+    //按大小归还后同样的申请拿回同一块
+    for(std::size_t i=0;i<blocks.size();i++){
+        Block& block=blocks[i];
+        if(i%3==0){
+            pool.GiveBack(block.pointer);
+            continue;
+        }
+        pool.GiveBack(block.pointer,block.size,block.align);
+        char* again=pool.GetMemory(block.size,block.align);
+        CHECK(again==block.pointer);
+        pool.GiveBack(again,block.size,block.align);
+    }
+}
+
+/// 编译期大小和运行时大小落在同一个级别：归还后用另一种方式申请拿回同一块
+template<std::size_t N>
+void CheckFixed(MemoryPool& pool){
+    char* fixed=pool.GetMemory<N>();
+    CHECK(fixed!= nullptr);
+    std::memset(fixed,0x5a,N);
+    pool.GiveBack(fixed,N);
+    char* dynamic=pool.GetMemory(N);
+    CHECK(dynamic==fixed);
+    pool.GiveBack(dynamic);
+}
+
+void TestFixed(){
+    MemoryPool pool;
+    CheckFixed<1>(pool);
+    CheckFixed<8>(pool);
+    CheckFixed<24>(pool);
+    CheckFixed<100>(pool);
+    CheckFixed<1000>(pool);
+    CheckFixed<60000>(pool);
+    //编译期大小超过阈值的也直接mmap
+    char* large=pool.GetMemory<MemoryPool::MMAP_THRESHOLD+1>();
+    CHECK(large!= nullptr&&pool.LargeBytes()>MemoryPool::MMAP_THRESHOLD);
+    pool.GiveBack(large);
+    CHECK(pool.LargeBytes()==0);
+}
+
+void TestLarge(){
+    MemoryPool pool;
+    //超过阈值的直接mmap，按页取整，归还时unmap
+    std::vector<Block> blocks;
+    std::size_t sizes[]={MemoryPool::MMAP_THRESHOLD+1,MemoryPool::MMAP_THRESHOLD*3,std::size_t(16)<<20};
+    std::size_t total=0;
+    for(std::size_t size:sizes){
+        for(std::size_t align:{std::size_t(0),std::size_t(64)}){
+            Block block{pool.GetMemory(size,align),size,align,static_cast<unsigned char>(size+align)};
+            CHECK(block.pointer!= nullptr&&Aligned(block.pointer,align));
+            if(block.pointer== nullptr) continue;
+#if ENABLE_MEMORY_POOL_HEADERLESS
+            CHECK(Aligned(block.pointer,16));
+#endif
+            Fill(block);
+            total+=size;
+            blocks.push_back(block);
+        }
+    }
+    CHECK(pool.LargeBytes()>=total&&pool.LargeBytes()%4096==0);
+    for(auto& block:blocks) CHECK(Intact(block));
+    for(std::size_t i=0;i<blocks.size();i++){
+        if(i%2) pool.GiveBack(blocks[i].pointer);
+        else pool.GiveBack(blocks[i].pointer,blocks[i].size,blocks[i].align);
+    }
+    CHECK(pool.LargeBytes()==0);
+    //刚好在阈值以内的还走级别
+    std::size_t small=MemoryPool::MMAP_THRESHOLD-MemoryPool::HEADER_SIZE-MemoryPool::DEBUG_PREFIX-MemoryPool::DEBUG_SUFFIX;
+    char* pointer=pool.GetMemory(small);
+    CHECK(pointer!= nullptr&&pool.LargeBytes()==0);
+    pool.GiveBack(pointer,small);
+}
+
+void TestTrim(){
+    MemoryPool pool;
+    std::vector<char*> blocks(8192);
+    for(auto& block:blocks){
+        block=pool.GetMemory(1000);
+        std::memset(block,1,1000);
+    }
+    for(auto block:blocks) pool.GiveBack(block);
+    //高峰后第一次Trim按高水位保留，第二次才释放
+    CHECK(pool.Trim()==0);
+    CHECK(pool.Trim()>0);
+    //再来一次，重用已经还掉的slab，force时全部释放
+    for(auto& block:blocks){
+        block=pool.GetMemory(1000);
+        std::memset(block,2,1000);
+    }
+    for(auto block:blocks) pool.GiveBack(block);
+    CHECK(pool.Trim(true)>0);
+    CHECK(pool.Trim(true)==0);
+}
+
+/// 读预热文件：块大小==>块数
+std::map<std::size_t,std::size_t> ReadProfile(const char* path){
+    std::map<std::size_t,std::size_t> profile;
+    std::ifstream in(path);
+    std::string line;
+    while(std::getline(in,line)){
+        if(line.empty()||line[0]=='#') continue;
+        std::istringstream fields(line);
+        std::size_t size=0,count=0;
+        if(fields>>size>>count) profile[size]=count;
+    }
+    return profile;
+}
+
+/// 块大小为block_size的级别的统计，没用过时为空
+MemoryPoolClassStats ClassStats(MemoryPool& pool,std::size_t block_size){
+    for(auto& item:pool.Stats().classes){
+        if(item.block_size==block_size) return item;
+    }
+    return MemoryPoolClassStats();
+}
+
+void TestProfile(){
+    const char* path="test_memory_pool.profile";
+    const char* copy="test_memory_pool.profile2";
+    std::size_t small=MemorySizeClass::Size(MemorySizeClass::Index(MemoryPool::HEADER_SIZE+MemoryPool::DEBUG_PREFIX+100+MemoryPool::DEBUG_SUFFIX));
+    std::size_t reserved=MemorySizeClass::Size(MemorySizeClass::Index(MemoryPool::HEADER_SIZE+MemoryPool::DEBUG_PREFIX+2000+MemoryPool::DEBUG_SUFFIX));
+    {
+        //峰值300块，另一个级别预留40块
+        MemoryPool pool;
+        std::vector<char*> blocks;
+        for(int i=0;i<300;i++) blocks.push_back(pool.GetMemory(100));
+        for(char* block:blocks) pool.GiveBack(block);
+        CHECK(pool.Reserve(2000,40));
+        CHECK(ClassStats(pool,reserved).free_blocks>=40);
+        CHECK(!pool.Reserve(MemoryPool::MMAP_THRESHOLD+1,1));
+        CHECK(pool.SaveProfile(path));
+        CHECK(std::ifstream(std::string(path)+".tmp").fail());
+        CHECK(!pool.SaveProfile("no_such_dir/test_memory_pool.profile"));
+    }
+    auto profile=ReadProfile(path);
+    CHECK(profile.size()==2&&profile[small]>=300&&profile[reserved]==40);
+    {
+        //按文件预热，每个级别一开始就有这么多空闲块；没有申请过，写回去的和读进来的一样
+        MemoryPool pool;
+        CHECK(pool.LoadProfile(path)==profile.size());
+        for(auto& item:profile){
+            MemoryPoolClassStats stats=ClassStats(pool,item.first);
+            CHECK(stats.free_blocks>=item.second&&stats.allocs==0);
+        }
+        CHECK(pool.SaveProfile(copy));
+        CHECK(ReadProfile(copy)==profile);
+        //预热的级别申请时不再要新slab
+        std::size_t slabs=ClassStats(pool,small).slabs;
+        std::vector<char*> blocks;
+        for(std::size_t i=0;i<profile[small];i++) blocks.push_back(pool.GetMemory(100));
+        CHECK(ClassStats(pool,small).slabs==slabs);
+        for(char* block:blocks) pool.GiveBack(block);
+    }
+    {
+        //格式不对、不是级别大小、超过mmap阈值的行跳过；块数特别大(包括负数)的截断到MEMORY_POOL_PROFILE_MAX_BYTES
+        std::ofstream out(path,std::ios::trunc);
+        out<<"# block_size peak_blocks\n\nabc def\n64\n104 10\n0 5\n112 0\n"
+           <<MemoryPool::MMAP_THRESHOLD*2<<" 1\n64 3 trailing\n128 -1\n";
+    }
+    {
+        MemoryPool pool;
+        CHECK(pool.LoadProfile(path)==2);
+        CHECK(ClassStats(pool,64).free_blocks>=3);
+        CHECK(ClassStats(pool,104).block_size==0&&ClassStats(pool,112).block_size==0);
+        MemoryPoolClassStats capped=ClassStats(pool,128);
+        CHECK(capped.free_blocks>=(MEMORY_POOL_PROFILE_MAX_BYTES)/128-Chunk::SLAB_SIZE/128);
+        CHECK(capped.slab_bytes<=(MEMORY_POOL_PROFILE_MAX_BYTES)+Chunk::SLAB_SIZE);
+    }
+    CHECK(MemoryPool().LoadProfile("no_such_file.profile")==0);
+    std::remove(path);
+    std::remove(copy);
+}
+
+/// 标签id为tag的统计
+MemoryPoolTagStats TagStats(MemoryPool& pool,uint16_t tag){
+    MemoryPoolStats stats=pool.Stats();
+    return tag<stats.tags.size()?stats.tags[tag]:MemoryPoolTagStats();
+}
+
+void TestStats(){
+#if ENABLE_MEMORY_POOL_STATS
+    MemoryPool pool;
+    uint16_t tag=pool.RegisterTag("test");
+    CHECK(tag!=0&&pool.RegisterTag("test")==tag&&pool.RegisterTag("other")!=tag);
+    //带标签的申请按块大小(大块按映射大小)计字节数，归还后回到原样
+    constexpr std::size_t SIZE=100;
+    constexpr std::size_t COUNT=37;
+    std::size_t block_size=MemorySizeClass::Size(MemorySizeClass::Index(MemoryPool::HEADER_SIZE+MemoryPool::DEBUG_PREFIX+SIZE+MemoryPool::DEBUG_SUFFIX));
+    MemoryPoolStats before=pool.Stats();
+    MemoryPoolTagStats tag_before=TagStats(pool,tag);
+    std::vector<char*> blocks;
+    for(std::size_t i=0;i<COUNT;i++) blocks.push_back(pool.GetMemory(SIZE,0,tag));
+    char* large=pool.GetMemory(MemoryPool::MMAP_THRESHOLD*2,0,tag);
+    MemoryPoolStats during=pool.Stats();
+    MemoryPoolTagStats tag_during=TagStats(pool,tag);
+    CHECK(tag_during.name=="test");
+    CHECK(tag_during.allocs-tag_before.allocs==COUNT+1);
+    CHECK(tag_during.frees==tag_before.frees);
+    CHECK(tag_during.live_blocks-tag_before.live_blocks==COUNT+1);
+    CHECK(tag_during.live_bytes-tag_before.live_bytes==COUNT*block_size+pool.LargeBytes());
+    CHECK(during.total_allocs-before.total_allocs==COUNT+1);
+    CHECK(during.live_blocks-before.live_blocks==COUNT+1);
+    CHECK(during.large_allocs-before.large_allocs==1&&during.large_live_bytes==pool.LargeBytes());
+    CHECK(during.tags[0].allocs==before.tags[0].allocs);
+    bool found=false;
+    for(auto& item:during.classes){
+        if(item.block_size!=block_size) continue;
+        found=true;
+        CHECK(item.live_blocks==COUNT&&item.live_bytes==COUNT*block_size&&item.peak_blocks>=COUNT);
+    }
+    CHECK(found);
+    for(char* block:blocks) pool.GiveBack(block,SIZE,0,tag);
+    pool.GiveBack(large,MemoryPool::MMAP_THRESHOLD*2,0,tag);
+    MemoryPoolStats after=pool.Stats();
+    MemoryPoolTagStats tag_after=TagStats(pool,tag);
+    CHECK(tag_after.frees-tag_before.frees==COUNT+1);
+    CHECK(tag_after.live_blocks==tag_before.live_blocks&&tag_after.live_bytes==tag_before.live_bytes);
+    CHECK(after.live_blocks==before.live_blocks&&after.live_bytes==before.live_bytes);
+    CHECK(after.total_frees-before.total_frees==COUNT+1&&after.large_live_bytes==0);
+#endif
+}
+
+#if ENABLE_DEBUG_MEMORY_POOL
+/// 把std::cout接到字符串上，析构时恢复
+struct CaptureOutput{
+    std::ostringstream text;
+    std::streambuf* saved;
+    CaptureOutput():saved(std::cout.rdbuf(text.rdbuf())){}
+    ~CaptureOutput(){ std::cout.rdbuf(saved); }
+    std::size_t Count(const std::string& what) const{
+        std::string all=text.str();
+        std::size_t count=0;
+        for(std::size_t pos=all.find(what);pos!=std::string::npos;pos=all.find(what,pos+what.size())) count++;
+        return count;
+    }
+};
+#endif
+
+void TestDebug(){
+#if ENABLE_DEBUG_MEMORY_POOL
+    MemoryPool pool;
+    std::size_t double_free=0,overflow=0,underflow=0,mismatch=0,leak=0,leaked=0,after_free=0;
+    {
+        CaptureOutput output;
+        //重复归还：第二次报告一次，不会再挂到空闲链上
+        char* a=pool.GetMemory(100);
+        pool.GiveBack(a);
+        pool.GiveBack(a);
+        char* b=pool.GetMemory(100,0,0);
+        pool.GiveBack(b,100);
+        pool.GiveBack(b,100);
+        char* c=pool.GetMemory(100);
+        char* d=pool.GetMemory(100);
+        CHECK(c!=d);
+        //写越界、写到前面(头部模式下跳过头部，写到金丝雀上)
+        c[100]=0;
+        pool.GiveBack(c);
+        d[-static_cast<std::ptrdiff_t>(MemoryPool::HEADER_SIZE)-1]=0;
+        pool.GiveBack(d,100);
+        //大小和申请时不一致
+        char* e=pool.GetMemory(64);
+        pool.GiveBack(e,32);
+        //泄漏报告
+        uint16_t tag=pool.RegisterTag("leak");
+        char* f=pool.GetMemory(48,0,tag);
+        char* g=pool.GetMemory(MemoryPool::MMAP_THRESHOLD*2);
+        leaked=pool.ReportLeaks();
+        pool.GiveBack(f,48,0,tag);
+        pool.GiveBack(g);
+        after_free=pool.ReportLeaks();
+        double_free=output.Count("重复归还");
+        overflow=output.Count("写越界");
+        underflow=output.Count("前面的金丝雀被改写");
+        mismatch=output.Count("不一致");
+        leak=output.Count("内存池泄漏 2块")+output.Count("标签 leak 1块 48字节");
+    }
+    CHECK(double_free==2);
+    CHECK(overflow==1);
+    CHECK(underflow==1);
+    CHECK(mismatch==1);
+    CHECK(leaked==2&&leak==2);
+    CHECK(after_free==0);
+#endif
+}
+
+}
+
 int main(){
-    auto *memory_pool= MemPoolManager;
-    memory_pool->DebugPrint();
-    auto mem= memory_pool->GetMemory(10);
-    memory_pool->GiveBack(mem);
-    memory_pool->DebugPrint();
-
-    mem=memory_pool->GetMemory(100);
-    memory_pool->DebugPrint();
-    memory_pool->GiveBack(mem);
-    memory_pool->DebugPrint();
-
-    mem=memory_pool->GetMemory(1000);
-    memory_pool->DebugPrint();
-    memory_pool->GiveBack(mem);
-    memory_pool->DebugPrint();
-}
\ No newline at end of file
+    TestSizeClass();
+    TestRoundTrip();
+    TestAlign();
+    TestFixed();
+    TestLarge();
+    TestTrim();
+    TestProfile();
+    TestStats();
+    TestDebug();
+    if(failures){
+        std::cout<<failures<<" checks failed"<<std::endl;
+        return 1;
+    }
+    std::cout<<"ok"<<std::endl;
+    return 0;
+}
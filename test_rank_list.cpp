@@ -0,0 +1,830 @@
+//
+// Created by zhangshiping on 26-10-17.
+//
+//排行榜的行为检查：各种建表、批量、引擎的结果都和逐个执行的RankSkipList比对，失败时打印并返回非0
+#include "skip_list.h"
+#include "leaderboard_registry.h"
+#include "rank_btree.h"
+#include "sharded_rank_list.h"
+#include "skip_list_snapshot.h"
+#include "windowed_rank_list.h"
+#include <atomic>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace GameTools;
+
+namespace{
+
+int failures=0;
+
+#define CHECK(cond) do{ if(!(cond)){ failures++; std::cout<<__FILE__<<":"<<__LINE__<<" CHECK("#cond") failed"<<std::endl; } }while(0)
+
+using Item=std::pair<int64_t,int64_t>;
+using List=RankSkipList<int64_t,int64_t>;
+using Compact=CompactRankList<int64_t,int64_t>;
+using Log=SkipListChangeLog<int64_t,int64_t>;
+
+/// 按排名导出(key,val)
+template<class L>
+std::vector<Item> Dump(const L& list){
+    std::vector<Item> items;
+    for(auto& node:list) items.emplace_back(node.key,node.value);
+    return items;
+}
+
+/// 逐个InsertOrUpdate得到的结果，作为比对的基准
+std::vector<Item> Incremental(const std::vector<Item>& items,uint64_t max_len){
+    List list(max_len,1);
+    for(auto& item:items) list.InsertOrUpdate(item.first,item.second);
+    return Dump(list);
+}
+
+/// 排名、getKey和顺序遍历一致
+void CheckIndex(List& list,const std::vector<Item>& expect){
+    CHECK(list.length()==expect.size());
+    for(std::size_t i=0;i<expect.size();i++){
+        CHECK(list.Rank(expect[i].second)==static_cast<int64_t>(i+1));
+        CHECK(list.getKey(expect[i].second)!= nullptr&&*list.getKey(expect[i].second)==expect[i].first);
+        auto* node=list.getNodeByRank(i+1);
+        CHECK(node!= nullptr&&node->value==expect[i].second);
+    }
+}
+
+/// 大部分有序、夹杂乱序和重复val的序列
+std::vector<Item> NearlySorted(std::mt19937_64& gen,std::size_t n,int64_t vals){
+    std::vector<Item> items;
+    int64_t key=static_cast<int64_t>(n)*4;
+    for(std::size_t i=0;i<n;i++){
+        key-=static_cast<int64_t>(gen()%3);
+        int64_t k=gen()%8==0?static_cast<int64_t>(gen()%(n*4)):key;
+        items.emplace_back(k,static_cast<int64_t>(gen()%vals));
+    }
+    return items;
+}
+
+void TestBuild(){
+    //先出现的乱序元素进pending，之后同一个val按顺序出现时不能被pending覆盖
+    std::vector<Item> items{{10,1},{5,2},{7,3},{3,3}};
+    List list;
+    list.BuildFromSorted(items.begin(),items.end());
+    CHECK(list.getKey(3)!= nullptr&&*list.getKey(3)==3);
+    CheckIndex(list,Incremental(items,0));
+
+    std::mt19937_64 gen(7);
+    for(int round=0;round<300;round++){
+        std::size_t n=gen()%200;
+        int64_t vals=1+static_cast<int64_t>(gen()%(n+1));
+        uint64_t max_len=round%3==0?0:gen()%(n+2);
+        auto sorted=NearlySorted(gen,n,vals);
+        std::vector<Item> shuffled=sorted;
+        std::shuffle(shuffled.begin(),shuffled.end(),gen);
+        for(auto* input:{&sorted,&shuffled}){
+            auto expect=Incremental(*input,max_len);
+            List from_sorted(max_len,round+1);
+            from_sorted.BuildFromSorted(input->begin(),input->end());
+            CheckIndex(from_sorted,expect);
+            List built(max_len,round+1);
+            built.Build(input->begin(),input->end());
+            CheckIndex(built,expect);
+        }
+    }
+}
+
+/// 200个key一组哈希相同，探测链会超过上限，触发插入中途扩容
+struct ClusterHash{
+    std::size_t operator()(int64_t key) const{ return static_cast<std::size_t>(key/200); }
+};
+
+/// emplace返回的迭代器指向刚插入的元素，包括被抢占挪动和中途扩容的情况
+template<class Hash>
+void RunFlatHashMap(int64_t n){
+    FlatHashMap<int64_t,int64_t,Hash> map;
+    for(int64_t key=0;key<n;key++){
+        auto result=map.emplace(key,key*3);
+        CHECK(result.second&&result.first->first==key&&result.first->second==key*3);
+        auto again=map.emplace(key,0);
+        CHECK(!again.second&&again.first->second==key*3);
+    }
+    CHECK(map.size()==static_cast<std::size_t>(n));
+    for(int64_t key=0;key<n;key++) CHECK(map.find(key)!=map.end()&&map.find(key)->second==key*3);
+}
+
+void TestFlatHashMap(){
+    RunFlatHashMap<std::hash<int64_t>>(50000);
+    RunFlatHashMap<ClusterHash>(20000);
+}
+
+/// 反向遍历(pre指针和tail)和正向一致
+void CheckReverse(const List& list){
+    std::vector<Item> backward;
+    for(auto iter=list.rbegin();iter!=list.rend();++iter) backward.emplace_back(iter->key,iter->value);
+    std::reverse(backward.begin(),backward.end());
+    CHECK(backward==Dump(list));
+}
+
+void TestUpdate(){
+    std::mt19937_64 gen(3);
+    for(int round=0;round<20;round++){
+        std::size_t n=1+gen()%3000;
+        List list(0,round+1);
+        std::vector<int64_t> keys(n);
+        for(std::size_t v=0;v<n;v++){
+            keys[v]=static_cast<int64_t>(gen()%(n*2));
+            list.InsertOrUpdate(keys[v],static_cast<int64_t>(v));
+        }
+        //多数是小幅涨跌(在原位置附近挪)，少数跳得很远(下降)
+        for(int step=0;step<20000;step++){
+            std::size_t v=gen()%n;
+            int64_t delta=gen()%8==0?static_cast<int64_t>(gen()%(n*2))-static_cast<int64_t>(n):static_cast<int64_t>(gen()%9)-4;
+            keys[v]+=delta;
+            auto* node=list.InsertOrUpdate(keys[v],static_cast<int64_t>(v));
+            CHECK(node!= nullptr&&node->key==keys[v]);
+        }
+        std::vector<Item> expect;
+        for(std::size_t v=0;v<n;v++) expect.emplace_back(keys[v],static_cast<int64_t>(v));
+        std::sort(expect.begin(),expect.end(),[](const Item& a,const Item& b){
+            return a.first>b.first||(a.first==b.first&&a.second>b.second);
+        });
+        CheckIndex(list,expect);
+        CheckReverse(list);
+    }
+}
+
+void TestApplyBatch(){
+    std::mt19937_64 gen(13);
+    for(int round=0;round<60;round++){
+        std::size_t n=gen()%2000;
+        int64_t vals=1+static_cast<int64_t>(n+gen()%200);
+        int64_t keys=static_cast<int64_t>(n*2+10);
+        uint64_t max_len=round%3==0?0:1+gen()%(n+1);
+        List batched(max_len,round+1),sequential(max_len,round+1);
+        for(std::size_t i=0;i<n;i++){
+            int64_t key=static_cast<int64_t>(gen())%keys,val=static_cast<int64_t>(gen())%vals;
+            batched.InsertOrUpdate(key,val);
+            sequential.InsertOrUpdate(key,val);
+        }
+        for(int batch=0;batch<40;batch++){
+            //偶数批只插入、只涨分(设置max_len时截断一次)，奇数批带删除和降分(设置max_len时可能逐个执行)
+            bool monotone=batch%2==0;
+            std::vector<SkipListBatchOp<int64_t,int64_t>> ops(1+gen()%64);
+            std::map<int64_t,int64_t> latest;
+            for(auto& op:ops){
+                op.value=static_cast<int64_t>(gen())%vals;
+                if(monotone){
+                    auto iter=latest.find(op.value);
+                    const int64_t* key=sequential.getKey(op.value);
+                    int64_t base=iter!=latest.end()?iter->second:(key?*key:0);
+                    op.key=base+static_cast<int64_t>(gen()%50);
+                    latest[op.value]=op.key;
+                }
+                else{
+                    op.key=static_cast<int64_t>(gen())%keys;
+                    op.remove=gen()%4==0;
+                }
+            }
+            batched.ApplyBatch(ops.data(),ops.size());
+            for(auto& op:ops){
+                if(op.remove) sequential.DeleteNode(op.value);
+                else sequential.InsertOrUpdate(op.key,op.value);
+            }
+            auto expect=Dump(sequential);
+            CHECK(Dump(batched)==expect);
+            if(batch%8==7){
+                CheckIndex(batched,expect);
+                CheckReverse(batched);
+            }
+        }
+    }
+}
+
+/// RankBTree的每个查询都和RankSkipList一致
+template<class Tree>
+void CheckTree(const Tree& tree,List& list,std::mt19937_64& gen){
+    auto expect=Dump(list);
+    CHECK(tree.length()==expect.size());
+    std::vector<Item> forward;
+    tree.ForEachByRank(1,expect.size(),[&](const RankBTreeEntry<int64_t,int64_t>& e){ forward.emplace_back(e.key,e.value); });
+    CHECK(forward==expect);
+    for(std::size_t i=0;i<expect.size();i++){
+        CHECK(tree.Rank(expect[i].second)==static_cast<int64_t>(i+1));
+        CHECK(tree.getKey(expect[i].second)!= nullptr&&*tree.getKey(expect[i].second)==expect[i].first);
+        auto* entry=tree.getNodeByRank(i+1);
+        CHECK(entry!= nullptr&&entry->key==expect[i].first&&entry->value==expect[i].second);
+    }
+    CHECK(tree.getNodeByRank(expect.size()+1)== nullptr);
+    for(int probe=0;probe<8;probe++){
+        int64_t key=static_cast<int64_t>(gen()%4000),val=static_cast<int64_t>(gen()%3000);
+        CHECK(tree.has(val)==list.has(val));
+        CHECK(tree.Rank(val)==list.Rank(val));
+        CHECK(tree.RankByKey(key)==list.RankByKey(key));
+        uint64_t start=1+gen()%(expect.size()+2),end=start+gen()%40;
+        std::vector<Item> range_a,range_b;
+        uint64_t count_a=tree.ForEachByRank(start,end,[&](const RankBTreeEntry<int64_t,int64_t>& e){ range_a.emplace_back(e.key,e.value); });
+        uint64_t count_b=list.ForEachByRank(start,end,[&](const SkipListNode<int64_t,int64_t>& e){ range_b.emplace_back(e.key,e.value); });
+        CHECK(count_a==count_b&&range_a==range_b);
+    }
+}
+
+template<class Tree>
+void RunTree(uint64_t seed){
+    std::mt19937_64 gen(seed);
+    for(int round=0;round<12;round++){
+        uint64_t max_len=round%3==0?0:500+gen()%2000;
+        Tree tree(max_len);
+        List list(max_len,round+1);
+        //先涨到几千条再删到很少，来回几次，叶子和内部节点都会分裂、合并，树高会变
+        for(int step=0;step<12000;step++){
+            int64_t key=static_cast<int64_t>(gen()%4000),val=static_cast<int64_t>(gen()%3000);
+            bool grow=(step/3000)%2==0;
+            switch(gen()%8){
+                case 0:{
+                    uint64_t length=list.length();
+                    if(length==0) break;
+                    uint64_t start=1+gen()%length,end=start+gen()%(grow?3:40);
+                    if(end>length) end=length;
+                    CHECK(tree.DeleteNodeByRange(start,end)==list.DeleteNodeByRange(start,end));
+                    break;
+                }
+                case 1:{
+                    uint64_t length=list.length();
+                    if(length==0) break;
+                    uint64_t rank=1+gen()%length;
+                    CHECK(tree.DeleteNodeByRank(rank)==list.DeleteNodeByRank(rank));
+                    break;
+                }
+                case 2:
+                case 3:
+                case 4:
+                    if(!grow){
+                        CHECK(tree.DeleteNode(val)==list.DeleteNode(val));
+                        break;
+                    }
+                    //fallthrough
+                default:
+                    CHECK(tree.InsertOrUpdate(key,val)==(list.InsertOrUpdate(key,val)!= nullptr));
+            }
+            if(step%500==0) CheckTree(tree,list,gen);
+        }
+        CheckTree(tree,list,gen);
+        tree.Clear();
+        CHECK(tree.length()==0&&tree.getNodeByRank(1)== nullptr&&!tree.has(0));
+    }
+}
+
+void TestBTree(){
+    RunTree<RankBTree<int64_t,int64_t>>(17);
+    //小叶子、小扇出，少量条目就有好几层
+    RunTree<RankBTree<int64_t,int64_t,std::hash<int64_t>,RankBTreePolicy<2,4>>>(19);
+}
+
+/// ShardedRankList的排名、RankByKey和任意起点的翻页都和单个RankSkipList一致
+void CheckSharded(ShardedRankList<int64_t,int64_t>& sharded,List& list,int64_t keys,int64_t vals,std::mt19937_64& gen){
+    auto expect=Dump(list);
+    uint64_t total=expect.size();
+    CHECK(sharded.length()==total);
+    for(int64_t val=0;val<vals;val++) CHECK(sharded.Rank(val)==list.Rank(val));
+    for(int64_t key=-1;key<=keys;key++) CHECK(sharded.RankByKey(key)==list.RankByKey(key));
+    auto walk=[&](uint64_t start,uint64_t end){
+        std::vector<Item> items;
+        uint64_t visited=sharded.ForEachByRank(start,end,[&](const SkipListNode<int64_t,int64_t>& node){ items.emplace_back(node.key,node.value); });
+        CHECK(visited==items.size());
+        return items;
+    };
+    CHECK(walk(1,total)==expect);
+    CHECK(walk(0,total+10)==expect);
+    std::vector<Item> top;
+    sharded.ForEachTop(5,[&](const SkipListNode<int64_t,int64_t>& node){ top.emplace_back(node.key,node.value); });
+    CHECK(top==std::vector<Item>(expect.begin(),expect.begin()+static_cast<std::ptrdiff_t>(std::min<uint64_t>(5,total))));
+    //每个起点单独定位一次，再随机翻几页
+    for(uint64_t start=1;start<=total;start++){
+        auto one=walk(start,start);
+        CHECK(one.size()==1&&one[0]==expect[start-1]);
+    }
+    for(int page=0;page<20&&total>0;page++){
+        uint64_t start=1+gen()%total,end=start+gen()%30;
+        auto items=walk(start,end);
+        uint64_t last=std::min(end,total);
+        CHECK(items==std::vector<Item>(expect.begin()+static_cast<std::ptrdiff_t>(start-1),expect.begin()+static_cast<std::ptrdiff_t>(last)));
+    }
+    CHECK(walk(total+1,total+5).empty());
+    CHECK(walk(3,2).empty());
+}
+
+void TestSharded(){
+    std::mt19937_64 gen(23);
+    for(uint32_t shards:{1u,2u,3u,7u,16u}){
+        for(int round=0;round<4;round++){
+            //key的范围小，同key的节点多，分布在不同分片；分片多、条目少时有空分片
+            int64_t keys=round%2==0?8:200;
+            int64_t vals=round<2?12:300;
+            ShardedRankList<int64_t,int64_t> sharded(shards,round+1);
+            List list(0,round+1);
+            CheckSharded(sharded,list,keys,vals,gen);
+            for(int step=0;step<600;step++){
+                int64_t key=static_cast<int64_t>(gen()%keys),val=static_cast<int64_t>(gen()%vals);
+                if(gen()%4==0) CHECK(sharded.DeleteNode(val)==list.DeleteNode(val));
+                else CHECK(sharded.InsertOrUpdate(key,val)==(list.InsertOrUpdate(key,val)!= nullptr));
+                if(step%100==99) CheckSharded(sharded,list,keys,vals,gen);
+            }
+            //删到只剩几个
+            for(int64_t val=0;val<vals-3;val++) CHECK(sharded.DeleteNode(val)==list.DeleteNode(val));
+            CheckSharded(sharded,list,keys,vals,gen);
+        }
+    }
+}
+
+/// (key,val)在跳表里是否排在other之前
+bool Before(const Item& item,const Item& other){
+    return item.first>other.first||(item.first==other.first&&item.second>other.second);
+}
+
+/// 只按事件维护的榜：每条事件的排名先和当前内容核对，再改内容；不依赖任何排行榜的实现
+struct EventModel{
+    std::vector<Item> items;
+
+    /// (key,val)放在下标pos时前后顺序正确
+    bool Fits(std::size_t pos,const Item& item) const{
+        return (pos==0||Before(items[pos-1],item))&&(pos==items.size()||Before(item,items[pos]));
+    }
+    /// 下标pos的是val
+    bool At(uint64_t rank,int64_t val) const{
+        return rank>=1&&rank<=items.size()&&items[rank-1].second==val;
+    }
+    bool Contains(int64_t val) const{
+        for(auto& item:items) if(item.second==val) return true;
+        return false;
+    }
+    void Apply(const SkipListChangeEvent<int64_t,int64_t>& event){
+        Item item(event.key,event.value);
+        switch(event.type){
+            case SkipListChange::Entered:{
+                CHECK(event.old_rank==0&&!Contains(event.value));
+                CHECK(event.new_rank>=1&&event.new_rank<=items.size()+1&&Fits(event.new_rank-1,item));
+                if(event.new_rank>=1&&event.new_rank<=items.size()+1) items.insert(items.begin()+static_cast<std::ptrdiff_t>(event.new_rank-1),item);
+                break;
+            }
+            case SkipListChange::Left:{
+                CHECK(event.new_rank==0&&At(event.old_rank,event.value)&&items[event.old_rank-1].first==event.key);
+                if(At(event.old_rank,event.value)) items.erase(items.begin()+static_cast<std::ptrdiff_t>(event.old_rank-1));
+                break;
+            }
+            case SkipListChange::Moved:{
+                CHECK(At(event.old_rank,event.value));
+                if(!At(event.old_rank,event.value)) break;
+                items.erase(items.begin()+static_cast<std::ptrdiff_t>(event.old_rank-1));
+                CHECK(event.new_rank>=1&&event.new_rank<=items.size()+1&&Fits(event.new_rank-1,item));
+                if(event.new_rank>=1&&event.new_rank<=items.size()+1) items.insert(items.begin()+static_cast<std::ptrdiff_t>(event.new_rank-1),item);
+                break;
+            }
+            case SkipListChange::Cleared:
+                items.clear();
+                break;
+        }
+    }
+    /// 排名窗口[lo,hi]的内容
+    std::vector<Item> Window(uint64_t lo,uint64_t hi) const{
+        std::vector<Item> window;
+        for(uint64_t rank=lo;rank<=hi&&rank<=items.size();rank++) window.push_back(items[rank-1]);
+        return window;
+    }
+};
+
+/// 每个操作的事件按顺序套到操作前的内容上，结果等于操作后的内容；重放到副本上和原榜一致；
+/// 订阅窗口只漏掉不改变窗口内容的事件
+void TestChangeLog(){
+    std::mt19937_64 gen(29);
+    const uint64_t windows[][2]={{1,1},{1,10},{5,20},{30,60},{100,200}};
+    for(int round=0;round<16;round++){
+        uint64_t max_len=round%2==0?0:20+gen()%80;
+        int64_t keys=round%4<2?30:500,vals=200;
+        List list(max_len,round+1);
+        List replica(0,round+7);
+        Log log(4096);
+        list.SetChangeLog(&log);
+        std::vector<uint32_t> subs;
+        for(auto& window:windows) subs.push_back(log.Subscribe(window[0],window[1]));
+        EventModel model;
+        uint64_t cursor=log.NextSeq();
+        for(int step=0;step<1500;step++){
+            int64_t key=static_cast<int64_t>(gen())%keys,val=static_cast<int64_t>(gen())%vals;
+            uint64_t length=list.length();
+            switch(gen()%16){
+                case 0:
+                case 1:
+                    list.DeleteNode(val);
+                    break;
+                case 2:
+                    if(length) list.DeleteNodeByRank(1+gen()%length);
+                    break;
+                case 3:
+                    if(length){
+                        uint64_t start=1+gen()%length;
+                        list.DeleteNodeByRange(start,std::min(length,start+gen()%10));
+                    }
+                    break;
+                case 4:
+                    list.DeleteNodeByKeyRange(key,key+static_cast<int64_t>(gen()%5));
+                    break;
+                case 5:{
+                    std::vector<SkipListBatchOp<int64_t,int64_t>> ops(1+gen()%20);
+                    for(auto& op:ops) op={static_cast<int64_t>(gen())%vals,static_cast<int64_t>(gen())%keys,gen()%4==0};
+                    list.ApplyBatch(ops.data(),ops.size());
+                    break;
+                }
+                case 6:
+                    if(gen()%20==0) list.Clear();
+                    break;
+                case 7:
+                    if(gen()%20==0){
+                        std::vector<Item> items;
+                        for(int i=0;i<static_cast<int>(gen()%150);i++) items.emplace_back(static_cast<int64_t>(gen())%keys,static_cast<int64_t>(gen())%vals);
+                        if(gen()%2) list.Build(items.begin(),items.end());
+                        else list.BuildFromSorted(items.begin(),items.end());
+                    }
+                    break;
+                default:
+                    list.InsertOrUpdate(key,val);
+            }
+            SkipListChangeEvent<int64_t,int64_t> events[1024];
+            bool overrun=false;
+            uint64_t count=log.Read(cursor,events,1024,overrun);
+            CHECK(!overrun&&cursor==log.NextSeq());
+            //逐条事件改模型，同时看每个窗口在这条事件前后是否变化
+            for(uint64_t i=0;i<count;i++){
+                std::vector<std::vector<Item>> before_windows;
+                for(auto& window:windows) before_windows.push_back(model.Window(window[0],window[1]));
+                model.Apply(events[i]);
+                for(std::size_t w=0;w<subs.size();w++){
+                    //不影响窗口的事件不能改变窗口内容
+                    bool differs=model.Window(windows[w][0],windows[w][1])!=before_windows[w];
+                    CHECK(!differs||Log::Affects(events[i],windows[w][0],windows[w][1]));
+                }
+            }
+            CHECK(model.items==Dump(list));
+            Log::Replay(replica,events,count);
+            CHECK(Dump(replica)==Dump(list));
+            //Poll只返回影响窗口的事件，按顺序，不漏掉改变了窗口内容的
+            for(std::size_t w=0;w<subs.size();w++){
+                SkipListChangeEvent<int64_t,int64_t> polled[1024];
+                uint64_t got=log.Poll(subs[w],polled,1024,overrun);
+                CHECK(!overrun);
+                uint64_t next=0;
+                for(uint64_t i=0;i<count;i++){
+                    bool affects=Log::Affects(events[i],windows[w][0],windows[w][1]);
+                    if(!affects) continue;
+                    CHECK(next<got&&polled[next].seq==events[i].seq);
+                    next++;
+                }
+                CHECK(next==got);
+            }
+        }
+    }
+}
+
+/// 两个变化日志从cursor起新增的事件相同
+template<class K,class V>
+void CheckEvents(SkipListChangeLog<K,V>& a,SkipListChangeLog<K,V>& b,uint64_t& cursor_a,uint64_t& cursor_b){
+    SkipListChangeEvent<K,V> ea[256],eb[256];
+    bool overrun=false;
+    uint64_t na=a.Read(cursor_a,ea,256,overrun);
+    uint64_t nb=b.Read(cursor_b,eb,256,overrun);
+    CHECK(na==nb);
+    for(uint64_t i=0;i<na&&i<nb;i++){
+        CHECK(ea[i].type==eb[i].type&&ea[i].key==eb[i].key&&ea[i].value==eb[i].value
+            &&ea[i].old_rank==eb[i].old_rank&&ea[i].new_rank==eb[i].new_rank);
+    }
+}
+
+/// CompactRankList的每个查询都和RankSkipList一致
+void CheckCompact(Compact& compact,List& list,std::mt19937_64& gen){
+    auto expect=Dump(list);
+    CHECK(compact.length()==expect.size());
+    std::vector<Item> forward,backward;
+    for(auto& entry:compact) forward.emplace_back(entry.key,entry.value);
+    for(auto iter=compact.rbegin();iter!=compact.rend();++iter) backward.emplace_back(iter->key,iter->value);
+    std::reverse(backward.begin(),backward.end());
+    CHECK(forward==expect);
+    CHECK(backward==expect);
+    for(std::size_t i=0;i<expect.size();i++){
+        CHECK(compact.Rank(expect[i].second)==static_cast<int64_t>(i+1));
+        CHECK(compact.getKey(expect[i].second)!= nullptr&&*compact.getKey(expect[i].second)==expect[i].first);
+        auto* entry=compact.getNodeByRank(i+1);
+        CHECK(entry!= nullptr&&entry->value==expect[i].second);
+    }
+    CHECK(compact.getNodeByRank(expect.size()+1)== nullptr);
+    for(int probe=0;probe<8;probe++){
+        int64_t lo=static_cast<int64_t>(gen()%400),hi=lo+static_cast<int64_t>(gen()%100);
+        int64_t val=static_cast<int64_t>(gen()%300);
+        CHECK(compact.has(val)==list.has(val));
+        CHECK(compact.RankByKey(lo)==list.RankByKey(lo));
+        CHECK(compact.RankByKey(lo,val)==list.RankByKey(lo,val));
+        CHECK(compact.CountInKeyRange(lo,hi)==list.CountInKeyRange(lo,hi));
+        double percentile=static_cast<double>(gen()%101);
+        const int64_t* a=compact.KeyAtPercentile(percentile);
+        const int64_t* b=list.KeyAtPercentile(percentile);
+        CHECK((a== nullptr)==(b== nullptr)&&(a== nullptr||*a==*b));
+        std::vector<Item> by_key_a,by_key_b;
+        compact.ForEachByKey(lo,hi,[&](const CompactRankEntry<int64_t,int64_t>& e){ by_key_a.emplace_back(e.key,e.value); });
+        list.ForEachByKey(lo,hi,[&](const SkipListNode<int64_t,int64_t>& e){ by_key_b.emplace_back(e.key,e.value); });
+        CHECK(by_key_a==by_key_b);
+        const CompactRankEntry<int64_t,int64_t>* around_a[7];
+        const SkipListNode<int64_t,int64_t>* around_b[7];
+        uint64_t count_a=0,count_b=0,first_a=0,first_b=0;
+        CHECK(compact.getAroundRank(val,3,around_a,count_a,first_a)==list.getAroundRank(val,3,around_b,count_b,first_b));
+        CHECK(count_a==count_b&&first_a==first_b);
+        for(uint64_t i=0;i<count_a&&i<count_b;i++) CHECK(around_a[i]->value==around_b[i]->value);
+    }
+}
+
+void TestCompact(){
+    std::mt19937_64 gen(11);
+    for(int round=0;round<40;round++){
+        uint64_t max_len=round%2==0?0:Compact::PROMOTE_AT+1+gen()%60;
+        Compact compact(max_len,round+1);
+        List list(max_len,round+1);
+        SkipListChangeLog<int64_t,int64_t> log_a(1024),log_b(1024);
+        compact.SetChangeLog(&log_a);
+        list.SetChangeLog(&log_b);
+        uint64_t cursor_a=log_a.NextSeq(),cursor_b=log_b.NextSeq();
+        bool was_small=true,promoted=false,demoted=false;
+        //先涨到PROMOTE_AT以上再删回DEMOTE_AT以下，来回几次
+        int64_t vals=80+static_cast<int64_t>(gen()%200);
+        for(int step=0;step<1500;step++){
+            int64_t key=static_cast<int64_t>(gen()%400),val=static_cast<int64_t>(gen()%vals);
+            bool grow=(step/300)%2==0;
+            switch(gen()%10){
+                case 0:{
+                    uint64_t length=list.length();
+                    if(length==0) break;
+                    uint64_t start=1+gen()%length,end=start+gen()%(grow?2:20);
+                    if(end>length) end=length;
+                    CHECK(compact.DeleteNodeByRange(start,end)==list.DeleteNodeByRange(start,end));
+                    break;
+                }
+                case 1:{
+                    int64_t hi=key+static_cast<int64_t>(gen()%(grow?4:60));
+                    CHECK(compact.DeleteNodeByKeyRange(key,hi)==list.DeleteNodeByKeyRange(key,hi));
+                    break;
+                }
+                case 2:{
+                    std::vector<SkipListBatchOp<int64_t,int64_t>> ops(1+gen()%16);
+                    for(auto& op:ops) op={static_cast<int64_t>(gen()%vals),static_cast<int64_t>(gen()%400),!grow&&gen()%2==0};
+                    compact.ApplyBatch(ops.data(),ops.size());
+                    list.ApplyBatch(ops.data(),ops.size());
+                    break;
+                }
+                case 3:
+                case 4:
+                    if(!grow){
+                        CHECK(compact.DeleteNode(val)==list.DeleteNode(val));
+                        break;
+                    }
+                    //fallthrough
+                default:{
+                    auto* a=compact.InsertOrUpdate(key,val);
+                    auto* b=list.InsertOrUpdate(key,val);
+                    CHECK((a== nullptr)==(b== nullptr));
+                    CHECK(a== nullptr||(a->key==key&&a->value==val));
+                }
+            }
+            if(compact.IsSmall()!=was_small){
+                (was_small?promoted:demoted)=true;
+                was_small=compact.IsSmall();
+                CHECK(was_small?compact.length()<Compact::DEMOTE_AT:compact.length()>=Compact::DEMOTE_AT);
+            }
+            CheckEvents(log_a,log_b,cursor_a,cursor_b);
+            if(step%10==0) CheckCompact(compact,list,gen);
+        }
+        CHECK(promoted&&demoted);
+        std::vector<Item> items;
+        for(int i=0;i<static_cast<int>(gen()%150);i++) items.emplace_back(static_cast<int64_t>(gen()%400),static_cast<int64_t>(gen()%vals));
+        compact.Build(items.begin(),items.end());
+        list.Build(items.begin(),items.end());
+        CHECK(compact.IsSmall()==(compact.length()<=Compact::PROMOTE_AT));
+        CheckEvents(log_a,log_b,cursor_a,cursor_b);
+        CheckCompact(compact,list,gen);
+        compact.Clear();
+        list.Clear();
+        CheckEvents(log_a,log_b,cursor_a,cursor_b);
+        CHECK(compact.length()==0&&compact.begin()==compact.end());
+    }
+}
+
+/// 改写快照文件offset处的字节
+void PatchFile(const char* path,long offset,const void* data,std::size_t size){
+    FILE* file=std::fopen(path,"r+b");
+    CHECK(file!= nullptr);
+    if(file== nullptr) return;
+    std::fseek(file,offset,SEEK_SET);
+    std::fwrite(data,size,1,file);
+    std::fclose(file);
+}
+
+void TestSnapshot(){
+    const char* path="test_rank_list.snapshot";
+    std::mt19937_64 gen(5);
+    List list(0,3);
+    for(int i=0;i<5000;i++) list.InsertOrUpdate(static_cast<int64_t>(gen()%3000),static_cast<int64_t>(gen()%4000));
+    auto expect=Dump(list);
+    CHECK(SaveSnapshot(list,path));
+    List loaded(0,4);
+    loaded.InsertOrUpdate(1,1);
+    CHECK(LoadSnapshot(loaded,path));
+    CheckIndex(loaded,expect);
+    {
+        FrozenRankList<int64_t,int64_t> frozen;
+        CHECK(frozen.Open(path));
+        CHECK(frozen.length()==expect.size());
+        for(std::size_t i=0;i<expect.size();i++){
+            CHECK(frozen.Rank(expect[i].second)==static_cast<int64_t>(i+1));
+            CHECK(frozen.getNodeByRank(i+1)->key==expect[i].first);
+        }
+        for(int64_t val=0;val<4000;val+=7) CHECK(frozen.has(val)==list.has(val));
+        for(int64_t key=0;key<3000;key+=13){
+            CHECK(frozen.RankByKey(key)==list.RankByKey(key));
+            CHECK(frozen.CountInKeyRange(key,key+50)==list.CountInKeyRange(key,key+50));
+        }
+    }
+    //count*sizeof(Entry)溢出回绕成很小的数，不能通过范围检查
+    SkipListSnapshotHeader header;
+    FILE* file=std::fopen(path,"rb");
+    CHECK(file!= nullptr&&std::fread(&header,sizeof(header),1,file)==1);
+    if(file) std::fclose(file);
+    uint64_t count=UINT64_MAX/sizeof(uint64_t)+2;//乘8和乘16都回绕
+    PatchFile(path,static_cast<long>(offsetof(SkipListSnapshotHeader,count)),&count,sizeof(count));
+    {
+        FrozenRankList<int64_t,int64_t> frozen;
+        CHECK(!frozen.Open(path,false));
+    }
+    //下标越界：不校验checksum时能打开，查询不越界
+    PatchFile(path,static_cast<long>(offsetof(SkipListSnapshotHeader,count)),&header.count,sizeof(header.count));
+    uint64_t bad_index=header.count+(1u<<24);
+    for(uint64_t i=0;i<header.count;i+=97){
+        PatchFile(path,static_cast<long>(header.index_offset+i*sizeof(uint64_t)),&bad_index,sizeof(bad_index));
+    }
+    {
+        FrozenRankList<int64_t,int64_t> frozen;
+        CHECK(!frozen.Open(path,true));
+        CHECK(frozen.Open(path,false));
+        for(int64_t val=0;val<4000;val++){
+            int64_t rank=frozen.Rank(val);
+            CHECK(rank==-1||frozen.getNodeByRank(static_cast<uint64_t>(rank))->value==val);
+        }
+    }
+    std::remove(path);
+}
+
+/// 按Tag分别记录的在用字节数，rebind出来的各种T共用一份
+template<int Tag>
+std::atomic<int64_t>& CountedBytes(){
+    static std::atomic<int64_t> bytes{0};
+    return bytes;
+}
+
+/// 记录在用字节数的分配器，看过期窗口的内存是否真的还回去了
+template<class T,int Tag>
+struct CountingAllocator{
+    using value_type=T;
+    template<class U>
+    struct rebind{
+        using other=CountingAllocator<U,Tag>;
+    };
+    CountingAllocator()=default;
+    template<class U>
+    CountingAllocator(const CountingAllocator<U,Tag>&){}
+    T* allocate(std::size_t n){
+        CountedBytes<Tag>()+=static_cast<int64_t>(n*sizeof(T));
+        return std::allocator<T>().allocate(n);
+    }
+    void deallocate(T* p,std::size_t n){
+        CountedBytes<Tag>()-=static_cast<int64_t>(n*sizeof(T));
+        std::allocator<T>().deallocate(p,n);
+    }
+};
+template<class T,class U,int Tag>
+bool operator==(const CountingAllocator<T,Tag>&,const CountingAllocator<U,Tag>&){ return true; }
+template<class T,class U,int Tag>
+bool operator!=(const CountingAllocator<T,Tag>&,const CountingAllocator<U,Tag>&){ return false; }
+
+/// 同步释放、后台释放两份窗口榜各自的在用字节数
+int64_t SyncBytes(){ return CountedBytes<0>(); }
+int64_t BackgroundBytes(){ return CountedBytes<1>(); }
+
+template<int Tag>
+using CountedWindows=WindowedRankList<int64_t,int64_t,std::hash<int64_t>,SkipListPolicy<32,1,CountingAllocator<char,Tag>>>;
+
+/// 窗口榜：保留数、归档顺序、跨窗口查询和每个窗口单独的RankSkipList比对；
+/// 同样的操作在同步释放(Tag 0)和后台释放(Tag 1)两份上做，DrainReclaimer之后两边在用字节数必须相同
+void TestWindowed(){
+    struct Config{ uint32_t keep; uint64_t max_len; };
+    for(Config config:{Config{0,0},Config{2,40},Config{3,0},Config{5,25}}){
+        std::mt19937_64 gen(config.keep*131+config.max_len);
+        {
+            CountedWindows<0> sync(config.keep,config.max_len,9,false);
+            CountedWindows<1> windows(config.keep,config.max_len,9,true);
+            //新建一个空窗口的字节数，和每个窗口归档时占的字节数
+            int64_t fresh=0;
+            {
+                CountedWindows<2>::List probe(config.max_len,9);
+                fresh=CountedBytes<2>();
+            }
+            CHECK(fresh>0);
+            std::vector<int64_t> footprint;
+            //refs[w]是第w个窗口的基准
+            std::vector<std::unique_ptr<List>> refs;
+            refs.emplace_back(new List(config.max_len,1));
+            for(uint64_t round=0;round<12;round++){
+                std::size_t ops=round%4==3?0:200;
+                for(std::size_t i=0;i<ops;i++){
+                    int64_t val=static_cast<int64_t>(gen()%60);
+                    if(gen()%5==0){
+                        bool deleted=refs.back()->DeleteNode(val);
+                        CHECK(sync.DeleteNode(val)==deleted);
+                        CHECK(windows.DeleteNode(val)==deleted);
+                    }else{
+                        int64_t key=static_cast<int64_t>(gen()%100);
+                        refs.back()->InsertOrUpdate(key,val);
+                        sync.InsertOrUpdate(key,val);
+                        windows.InsertOrUpdate(key,val);
+                    }
+                }
+                uint64_t id=round;
+                uint32_t archived=static_cast<uint32_t>(std::min<uint64_t>(id,config.keep));
+                CHECK(windows.WindowId()==id);
+                CHECK(windows.ArchivedCount()==archived);
+                CHECK(Dump(windows.Current())==Dump(*refs[id]));
+                CHECK(windows.Archived(0)== nullptr);
+                CHECK(windows.Archived(archived+1)== nullptr);
+                for(uint32_t ago=1;ago<=archived;ago++){
+                    CHECK(windows.Archived(ago)!= nullptr&&Dump(*windows.Archived(ago))==Dump(*refs[id-ago]));
+                }
+                for(uint32_t count=0;count<=config.keep+2;count++){
+                    for(int64_t val=0;val<60;val++){
+                        int64_t best=-1;
+                        int64_t sum=0;
+                        uint32_t on_board=0;
+                        for(uint32_t ago=0;ago<count&&ago<=archived;ago++){
+                            List& ref=*refs[id-ago];
+                            int64_t rank=ref.Rank(val);
+                            if(rank>0&&(best<0||rank<best)) best=rank;
+                            if(int64_t* key=ref.getKey(val)){
+                                sum+=*key;
+                                on_board++;
+                            }
+                        }
+                        uint32_t got_on_board=0;
+                        CHECK(windows.BestRank(val,count)==best);
+                        CHECK(windows.SumKey(val,count,got_on_board)==sum);
+                        CHECK(got_on_board==on_board);
+                    }
+                }
+                CHECK(SyncBytes()==BackgroundBytes());
+                int64_t before=SyncBytes();
+                int64_t retained=0;
+                for(uint32_t ago=1;ago<=archived;ago++) retained+=footprint[id-ago];
+                footprint.push_back(before-retained);
+                CHECK(sync.Rollover()==id+1);
+                CHECK(windows.Rollover()==id+1);
+                windows.DrainReclaimer();
+                CHECK(SyncBytes()==BackgroundBytes());
+                //超出保留数时最老的窗口被换掉，它占的字节全部还回去
+                int64_t expired=id>=config.keep?footprint[id-config.keep]:0;
+                CHECK(BackgroundBytes()==before+fresh-expired);
+                refs.emplace_back(new List(config.max_len,1));
+            }
+        }
+        CHECK(SyncBytes()==0);
+        CHECK(BackgroundBytes()==0);
+    }
+}
+
+}
+
+int main(){
+    TestFlatHashMap();
+    TestBuild();
+    TestUpdate();
+    TestApplyBatch();
+    TestBTree();
+    TestSharded();
+    TestChangeLog();
+    TestCompact();
+    TestSnapshot();
+    TestWindowed();
+    if(failures){
+        std::cout<<failures<<" checks failed"<<std::endl;
+        return 1;
+    }
+    std::cout<<"ok"<<std::endl;
+    return 0;
+}
@@ -0,0 +1,198 @@
+//
+// Created by zhangshiping on 26-10-17.
+//
+
+#ifndef GAMETOOLS_WINDOWED_RANK_LIST_H
+#define GAMETOOLS_WINDOWED_RANK_LIST_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "skip_list.h"
+
+namespace GameTools{
+
+///后台释放线程：把要销毁的对象交给它，在自己的线程里析构，调用方不等待
+template<class T>
+class BackgroundReclaimer{
+public:
+    BackgroundReclaimer():thread_([this]{ run(); }){}
+    ~BackgroundReclaimer(){
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_=true;
+        }
+        cond_.notify_one();
+        thread_.join();
+    }
+    BackgroundReclaimer(const BackgroundReclaimer&)=delete;
+    BackgroundReclaimer& operator=(const BackgroundReclaimer&)=delete;
+
+    /// 交给后台线程析构
+    void Retire(std::unique_ptr<T> object){
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.push_back(std::move(object));
+        }
+        cond_.notify_one();
+    }
+    /// 等待已交出的对象全部析构完
+    void Drain(){
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_cond_.wait(lock,[this]{ return pending_.empty()&&!busy_; });
+    }
+
+private:
+    void run(){
+        std::unique_lock<std::mutex> lock(mutex_);
+        while(true){
+            cond_.wait(lock,[this]{ return stop_||!pending_.empty(); });
+            if(pending_.empty()&&stop_) return;
+            std::vector<std::unique_ptr<T>> batch;
+            batch.swap(pending_);
+            busy_=true;
+            lock.unlock();
+            batch.clear();//在锁外析构
+            lock.lock();
+            busy_=false;
+            if(pending_.empty()) idle_cond_.notify_all();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::condition_variable idle_cond_;
+    std::vector<std::unique_ptr<T>> pending_;
+    bool stop_=false;
+    bool busy_=false;
+    //最后声明，其他成员初始化完再启动线程
+    std::thread thread_;
+};
+
+///按时间窗口(日榜/周榜/赛季榜)滚动的排行榜：当前窗口是一个RankSkipList，另外保留最近若干个归档窗口
+///  Rollover把一个新的空跳表换成当前窗口，O(1)；旧窗口进入归档，超出保留数的最老窗口整体交给后台线程析构，
+///  节点内存随跳表的arena整块释放，不在调用线程上逐个删除节点和rank_map_
+///  本身不是线程安全的，和RankSkipList一样在一个线程里使用
+template<class K,class V,class H=std::hash<V>,class P=SkipListPolicy<>>
+class WindowedRankList{
+public:
+    using List=RankSkipList<K,V,H,P>;
+private:
+    std::unique_ptr<List> current_;
+    //归档窗口，archive_[0]是上一个窗口
+    std::deque<std::unique_ptr<List>> archive_;
+    uint32_t keep_archived_=0;
+    uint64_t max_len_=0;
+    uint64_t seed_=0;
+    //当前窗口的序号，从0开始，每次Rollover加1
+    uint64_t window_id_=0;
+    //为nullptr时在调用线程上析构
+    std::unique_ptr<BackgroundReclaimer<List>> reclaimer_;
+
+    std::unique_ptr<List> newList() const{
+        return std::unique_ptr<List>(new List(max_len_,seed_?seed_+window_id_:0));
+    }
+
+public:
+    ///
+    /// \param keep_archived 保留的归档窗口数
+    /// \param max_len 每个窗口的最大长度
+    /// \param seed 随机层数种子，第i个窗口用seed+i；0表示用random_device取
+    /// \param background_free 是否用后台线程释放过期窗口
+    WindowedRankList(uint32_t keep_archived=0,uint64_t max_len=0,uint64_t seed=0,bool background_free=true)
+            : keep_archived_(keep_archived), max_len_(max_len), seed_(seed)
+    {
+        if(background_free) reclaimer_.reset(new BackgroundReclaimer<List>());
+        current_=newList();
+    }
+    ~WindowedRankList(){
+        //先析构窗口，再停后台线程
+        current_.reset();
+        archive_.clear();
+    }
+    WindowedRankList(const WindowedRankList&)=delete;
+    WindowedRankList& operator=(const WindowedRankList&)=delete;
+
+    /// 当前窗口
+    List& Current(){
+        return *current_;
+    }
+    /// 往前数第ago个归档窗口，ago=1是上一个窗口，不存在时为nullptr
+    List* Archived(uint32_t ago){
+        if(ago==0||ago>archive_.size()) return nullptr;
+        return archive_[ago-1].get();
+    }
+    /// 当前保留的归档窗口数
+    uint32_t ArchivedCount() const{
+        return static_cast<uint32_t>(archive_.size());
+    }
+    /// 当前窗口序号
+    uint64_t WindowId() const{
+        return window_id_;
+    }
+    /// 切换到新窗口：当前窗口归档，超出保留数的窗口交给后台线程释放
+    /// \return 新窗口序号
+    uint64_t Rollover(){
+        window_id_++;
+        std::unique_ptr<List> fresh=newList();
+        archive_.push_front(std::move(current_));
+        current_=std::move(fresh);
+        while(archive_.size()>keep_archived_){
+            std::unique_ptr<List> expired=std::move(archive_.back());
+            archive_.pop_back();
+            if(reclaimer_) reclaimer_->Retire(std::move(expired));
+        }
+        return window_id_;
+    }
+    /// 等待后台线程把过期窗口全部释放完
+    void DrainReclaimer(){
+        if(reclaimer_) reclaimer_->Drain();
+    }
+    /// 写入当前窗口
+    SkipListNode<K,V>* InsertOrUpdate(K key,V val){
+        return current_->InsertOrUpdate(key,val);
+    }
+    bool DeleteNode(V val){
+        return current_->DeleteNode(val);
+    }
+    /// 当前窗口中的排名
+    int64_t Rank(const V& val){
+        return current_->Rank(val);
+    }
+    /// 最近windows个窗口(含当前窗口)中val的最好排名
+    /// \return 排名，都不在榜上时为-1
+    int64_t BestRank(const V& val,uint32_t windows){
+        int64_t best=-1;
+        for(uint32_t ago=0;ago<windows;ago++){
+            List* list=ago==0?current_.get():Archived(ago);
+            if(list== nullptr) break;
+            int64_t rank=list->Rank(val);
+            if(rank>0&&(best<0||rank<best)) best=rank;
+        }
+        return best;
+    }
+    /// 最近windows个窗口(含当前窗口)中val的key之和，没有上榜的窗口不计
+    /// \param windows_on_board 输出，上榜的窗口数
+    K SumKey(const V& val,uint32_t windows,uint32_t& windows_on_board){
+        K sum=K();
+        windows_on_board=0;
+        for(uint32_t ago=0;ago<windows;ago++){
+            List* list=ago==0?current_.get():Archived(ago);
+            if(list== nullptr) break;
+            if(K* key=list->getKey(val)){
+                sum=sum+*key;
+                windows_on_board++;
+            }
+        }
+        return sum;
+    }
+};
+
+}
+
+#endif //GAMETOOLS_WINDOWED_RANK_LIST_H